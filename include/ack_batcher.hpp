@@ -0,0 +1,105 @@
+#ifndef ACK_BATCHER_HPP
+#define ACK_BATCHER_HPP
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+
+#include <cstdint>
+
+#include "utility.hpp"
+
+/**
+ * @brief 受信した通知 id をまとめて累積 ack として送るクラス
+ *
+ * 1 通知ごとに ack を送るのではなく、件数 (`maxPending`) か経過時間
+ * (`interval`) のどちらかに達したときに「ここまで受信済み」を 1 回だけ送る。
+ * `Subscription` と `PollingSubscription` のどちらにも使えるよう、
+ * `ackRequest()` を持つ Client 型でテンプレート化している。
+ *
+ * @tparam SubscriptionClient `ackRequest()` を持つ capability の Client 型
+ */
+template <typename SubscriptionClient>
+class CumulativeAckBatcher {
+ public:
+  /**
+   * @brief コンストラクタ
+   *
+   * @param subscription ack の送信先
+   * @param timer        間隔 flush 用のタイマー
+   * @param taskSet      送信タスクを管理する TaskSet
+   * @param maxPending   この件数たまったら即座に ack する
+   * @param interval     最初の未 ack からこの時間で ack する
+   */
+  CumulativeAckBatcher(SubscriptionClient subscription, kj::Timer& timer,
+                       kj::TaskSet& taskSet, uint32_t maxPending = 64,
+                       kj::Duration interval = 200 * kj::MILLISECONDS)
+      : subscription(kj::mv(subscription)),
+        timer(timer),
+        taskSet(taskSet),
+        maxPending(maxPending),
+        interval(interval) {}
+
+  /**
+   * @brief 通知を受信（処理完了）したことを記録する
+   *
+   * @param id 受信した通知の id
+   */
+  void received(uint64_t id) {
+    if (hasReceived && id <= highestId) return;
+    highestId = id;
+    hasReceived = true;
+    ++pending;
+
+    if (pending >= maxPending) {
+      flush();
+    } else if (!timerArmed) {
+      // 最初の未 ack から interval 後に flush する
+      timerArmed = true;
+      taskSet.add(canceler.wrap(timer.afterDelay(interval))
+                      .then([this]() {
+                        timerArmed = false;
+                        flush();
+                      })
+                      .catch_([](kj::Exception&&) {
+                        // flush() で先に送った場合はここでキャンセルされる
+                      }));
+    }
+  }
+
+  /**
+   * @brief 未送信の ack を直ちに送る
+   */
+  void flush() {
+    if (pending == 0) return;
+    canceler.cancel("ack flushed");
+    timerArmed = false;
+    pending = 0;
+    ++acksSent;
+
+    auto req = subscription.ackRequest();
+    req.setUpToId(highestId);
+    taskSet.add(req.send().ignoreResult().catch_([](kj::Exception&& e) {
+      LOG_COUT << "[Ack] failed to send ack: " << e.getDescription().cStr()
+               << std::endl;
+    }));
+  }
+
+  /// @brief これまでに送った ack の数
+  uint64_t getAcksSent() const { return acksSent; }
+
+ private:
+  SubscriptionClient subscription;
+  kj::Timer& timer;
+  kj::TaskSet& taskSet;
+  kj::Canceler canceler;
+  uint32_t maxPending;
+  kj::Duration interval;
+
+  uint64_t highestId = 0;
+  bool hasReceived = false;
+  uint32_t pending = 0;
+  bool timerArmed = false;
+  uint64_t acksSent = 0;
+};
+
+#endif  // ACK_BATCHER_HPP
@@ -0,0 +1,231 @@
+#ifndef BLOB_CACHE_HPP
+#define BLOB_CACHE_HPP
+
+#include <kj/async.h>
+#include <kj/debug.h>
+
+#include <blob_store.hpp>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <notification_store.hpp>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "notification.capnp.h"
+
+/**
+ * @brief ハッシュで引くペイロードの中身の LRU キャッシュ
+ * @details 中身の合計バイト数が capacity を超えると、最も長く使われて
+ * いないものから捨てる
+ */
+class BlobCache {
+ public:
+  using Bytes = std::shared_ptr<const std::vector<uint8_t>>;
+
+  explicit BlobCache(size_t capacity = 16 << 20) : capacity(capacity) {}
+
+  /**
+   * @brief 中身を引き、最近使ったものとして扱う
+   *
+   * @param hash ハッシュ
+   * @return Bytes なければ nullptr
+   */
+  Bytes find(const BlobHash& hash) {
+    auto it = index.find(hash);
+    if (it == index.end()) return nullptr;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+  }
+
+  /**
+   * @brief 中身を入れる（既にあれば最近使ったものとして扱う）
+   *
+   * @param hash  ハッシュ
+   * @param bytes 中身
+   */
+  void put(const BlobHash& hash, Bytes bytes) {
+    if (find(hash) != nullptr) return;
+    if (bytes->size() > capacity) return;
+    used += bytes->size();
+    lru.emplace_front(hash, std::move(bytes));
+    index.emplace(hash, lru.begin());
+    while (used > capacity) {
+      used -= lru.back().second->size();
+      index.erase(lru.back().first);
+      lru.pop_back();
+    }
+  }
+
+  size_t size() const { return lru.size(); }
+  size_t bytes() const { return used; }
+
+ private:
+  using Entry = std::pair<BlobHash, Bytes>;
+
+  size_t capacity;
+  size_t used = 0;
+  std::list<Entry> lru;  ///< 最近使った順
+  std::unordered_map<BlobHash, std::list<Entry>::iterator, BlobHashHasher>
+      index;
+};
+
+/**
+ * @brief payloadBlob で受け取った通知を、中身を戻した通知にする
+ *
+ * 中身は BlobCache から引き、なければ getBlob で取得する。同じハッシュの
+ * 取得が重なったときは 1 回だけ送り、応答を待っている全員に渡す。
+ * 大きな中身は fetch_bytes ずつ分けて取得し、1 つの大きな応答で同じ
+ * 接続の他の通知を待たせない。
+ * ハッシュで送られるのはサーバーが前にも送った中身なので、そのままの
+ * ペイロードで届いた大きな中身も observe() でキャッシュに入れておく。
+ * ただしキャッシュに入れるのはサーバーが登録済みと印を付けた中身
+ * （payloadRegistered）だけ。ハッシュは暗号学的ではないので、印のない
+ * 中身を入れると、同じハッシュの別の中身を仕込まれたときに、後で
+ * ハッシュで届いた通知を誤った中身で戻してしまう。
+ */
+class BlobResolver final : private kj::TaskSet::ErrorHandler {
+ public:
+  /**
+   * @param capacity    キャッシュする中身の合計の上限
+   * @param min_bytes   これより短い中身はキャッシュしない
+   * @param fetch_bytes getBlob 1 回で取得する最大バイト数（0 なら一度に）
+   */
+  explicit BlobResolver(size_t capacity = 16 << 20,
+                        size_t min_bytes = kDefaultBlobMinBytes,
+                        uint32_t fetch_bytes = 64 << 10)
+      : cache(capacity), min_bytes(min_bytes), fetch_bytes(fetch_bytes) {}
+
+  /**
+   * @brief そのままのペイロードで届いた大きな中身をキャッシュに入れる
+   * @details payloadRegistered でない中身は入れない
+   *
+   * @param notification 中身を戻した通知
+   */
+  void observe(Notification::Reader notification) {
+    const auto payload = notification.getPayload();
+    if (!notification.getPayloadRegistered() || payload.size() < min_bytes) {
+      return;
+    }
+    cache.put(hashBlob(payload), std::make_shared<const std::vector<uint8_t>>(
+                                     payload.begin(), payload.end()));
+  }
+
+  /**
+   * @brief キャッシュにある中身で通知を戻す
+   *
+   * @param notification payloadBlob の通知
+   * @return kj::Maybe<...> キャッシュになければ kj::none
+   */
+  kj::Maybe<kj::Own<const RetainedNotification>> resolveCached(
+      Notification::Reader notification) {
+    auto bytes = cache.find(hashOf(notification));
+    if (bytes == nullptr) return kj::none;
+    ++hits;
+    return RetainedNotification::withPayload(
+        notification, kj::arrayPtr(bytes->data(), bytes->size()));
+  }
+
+  /**
+   * @brief getBlob で中身を取得して通知を戻す
+   *
+   * @param notifier     取得先
+   * @param notification payloadBlob の通知
+   * @return kj::Promise<...> 中身を戻した通知
+   */
+  kj::Promise<kj::Own<const RetainedNotification>> fetch(
+      PollingNotifier::Client& notifier,
+      kj::Own<const RetainedNotification> notification) {
+    ++misses;
+    return fetchBytes(notifier, hashOf(notification->get()))
+        .then([n = kj::mv(notification)](BlobCache::Bytes bytes) {
+          return RetainedNotification::withPayload(
+              n->get(), kj::arrayPtr(bytes->data(), bytes->size()));
+        });
+  }
+
+  uint64_t getHits() const { return hits; }
+  uint64_t getMisses() const { return misses; }
+
+ private:
+  static BlobHash hashOf(Notification::Reader notification) {
+    const auto payload = notification.getPayload();
+    KJ_REQUIRE(payload.size() == sizeof(BlobHash), "invalid blob hash",
+               payload.size());
+    BlobHash hash;
+    std::memcpy(hash.data(), payload.begin(), hash.size());
+    return hash;
+  }
+
+  kj::Promise<BlobCache::Bytes> fetchBytes(PollingNotifier::Client& notifier,
+                                           const BlobHash& hash) {
+    auto paf = kj::newPromiseAndFulfiller<BlobCache::Bytes>();
+    auto [it, first] = pending.try_emplace(hash);
+    it->second.push_back(kj::mv(paf.fulfiller));
+    if (!first) return kj::mv(paf.promise);
+
+    tasks.add(download(notifier, hash)
+                  .then([this, hash](BlobCache::Bytes bytes) {
+                    cache.put(hash, bytes);
+                    for (auto& waiter : take(hash)) {
+                      waiter->fulfill(kj::cp(bytes));
+                    }
+                  })
+                  .catch_([this, hash](kj::Exception&& e) {
+                    for (auto& waiter : take(hash)) waiter->reject(kj::cp(e));
+                  }));
+    return kj::mv(paf.promise);
+  }
+
+  /// @brief getBlob を fetch_bytes ずつ繰り返して中身全体を取得する
+  kj::Promise<BlobCache::Bytes> download(PollingNotifier::Client notifier,
+                                         BlobHash hash) {
+    std::vector<uint8_t> bytes;
+    uint64_t size = 0;
+    do {
+      auto req = notifier.getBlobRequest();
+      req.setHash(kj::arrayPtr(hash.data(), hash.size()));
+      req.setOffset(bytes.size());
+      req.setMaxBytes(fetch_bytes);
+      auto response = co_await req.send();
+      const auto data = response.getData();
+      size = response.getSize();
+      KJ_REQUIRE(data.size() > 0 || bytes.size() == size,
+                 "blob fetch made no progress", bytes.size(), size);
+      KJ_REQUIRE(bytes.size() + data.size() <= size, "blob larger than size",
+                 bytes.size(), data.size(), size);
+      if (bytes.empty()) bytes.reserve(size);
+      bytes.insert(bytes.end(), data.begin(), data.end());
+    } while (bytes.size() < size);
+    KJ_REQUIRE(hashBlob(kj::arrayPtr(bytes.data(), bytes.size())) == hash,
+               "blob hash mismatch");
+    co_return std::make_shared<const std::vector<uint8_t>>(std::move(bytes));
+  }
+
+  /// @brief hash の取得を待っている全員を取り出す
+  std::vector<kj::Own<kj::PromiseFulfiller<BlobCache::Bytes>>> take(
+      const BlobHash& hash) {
+    auto node = pending.extract(hash);
+    if (node.empty()) return {};
+    return std::move(node.mapped());
+  }
+
+  void taskFailed(kj::Exception&&) override {
+    // 失敗は待っている呼び出しへ渡し済み
+  }
+
+  BlobCache cache;
+  size_t min_bytes;
+  uint32_t fetch_bytes;
+  std::unordered_map<
+      BlobHash, std::vector<kj::Own<kj::PromiseFulfiller<BlobCache::Bytes>>>,
+      BlobHashHasher>
+      pending;  ///< 取得中のハッシュと、応答を待っている呼び出し
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  kj::TaskSet tasks{*this};
+};
+
+#endif  // BLOB_CACHE_HPP
@@ -0,0 +1,155 @@
+#ifndef BLOB_STORE_HPP
+#define BLOB_STORE_HPP
+
+#include <kj/common.h>
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "notification.capnp.h"
+
+/// ペイロードの中身のハッシュ（blobHashBytes バイト）
+using BlobHash = std::array<uint8_t, 16>;
+static_assert(sizeof(BlobHash) == BLOB_HASH_BYTES);
+
+/// これより短いペイロードはハッシュで送らない（往復の方が高くつく）
+constexpr size_t kDefaultBlobMinBytes = 256;
+
+/**
+ * @brief ペイロードの中身の 128 bit ハッシュ
+ * @details 8 バイトずつ 2 系統で混ぜ、最後に murmur3 の fmix64 で
+ * 拡散する。暗号学的ハッシュではないので、意図的な衝突は防げない。
+ * サーバーは BlobStore への登録時に中身を比べ、衝突したものは
+ * ハッシュで送らない
+ *
+ * @param bytes ペイロード
+ * @return BlobHash ハッシュ
+ */
+inline BlobHash hashBlob(kj::ArrayPtr<const kj::byte> bytes) {
+  constexpr uint64_t kP1 = 0x9E3779B185EBCA87ULL;
+  constexpr uint64_t kP2 = 0xC2B2AE3D27D4EB4FULL;
+  auto fmix = [](uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    return h ^ (h >> 33);
+  };
+
+  const size_t n = bytes.size();
+  uint64_t h1 = 0x243F6A8885A308D3ULL ^ n;
+  uint64_t h2 = 0x13198A2E03707344ULL ^ (n * kP1);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    std::memcpy(&w, bytes.begin() + i, sizeof(w));
+    h1 = std::rotl(h1 ^ (w * kP1), 31) * kP2;
+    h2 = std::rotl(h2 ^ (w * kP2), 29) * kP1 + h1;
+  }
+  uint64_t tail = 0;
+  if (i < n) std::memcpy(&tail, bytes.begin() + i, n - i);
+  h1 = fmix(h1 ^ (tail * kP1));
+  h2 = fmix(h2 ^ (tail * kP2) ^ h1);
+  h1 += h2;
+
+  BlobHash hash;
+  std::memcpy(hash.data(), &h1, sizeof(h1));
+  std::memcpy(hash.data() + sizeof(h1), &h2, sizeof(h2));
+  return hash;
+}
+
+/// @brief BlobHash を unordered_map のキーにするためのハッシュ関数
+struct BlobHashHasher {
+  size_t operator()(const BlobHash& hash) const {
+    uint64_t v;
+    std::memcpy(&v, hash.data(), sizeof(v));
+    return static_cast<size_t>(v);
+  }
+};
+
+/**
+ * @brief 大きなペイロードの中身をハッシュで共有するサーバー側のストア
+ *
+ * 同じ中身のペイロードを 1 つにまとめ、ログのエントリから参照する。
+ * 中身を参照するエントリがログから捨てられると中身も解放されるので、
+ * getBlob で取得できるのはログに残っている通知の中身だけ。
+ */
+class BlobStore {
+ public:
+  /// 共有する中身
+  struct Blob {
+    BlobHash hash;
+    std::vector<uint8_t> bytes;
+  };
+
+  /// ログのエントリが持つ参照
+  struct Ref {
+    std::shared_ptr<const Blob> blob;  ///< 登録しなかったなら nullptr
+    bool repeated = false;  ///< 同じ中身を前にも登録していたか
+  };
+
+  explicit BlobStore(size_t min_bytes = kDefaultBlobMinBytes)
+      : min_bytes(min_bytes) {}
+
+  /**
+   * @brief ペイロードを登録する
+   * @details 短いペイロードと、ハッシュが同じで中身の違うペイロードは
+   * 登録しない。登録したら中身は Ref が持つので、payload は空にする
+   * （同じ中身を 2 か所に持たない）
+   *
+   * @param payload ペイロード（登録したら空になる）
+   * @return Ref 中身への参照
+   */
+  Ref put(std::vector<uint8_t>& payload) {
+    if (payload.size() < min_bytes) return {};
+    const auto hash = hashBlob(kj::arrayPtr(payload.data(), payload.size()));
+    auto& slot = blobs[hash];
+    if (auto blob = slot.lock()) {
+      if (blob->bytes != payload) return {};
+      std::vector<uint8_t>().swap(payload);
+      return {std::move(blob), true};
+    }
+    auto blob = std::make_shared<const Blob>(Blob{hash, std::move(payload)});
+    payload.clear();
+    slot = blob;
+    if (++puts_since_purge >= kPurgeEvery) purge();
+    return {std::move(blob), false};
+  }
+
+  /**
+   * @brief ハッシュから中身を引く
+   *
+   * @param hash blobHashBytes バイトのハッシュ
+   * @return std::shared_ptr<const Blob> 解放済み・未登録なら nullptr
+   */
+  std::shared_ptr<const Blob> find(kj::ArrayPtr<const kj::byte> hash) const {
+    if (hash.size() != sizeof(BlobHash)) return nullptr;
+    BlobHash key;
+    std::memcpy(key.data(), hash.begin(), key.size());
+    auto it = blobs.find(key);
+    return it == blobs.end() ? nullptr : it->second.lock();
+  }
+
+ private:
+  /// 解放済みの中身を表から外す間隔（登録の回数）
+  static constexpr size_t kPurgeEvery = 1024;
+
+  void purge() {
+    puts_since_purge = 0;
+    std::erase_if(blobs,
+                  [](const auto& slot) { return slot.second.expired(); });
+  }
+
+  size_t min_bytes;
+  std::unordered_map<BlobHash, std::weak_ptr<const Blob>, BlobHashHasher>
+      blobs;
+  size_t puts_since_purge = 0;
+};
+
+#endif  // BLOB_STORE_HPP
@@ -0,0 +1,136 @@
+#ifndef CHUNK_ASSEMBLER_HPP
+#define CHUNK_ASSEMBLER_HPP
+
+#include <kj/debug.h>
+#include <kj/time.h>
+
+#include <cstdint>
+#include <notification_store.hpp>
+#include <unordered_map>
+#include <vector>
+
+#include "notification.capnp.h"
+
+/**
+ * @brief onPayloadChunk で分けて届くペイロードを組み立てる
+ *
+ * payloadChunked の通知（ヘッダー）を begin() で登録し、断片を add() で
+ * 渡す。断片は offset の順に届くので、続きでない断片（再送で重複した
+ * もの）は捨てる。登録していない id の断片も捨てる。offset 0 の断片は
+ * 送り直しの始まりなので、途中まで組み立てた中身を捨ててやり直す。
+ * 送信が打ち切られて続きが届かなくなった通知は reclaim() で回収する。
+ */
+class ChunkAssembler {
+ public:
+  /**
+   * @param max_bytes 組み立て途中の中身の合計の上限
+   * @param stall     この時間断片が届かなければ打ち切られたとみなす
+   */
+  explicit ChunkAssembler(size_t max_bytes = 256 << 20,
+                          kj::Duration stall = 30 * kj::SECONDS)
+      : max_bytes(max_bytes), stall(stall) {}
+
+  /**
+   * @brief 中身が後から届く通知を登録する
+   *
+   * @param header payloadChunked が 0 でない通知
+   * @param now    現在時刻
+   * @return bool 登録したら true。上限を超えるなら登録せず false
+   */
+  bool begin(kj::Own<const RetainedNotification> header, kj::TimePoint now) {
+    const auto notification = header->get();
+    const auto total = notification.getPayloadChunked();
+    if (total == 0 || total > max_bytes - buffered) return false;
+    auto [it, inserted] = pending.try_emplace(notification.getId());
+    if (!inserted) return true;
+    it->second.header = kj::mv(header);
+    it->second.bytes.reserve(total);
+    it->second.progress = now;
+    buffered += total;
+    return true;
+  }
+
+  /**
+   * @brief 断片を受け取る
+   *
+   * @param id     通知の id
+   * @param offset 断片の位置
+   * @param data   断片
+   * @param now    現在時刻
+   * @return kj::Maybe<...> 中身がそろったら、中身を戻した通知
+   */
+  kj::Maybe<kj::Own<const RetainedNotification>> add(
+      uint64_t id, uint64_t offset, kj::ArrayPtr<const kj::byte> data,
+      kj::TimePoint now) {
+    auto it = pending.find(id);
+    if (it == pending.end()) return kj::none;
+    auto& entry = it->second;
+    if (offset == 0) entry.bytes.clear();  // 送り直し
+    if (offset != entry.bytes.size()) return kj::none;
+    entry.progress = now;
+    const auto total = entry.header->get().getPayloadChunked();
+    KJ_REQUIRE(data.size() <= total - offset, "chunk exceeds payload size",
+               id, offset, data.size(), total);
+    entry.bytes.insert(entry.bytes.end(), data.begin(), data.end());
+    if (entry.bytes.size() < total) return kj::none;
+
+    auto complete = RetainedNotification::withPayload(
+        entry.header->get(),
+        kj::arrayPtr(entry.bytes.data(), entry.bytes.size()));
+    buffered -= total;
+    pending.erase(it);
+    return kj::mv(complete);
+  }
+
+  /**
+   * @brief stall の間断片が届いていない通知を捨てる
+   *
+   * @param now 現在時刻
+   * @return std::vector<uint64_t> 捨てた通知の id
+   */
+  std::vector<uint64_t> reclaim(kj::TimePoint now) {
+    std::vector<uint64_t> reclaimed;
+    for (auto it = pending.begin(); it != pending.end();) {
+      if (now - it->second.progress < stall) {
+        ++it;
+        continue;
+      }
+      reclaimed.push_back(it->first);
+      buffered -= it->second.header->get().getPayloadChunked();
+      it = pending.erase(it);
+    }
+    return reclaimed;
+  }
+
+  /**
+   * @brief 組み立て途中の通知をやめる
+   * @details サーバーが分割をやめ、同じ通知を分けずに送り直したときに使う
+   *
+   * @param id 通知の id
+   * @return bool 組み立て途中だったら true
+   */
+  bool cancel(uint64_t id) {
+    auto it = pending.find(id);
+    if (it == pending.end()) return false;
+    buffered -= it->second.header->get().getPayloadChunked();
+    pending.erase(it);
+    return true;
+  }
+
+  /// @brief 組み立て途中の通知の数
+  size_t size() const { return pending.size(); }
+
+ private:
+  struct Pending {
+    kj::Own<const RetainedNotification> header;
+    std::vector<uint8_t> bytes;
+    kj::TimePoint progress = kj::origin<kj::TimePoint>();  ///< 最後の進捗
+  };
+
+  size_t max_bytes;
+  kj::Duration stall;
+  size_t buffered = 0;  ///< 組み立て途中の中身の合計（予定のバイト数）
+  std::unordered_map<uint64_t, Pending> pending;
+};
+
+#endif  // CHUNK_ASSEMBLER_HPP
@@ -0,0 +1,65 @@
+#ifndef CREDIT_REPLENISHER_HPP
+#define CREDIT_REPLENISHER_HPP
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+
+#include <cstdint>
+
+#include "notification.capnp.h"
+#include "utility.hpp"
+
+/**
+ * @brief クレジット方式のフロー制御で、消費した分をまとめて返却するクラス
+ *
+ * 購読時に `window` 個のクレジットをサーバーに渡しておき、通知を 1 件処理する
+ * ごとに `consumed()` を呼ぶ。消費数が `window / 2` に達した時点でまとめて
+ * `grantCredits` を送るため、返却の往復中もサーバー側には残り半分の
+ * クレジットがあり、高速な受信側でもパイプが途切れない。
+ */
+class CreditReplenisher {
+ public:
+  /**
+   * @brief コンストラクタ
+   *
+   * @param subscription クレジットの返却先
+   * @param taskSet      送信タスクを管理する TaskSet
+   * @param window       購読時に渡した初期クレジット数
+   */
+  CreditReplenisher(PollingSubscription::Client subscription,
+                    kj::TaskSet& taskSet, uint32_t window)
+      : subscription(kj::mv(subscription)),
+        taskSet(taskSet),
+        batch(window / 2 > 0 ? window / 2 : 1) {}
+
+  /**
+   * @brief 通知を 1 件消費したことを記録する
+   */
+  void consumed() {
+    if (++unreturned >= batch) {
+      flush();
+    }
+  }
+
+  /**
+   * @brief 消費済みのクレジットを直ちに返却する
+   */
+  void flush() {
+    if (unreturned == 0) return;
+    auto req = subscription.grantCreditsRequest();
+    req.setCredits(unreturned);
+    unreturned = 0;
+    taskSet.add(req.send().ignoreResult().catch_([](kj::Exception&& e) {
+      LOG_COUT << "[Credit] failed to grant credits: "
+               << e.getDescription().cStr() << std::endl;
+    }));
+  }
+
+ private:
+  PollingSubscription::Client subscription;
+  kj::TaskSet& taskSet;
+  uint32_t batch;           ///< この数たまったら返却する
+  uint32_t unreturned = 0;  ///< 消費したが未返却のクレジット
+};
+
+#endif  // CREDIT_REPLENISHER_HPP
@@ -0,0 +1,156 @@
+#ifndef DEDUP_WINDOW_HPP
+#define DEDUP_WINDOW_HPP
+
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+
+/**
+ * @brief 直近の通知 id を固定長のビットマップで覚えておく重複検出窓
+ *
+ * 受け取った最大の id から `Bits` 個前までの id について、受信済みかを
+ * 1 bit ずつ持つ。メモリは `Bits / 8` バイトで一定。1 件あたりの処理は、
+ * 窓を進める際のワード消去を含めても `Bits / 64` 回以下の定数時間。
+ *
+ * 窓より古い id は受信済みか判別できないため、重複とみなして捨てる
+ * （`getStale()` で数える）。
+ *
+ * @tparam Bits 窓の大きさ（64 の倍数）
+ */
+template <uint32_t Bits = 4096>
+class DedupWindow {
+  static_assert(Bits % 64 == 0, "Bits must be a multiple of 64");
+
+ public:
+  /**
+   * @brief id を記録し、初めて受け取ったかを返す
+   *
+   * @param id 受信した通知の id
+   * @return bool 初めてなら true、重複（または窓より古い）なら false
+   */
+  bool accept(uint64_t id) {
+    if (!started) {
+      started = true;
+      highest = id;
+      set(id);
+      return true;
+    }
+    if (id > highest) {
+      advance(id);
+      set(id);
+      return true;
+    }
+    if (highest - id >= Bits) {
+      ++stale;
+      return false;
+    }
+    if (test(id)) {
+      ++duplicates;
+      return false;
+    }
+    set(id);
+    return true;
+  }
+
+  /**
+   * @brief 窓を空にする
+   * @details id の系列が変わった（サーバーが再起動して id を振り直した）
+   * ときに呼ぶ。統計は残す
+   */
+  void reset() {
+    words.fill(0);
+    highest = 0;
+    started = false;
+  }
+
+  /// @brief これまでに受け取った最大の id
+  uint64_t getHighest() const { return highest; }
+
+  /// @brief 窓の中で見つかった重複の数
+  uint64_t getDuplicates() const { return duplicates; }
+
+  /// @brief 窓より古いために捨てた数
+  uint64_t getStale() const { return stale; }
+
+ private:
+  static constexpr uint32_t kWords = Bits / 64;
+
+  /// @brief 最大の id を id まで進め、窓から外れた範囲のビットを消す
+  void advance(uint64_t id) {
+    if (id - highest >= Bits) {
+      words.fill(0);
+    } else {
+      for (auto i = highest + 1; i <= id;) {
+        // ワード境界に揃っていればワード単位で消す
+        if (i % 64 == 0 && id - i >= 63) {
+          words[(i / 64) % kWords] = 0;
+          i += 64;
+        } else {
+          words[(i / 64) % kWords] &= ~(uint64_t{1} << (i % 64));
+          ++i;
+        }
+      }
+    }
+    highest = id;
+  }
+
+  bool test(uint64_t id) const {
+    return (words[(id / 64) % kWords] >> (id % 64)) & 1;
+  }
+
+  void set(uint64_t id) {
+    words[(id / 64) % kWords] |= uint64_t{1} << (id % 64);
+  }
+
+  std::array<uint64_t, kWords> words{};
+  uint64_t highest = 0;
+  bool started = false;
+  uint64_t duplicates = 0;
+  uint64_t stale = 0;
+};
+
+/**
+ * @brief 送信元ごとに DedupWindow を持つ重複フィルタ
+ * @details 送信元（サーバーや kind など、id の系列が独立した単位）ごとに
+ * 窓を分ける。窓 1 つのメモリは一定で、送信元の数に比例して増える。
+ *
+ * @tparam Source 送信元を表すキーの型
+ * @tparam Bits   窓の大きさ
+ */
+template <typename Source, uint32_t Bits = 4096>
+class DedupFilter {
+ public:
+  /**
+   * @brief 送信元 source からの id を記録し、初めて受け取ったかを返す
+   */
+  bool accept(const Source& source, uint64_t id) {
+    if (windows[source].accept(id)) {
+      ++accepted;
+      return true;
+    }
+    return false;
+  }
+
+  /// @brief 通した通知の数
+  uint64_t getAccepted() const { return accepted; }
+
+  /// @brief 全送信元で捨てた重複の数（窓より古いものを含む）
+  uint64_t getDropped() const {
+    uint64_t total = 0;
+    for (const auto& [source, window] : windows) {
+      total += window.getDuplicates() + window.getStale();
+    }
+    return total;
+  }
+
+  /// @brief 送信元ごとの窓（カウンタの参照用）
+  const std::unordered_map<Source, DedupWindow<Bits>>& getWindows() const {
+    return windows;
+  }
+
+ private:
+  std::unordered_map<Source, DedupWindow<Bits>> windows;
+  uint64_t accepted = 0;
+};
+
+#endif  // DEDUP_WINDOW_HPP
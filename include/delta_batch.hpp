@@ -0,0 +1,248 @@
+#ifndef DELTA_BATCH_HPP
+#define DELTA_BATCH_HPP
+
+#include <kj/common.h>
+#include <kj/debug.h>
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "notification.capnp.h"
+
+/**
+ * @brief DeltaColumn の符号化と復号
+ *
+ * 2 件目以降の値を直前との差の zigzag 符号で表し、全件を最大の差が収まる
+ * 同じビット数で詰める。連番の id なら 1 件 1 bit、一定間隔の timestamp
+ * なら数 bit になる。
+ *
+ * 差分は 4 レーンの縦型に詰める（schema の DeltaColumn を参照）。
+ * 復号では 4 レーンが同じワード位置・シフト量になるので、SSE2 が使える
+ * 環境では 4 件ずつ 128 bit のロード・シフト・マスクで取り出す。
+ * 差分から値へ戻す累積和は前の値に依存するため逐次に行う。
+ *
+ * words はリトルエンディアンのホストでそのまま読み書きする。
+ */
+class DeltaColumnCodec {
+ public:
+  static constexpr uint32_t kLanes = 4;
+
+  /**
+   * @brief 値の列を符号化する
+   * @details 差が 32 bit（zigzag 後）に収まらなければ何も書かずに false を
+   * 返す。その場合は呼び出し側で通常の形式にフォールバックする
+   *
+   * @param column 書き込み先
+   * @param values 値の列
+   * @return bool 符号化できたか
+   */
+  static bool encode(DeltaColumn::Builder column,
+                     const std::vector<uint64_t>& values) {
+    if (values.empty()) return true;
+    const size_t n = values.size() - 1;
+    std::vector<uint32_t> deltas(n);
+    uint32_t all = 0;
+    for (size_t j = 0; j < n; ++j) {
+      const auto d =
+          zigzag(static_cast<int64_t>(values[j + 1] - values[j]));
+      if (d > UINT32_MAX) return false;
+      deltas[j] = static_cast<uint32_t>(d);
+      all |= deltas[j];
+    }
+    const auto bits = static_cast<uint32_t>(std::bit_width(all));
+
+    column.setFirst(values[0]);
+    column.setBits(static_cast<uint8_t>(bits));
+    if (bits == 0) return true;
+
+    const size_t lane_words = laneWords(n, bits);
+    std::vector<uint32_t> words(lane_words * kLanes, 0);
+    for (size_t j = 0; j < n; ++j) {
+      const size_t lane = j % kLanes;
+      const size_t pos = (j / kLanes) * bits;
+      const size_t k = pos / 32;
+      const uint32_t shift = pos % 32;
+      words[k * kLanes + lane] |= deltas[j] << shift;
+      if (shift + bits > 32) {
+        words[(k + 1) * kLanes + lane] |= deltas[j] >> (32 - shift);
+      }
+    }
+    column.setWords(kj::arrayPtr(
+        reinterpret_cast<const kj::byte*>(words.data()), words.size() * 4));
+    return true;
+  }
+
+  /**
+   * @brief 列を復号する
+   *
+   * @param column 受信した列
+   * @param count  値の数（DeltaBatch.count）
+   * @param out    count 件を書き込む先
+   */
+  static void decode(DeltaColumn::Reader column, uint32_t count,
+                     uint64_t* out) {
+    if (count == 0) return;
+    const uint32_t bits = column.getBits();
+    KJ_REQUIRE(bits <= 32, "invalid delta width", bits);
+    const size_t n = count - 1;
+    const size_t slots = (n + kLanes - 1) / kLanes;
+    // 4 件単位で書き込むので、端数の分も確保しておく
+    std::vector<uint32_t> deltas(slots * kLanes, 0);
+    if (bits > 0) {
+      const auto words = column.getWords();
+      KJ_REQUIRE(words.size() >= laneWords(n, bits) * kLanes * 4,
+                 "truncated delta column", words.size());
+      unpack(words.begin(), bits, slots, deltas.data());
+    }
+
+    uint64_t value = column.getFirst();
+    out[0] = value;
+    for (size_t j = 0; j < n; ++j) {
+      value += static_cast<uint64_t>(unzigzag(deltas[j]));
+      out[j + 1] = value;
+    }
+  }
+
+ private:
+  static uint64_t zigzag(int64_t v) {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+  }
+
+  static int64_t unzigzag(uint64_t v) {
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+  }
+
+  /// @brief n 件の差分を bits ビットで詰めたときの 1 レーンのワード数
+  static size_t laneWords(size_t n, uint32_t bits) {
+    const size_t slots = (n + kLanes - 1) / kLanes;
+    return (slots * bits + 31) / 32;
+  }
+
+  /**
+   * @brief 縦型に詰めた差分を 4 件ずつ取り出す
+   *
+   * @param words 詰めた差分
+   * @param bits  1 件のビット数（1..32）
+   * @param slots 1 レーンの件数
+   * @param out   slots * 4 件の書き込み先
+   */
+  static void unpack(const kj::byte* words, uint32_t bits, size_t slots,
+                     uint32_t* out) {
+    const uint32_t mask =
+        bits == 32 ? UINT32_MAX : (uint32_t{1} << bits) - 1;
+#if defined(__SSE2__)
+    const __m128i vmask = _mm_set1_epi32(static_cast<int>(mask));
+    for (size_t s = 0; s < slots; ++s) {
+      const size_t pos = s * bits;
+      const size_t k = pos / 32;
+      const uint32_t shift = pos % 32;
+      __m128i v = _mm_srl_epi32(
+          _mm_loadu_si128(
+              reinterpret_cast<const __m128i*>(words + k * kLanes * 4)),
+          _mm_cvtsi32_si128(static_cast<int>(shift)));
+      if (shift + bits > 32) {
+        const __m128i next = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(words + (k + 1) * kLanes * 4));
+        v = _mm_or_si128(
+            v, _mm_sll_epi32(next,
+                             _mm_cvtsi32_si128(static_cast<int>(32 - shift))));
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + s * kLanes),
+                       _mm_and_si128(v, vmask));
+    }
+#else
+    for (size_t s = 0; s < slots; ++s) {
+      const size_t pos = s * bits;
+      const size_t k = pos / 32;
+      const uint32_t shift = pos % 32;
+      uint32_t low[kLanes];
+      std::memcpy(low, words + k * kLanes * 4, sizeof(low));
+      uint32_t high[kLanes] = {0, 0, 0, 0};
+      if (shift + bits > 32) {
+        std::memcpy(high, words + (k + 1) * kLanes * 4, sizeof(high));
+      }
+      for (uint32_t lane = 0; lane < kLanes; ++lane) {
+        uint32_t v = low[lane] >> shift;
+        if (shift + bits > 32) v |= high[lane] << (32 - shift);
+        out[s * kLanes + lane] = v & mask;
+      }
+    }
+#endif
+  }
+};
+
+/**
+ * @brief 受信した DeltaBatch の件数を列の長さと照らし合わせる
+ * @details count は相手が送ってきた値なので、列の長さ（実際に届いた
+ * データ）と一致しない限り、その件数のリストを確保してはならない
+ *
+ * @param batch 受信したバッチ
+ * @return uint32_t 検証済みの件数
+ */
+inline uint32_t validateDeltaBatch(DeltaBatch::Reader batch) {
+  const auto count = batch.getCount();
+  KJ_REQUIRE(batch.getKindIds().size() == count &&
+                 batch.getFilterIndexes().size() == count,
+             "malformed delta batch", count);
+  const auto payloads = batch.getPayloads().size();
+  const auto dictionaries = batch.getPayloadDictionaries().size();
+  const auto blobs = batch.getPayloadBlobs().size();
+  const auto chunked = batch.getPayloadChunked().size();
+  const auto registered = batch.getPayloadRegistered().size();
+  KJ_REQUIRE(payloads == 0 || payloads == count, "malformed delta batch");
+  KJ_REQUIRE(dictionaries == 0 || dictionaries == count,
+             "malformed delta batch");
+  KJ_REQUIRE(blobs == 0 || blobs == count, "malformed delta batch");
+  KJ_REQUIRE(chunked == 0 || chunked == count, "malformed delta batch");
+  KJ_REQUIRE(registered == 0 || registered == count, "malformed delta batch");
+  return count;
+}
+
+/**
+ * @brief DeltaBatch を Notification のリストに戻す
+ * @details kind は番号（kindId）のまま。KindDictionary で文字列に戻せる
+ *
+ * @param batch 受信したバッチ
+ * @param list  validateDeltaBatch(batch) 件のリスト
+ */
+inline void expandDeltaBatch(DeltaBatch::Reader batch,
+                             capnp::List<Notification>::Builder list) {
+  const auto count = validateDeltaBatch(batch);
+  KJ_REQUIRE(list.size() == count, "list size mismatch", list.size(), count);
+  const auto kind_ids = batch.getKindIds();
+  const auto filters = batch.getFilterIndexes();
+  const auto payloads = batch.getPayloads();
+  const auto dictionaries = batch.getPayloadDictionaries();
+  const auto blobs = batch.getPayloadBlobs();
+  const auto chunked = batch.getPayloadChunked();
+  const auto registered = batch.getPayloadRegistered();
+
+  std::vector<uint64_t> ids(count), timestamps(count), kind_seqs(count);
+  DeltaColumnCodec::decode(batch.getIds(), count, ids.data());
+  DeltaColumnCodec::decode(batch.getTimestamps(), count, timestamps.data());
+  DeltaColumnCodec::decode(batch.getKindSeqs(), count, kind_seqs.data());
+
+  for (uint32_t i = 0; i < count; ++i) {
+    auto n = list[i];
+    n.setId(ids[i]);
+    n.setTimestamp(static_cast<int64_t>(timestamps[i]));
+    n.setKindSeq(kind_seqs[i]);
+    n.setKindId(kind_ids[i]);
+    n.setFilterIndex(filters[i]);
+    if (payloads.size() > 0 && payloads[i].size() > 0) {
+      n.setPayload(payloads[i]);
+    }
+    if (dictionaries.size() > 0) n.setPayloadDictionary(dictionaries[i]);
+    if (blobs.size() > 0) n.setPayloadBlob(blobs[i]);
+    if (chunked.size() > 0) n.setPayloadChunked(chunked[i]);
+    if (registered.size() > 0) n.setPayloadRegistered(registered[i]);
+  }
+}
+
+#endif  // DELTA_BATCH_HPP
@@ -0,0 +1,71 @@
+#ifndef GAP_DETECTOR_HPP
+#define GAP_DETECTOR_HPP
+
+#include <kj/common.h>
+#include <kj/string.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief kind ごとの連番 (kindSeq) から取りこぼしを検出するクラス
+ *
+ * kind ごとに次に来るはずの連番を覚えておき、それより先の連番が届いたら
+ * 間の範囲を Gap として返す。Gap は `PollingNotifier.replay` にそのまま
+ * 渡せるので、全体を取り直さずに欠けた範囲だけを再取得できる。
+ *
+ * フィルタで絞り込んでいても、連番は kind ごとなので見ていない kind の
+ * 通知で飛びが生じることはない。期待より小さい連番（再送や replay で
+ * 後から届いたもの）は何もしない。
+ */
+class GapDetector {
+ public:
+  /// 取りこぼした範囲（両端を含む）
+  struct Gap {
+    std::string kind;
+    uint64_t fromSeq;
+    uint64_t toSeq;
+  };
+
+  /**
+   * @brief 受信した通知の連番を記録する
+   * @details kind を初めて見たときはそこを起点とし、Gap は返さない。
+   * 連番が 0 の通知（連番を付けないサーバーから）は無視する
+   *
+   * @param kind 通知の種類
+   * @param seq  kind ごとの連番
+   * @return kj::Maybe<Gap> 飛びがあればその範囲
+   */
+  kj::Maybe<Gap> observe(kj::StringPtr kind, uint64_t seq) {
+    if (seq == 0) return kj::none;
+    auto [it, first] = expected.try_emplace(std::string(kind.cStr()), seq + 1);
+    if (first) return kj::none;
+
+    auto& next = it->second;
+    if (seq < next) return kj::none;
+    if (seq == next) {
+      ++next;
+      return kj::none;
+    }
+
+    Gap gap{it->first, next, seq - 1};
+    ++gaps;
+    missed += seq - next;
+    next = seq + 1;
+    return kj::mv(gap);
+  }
+
+  /// @brief 検出した飛びの数
+  uint64_t getGaps() const { return gaps; }
+
+  /// @brief 飛びで欠けた通知の合計
+  uint64_t getMissed() const { return missed; }
+
+ private:
+  std::unordered_map<std::string, uint64_t> expected;  ///< 次に来るはずの連番
+  uint64_t gaps = 0;
+  uint64_t missed = 0;
+};
+
+#endif  // GAP_DETECTOR_HPP
@@ -0,0 +1,59 @@
+#ifndef KIND_DICTIONARY_HPP
+#define KIND_DICTIONARY_HPP
+
+#include <kj/string.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "notification.capnp.h"
+
+/**
+ * @brief internKinds 購読で受け取った kind の番号と文字列の対応
+ *
+ * サーバーは kind を番号（Notification.kindId）だけで送り、対応は
+ * onKinds で先に届く。受信側はこの辞書で番号を文字列に戻す。
+ */
+class KindDictionary {
+ public:
+  /**
+   * @brief onKinds で届いた対応を登録する
+   * @details maxKindIds 以上の番号は無視する
+   *
+   * @param bindings 番号と文字列の対応
+   */
+  void bind(capnp::List<KindBinding>::Reader bindings) {
+    for (const auto binding : bindings) {
+      const auto id = binding.getId();
+      if (id >= MAX_KIND_IDS) continue;
+      if (id >= names.size()) names.resize(id + 1);
+      names[id] = binding.getKind().cStr();
+    }
+  }
+
+  /**
+   * @brief 通知の kind を文字列で得る
+   * @details kind の文字列が付いていればそれを、なければ番号から引く
+   *
+   * @param notification 受信した通知
+   * @return kj::StringPtr kind。対応が未登録なら空文字列
+   */
+  kj::StringPtr kindOf(Notification::Reader notification) const {
+    if (notification.hasKind()) return notification.getKind();
+    const auto id = notification.getKindId();
+    if (id == 0 || id >= names.size()) return "";
+    return kj::StringPtr(names[id].c_str(), names[id].size());
+  }
+
+  /// @brief 番号 id の kind（未登録なら空文字列）
+  const std::string& name(uint32_t id) const {
+    static const std::string kEmpty;
+    return id < names.size() ? names[id] : kEmpty;
+  }
+
+ private:
+  std::vector<std::string> names;  ///< 番号から kind への対応（0 は未使用）
+};
+
+#endif  // KIND_DICTIONARY_HPP
@@ -0,0 +1,214 @@
+#ifndef KIND_ROUTER_HPP
+#define KIND_ROUTER_HPP
+
+#include <kj/debug.h>
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "notification.capnp.h"
+
+/**
+ * @brief kind 文字列の 64bit FNV-1a ハッシュ
+ * @details constexpr なので、テンプレート引数で登録した kind は
+ * コンパイル時にハッシュ済みになる
+ */
+constexpr uint64_t kindHash(std::string_view kind) {
+  uint64_t hash = 14695981039346656037ull;
+  for (const char c : kind) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/**
+ * @brief テンプレート引数に文字列リテラルを渡すためのラッパー
+ *
+ * @tparam N 終端の '\0' を含む文字数
+ */
+template <size_t N>
+struct KindName {
+  char value[N];
+
+  constexpr KindName(const char (&s)[N]) {
+    for (size_t i = 0; i < N; ++i) value[i] = s[i];
+  }
+
+  constexpr std::string_view view() const { return {value, N - 1}; }
+};
+
+/**
+ * @brief 通知を kind ごとのハンドラへ振り分けるルーター
+ *
+ * ```
+ * KindRouter router;
+ * router.on<"polling_demo">([](Notification::Reader n) { ... })
+ *       .otherwise([](Notification::Reader n) { ... });
+ * router.dispatch(notification);
+ * ```
+ *
+ * kind は登録時にハッシュしてオープンアドレス法の表に入れる。
+ * `on<"kind">` で登録した場合はハッシュもコンパイル時に求まる。
+ * 通知 1 件あたりの処理は kind のハッシュ 1 回と表の参照で、
+ * 文字列比較はハッシュが一致した候補に対して 1 回だけ行う。
+ *
+ * internKinds 購読では `bind()` で番号と kind を結び付けておくと、
+ * 番号だけで届いた通知を配列の添字 1 回で振り分ける。番号の対応は
+ * on() の前後どちらで結び付けてもよい（登録のたびに引き直す）。
+ *
+ * 受信側やストリームにつなぐには routing_receiver.hpp を使う。
+ */
+class KindRouter {
+ public:
+  using Handler = std::function<void(Notification::Reader)>;
+
+  /**
+   * @brief コンパイル時に決まる kind のハンドラを登録する
+   *
+   * @tparam Kind 対象の kind
+   * @param handler 通知を受け取るハンドラ
+   * @return KindRouter& 連続して登録するための自分自身
+   */
+  template <KindName Kind>
+  KindRouter& on(Handler handler) {
+    static constexpr auto hash = kindHash(Kind.view());
+    insert(hash, std::string(Kind.view()), kj::mv(handler));
+    return *this;
+  }
+
+  /**
+   * @brief 実行時に決まる kind のハンドラを登録する
+   *
+   * @param kind    対象の kind
+   * @param handler 通知を受け取るハンドラ
+   * @return KindRouter& 連続して登録するための自分自身
+   */
+  KindRouter& on(std::string kind, Handler handler) {
+    const auto hash = kindHash(kind);
+    insert(hash, kj::mv(kind), kj::mv(handler));
+    return *this;
+  }
+
+  /**
+   * @brief どの kind にも一致しなかった通知のハンドラを登録する
+   */
+  KindRouter& otherwise(Handler handler) {
+    fallback = kj::mv(handler);
+    return *this;
+  }
+
+  /**
+   * @brief サーバーが割り当てた kind の番号をハンドラに結び付ける
+   * @details maxKindIds 以上の番号は無視し、その番号の通知は kind の
+   * 文字列がなければ otherwise() に渡る
+   *
+   * @param id   Notification.kindId
+   * @param kind その番号の kind
+   */
+  void bind(uint32_t id, kj::StringPtr kind) {
+    if (id >= MAX_KIND_IDS) return;
+    if (id >= byId.size()) {
+      byId.resize(id + 1, kEmpty);
+      boundKinds.resize(id + 1);
+    }
+    boundKinds[id] = kind.cStr();
+    byId[id] = find(boundKinds[id]);
+  }
+
+  /**
+   * @brief 通知を対応するハンドラへ渡す
+   *
+   * @param notification 受信した通知
+   * @return bool 登録済みの kind に一致すれば true
+   */
+  bool dispatch(Notification::Reader notification) const {
+    uint32_t route = kEmpty;
+    const auto id = notification.getKindId();
+    if (!notification.hasKind() && id < byId.size()) {
+      route = byId[id];
+    } else {
+      const auto kind = notification.getKind();
+      route = find(std::string_view(kind.begin(), kind.size()));
+    }
+    if (route != kEmpty) {
+      routes[route].handler(notification);
+      return true;
+    }
+    if (fallback) fallback(notification);
+    return false;
+  }
+
+  /// @brief 登録済みの kind の数
+  size_t size() const { return routes.size(); }
+
+ private:
+  static constexpr uint32_t kEmpty = UINT32_MAX;
+
+  struct Route {
+    uint64_t hash;  ///< kindHash(kind)。登録時に求めたものを使い回す
+    std::string kind;
+    Handler handler;
+  };
+
+  struct Slot {
+    uint64_t hash = 0;
+    uint32_t route = kEmpty;
+  };
+
+  /// @brief kind のルート番号を表から引く（なければ kEmpty）
+  uint32_t find(std::string_view kind) const {
+    if (slots.empty()) return kEmpty;
+    const auto hash = kindHash(kind);
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      const auto& slot = slots[i];
+      if (slot.route == kEmpty) return kEmpty;
+      if (slot.hash == hash && routes[slot.route].kind == kind) {
+        return slot.route;
+      }
+    }
+  }
+
+  /// @brief ルートを追加する。同じ kind の再登録はハンドラを置き換える
+  void insert(uint64_t hash, std::string kind, Handler handler) {
+    for (auto& route : routes) {
+      if (route.kind == kind) {
+        route.handler = kj::mv(handler);
+        return;
+      }
+    }
+    routes.push_back({hash, kj::mv(kind), kj::mv(handler)});
+    rebuild();
+  }
+
+  /// @brief 負荷率が 1/2 以下になる大きさで表を作り直し、番号の対応も
+  /// 引き直す
+  void rebuild() {
+    size_t capacity = 8;
+    while (capacity < routes.size() * 2) capacity *= 2;
+    slots.assign(capacity, Slot{});
+    mask = capacity - 1;
+    for (uint32_t r = 0; r < routes.size(); ++r) {
+      const auto hash = routes[r].hash;
+      auto i = hash & mask;
+      while (slots[i].route != kEmpty) i = (i + 1) & mask;
+      slots[i] = {hash, r};
+    }
+    for (size_t id = 0; id < byId.size(); ++id) {
+      if (!boundKinds[id].empty()) byId[id] = find(boundKinds[id]);
+    }
+  }
+
+  std::vector<Route> routes;
+  std::vector<Slot> slots;     ///< ハッシュ表（線形探索）
+  std::vector<uint32_t> byId;  ///< kind の番号からルート番号への対応
+  std::vector<std::string> boundKinds;  ///< bind() で結び付けた kind
+  size_t mask = 0;
+  Handler fallback;
+};
+
+#endif  // KIND_ROUTER_HPP
@@ -0,0 +1,84 @@
+#ifndef NOTIFICATION_CURSOR_HPP
+#define NOTIFICATION_CURSOR_HPP
+
+#include <kj/async.h>
+#include <kj/debug.h>
+
+#if !KJ_HAS_COROUTINE
+#error "notification_cursor.hpp requires C++20 coroutine support in KJ"
+#endif
+
+#include <pipelined_reader.hpp>
+
+#include "notification.capnp.h"
+
+/**
+ * @brief NotificationStream をコルーチンから順に読むためのカーソル
+ *
+ * ```
+ * NotificationCursor cursor(promise.getStream(), timer);
+ * while (co_await cursor.next()) {
+ *   handle(cursor.get());
+ * }
+ * ```
+ *
+ * 裏では PipelinedStreamReader が read() を先行して送っておくため、
+ * 1 件ずつ wait() する場合のように往復待ちが積み重ならない。
+ * `get()` が返す Reader のメッセージはカーソルが保持し、次の `next()` で
+ * 自動的に解放される。
+ */
+class NotificationCursor {
+ public:
+  /**
+   * @brief コンストラクタ
+   *
+   * @param stream    読み出し元のストリーム
+   * @param timer     先読み数の調整に使うタイマー
+   * @param maxWindow 先行して送る read() の上限
+   */
+  NotificationCursor(NotificationStream::Client stream, kj::Timer& timer,
+                     uint32_t maxWindow = 64)
+      : reader(kj::mv(stream), timer, 1, maxWindow) {}
+
+  KJ_DISALLOW_COPY_AND_MOVE(NotificationCursor);
+
+  /**
+   * @brief 次の通知まで進める
+   * @details 直前の通知のメッセージはこの呼び出しで解放される
+   *
+   * @return kj::Promise<bool> 通知があれば true、ストリームの終端なら false
+   */
+  kj::Promise<bool> next() {
+    current = kj::none;
+    if (ended) co_return false;
+
+    auto response = co_await reader.next();
+    if (!response.hasResult()) {
+      ended = true;
+      co_return false;
+    }
+    current = kj::mv(response);
+    co_return true;
+  }
+
+  /**
+   * @brief 現在の通知を取得する
+   * @details 次に `next()` を呼ぶまで有効
+   */
+  Notification::Reader get() const {
+    KJ_IF_SOME(response, current) {
+      return response.getResult();
+    }
+    KJ_FAIL_REQUIRE("next() has not produced a notification");
+  }
+
+  /// @brief 先読みしている read() の数
+  uint32_t getWindow() const { return reader.getWindow(); }
+
+ private:
+  PipelinedStreamReader reader;
+  kj::Maybe<PipelinedStreamReader::Response> current;  ///< 現在の通知
+  bool ended = false;
+};
+
+#endif  // NOTIFICATION_CURSOR_HPP
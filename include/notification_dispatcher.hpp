@@ -0,0 +1,320 @@
+#ifndef NOTIFICATION_DISPATCHER_HPP
+#define NOTIFICATION_DISPATCHER_HPP
+
+#include <kj/async.h>
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <credit_replenisher.hpp>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <kind_dictionary.hpp>
+#include <memory>
+#include <mutex>
+#include <notification_store.hpp>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "notification.capnp.h"
+#include "utility.hpp"
+
+/**
+ * @brief 受信した通知をワーカースレッドへ振り分けて処理するクラス
+ *
+ * RPC のイベントループ上では通知を RetainedNotification として保持し、
+ * キューに積むだけにする。アプリケーションの処理は `threads` 本の
+ * ワーカーで行う。
+ * 通知は kind の文字列のハッシュでワーカーを決めるため、同じ kind の
+ * 通知は受信順に処理される。internKinds で番号だけが届く場合は
+ * `bindKinds()` で登録した対応で文字列に戻してから決めるので、
+ * 文字列付きで届いた同じ kind と同じワーカーに入る。
+ *
+ * キューの長さが `capacity` を超えると `enqueue()` が返すプロミスは
+ * 空きができるまで完了しない。受信側の RPC 応答が遅れることで、
+ * サーバーのフロー制御（クレジット・バッチの同時送信数）に背圧が伝わる。
+ * それでも `limit` を超える分は積まず、OVERLOADED で失敗させる。
+ * 通知は捨てずに呼び出しごと断るので、atLeastOnce の購読なら ack されず
+ * サーバーが再送する。クレジット付きで購読し、積み終えた分だけ
+ * クレジットを返せば、キューの長さは capacity とクレジットの窓の和で
+ * 抑えられ、断ることはない。
+ *
+ * handler はワーカースレッドで呼ばれるので、capability や
+ * イベントループに触れてはならない。
+ */
+class NotificationDispatcher {
+ public:
+  /// ワーカースレッドで呼ばれる通知ハンドラ
+  using Handler = std::function<void(Notification::Reader)>;
+
+  /**
+   * @brief コンストラクタ
+   *
+   * @param handler  通知を処理するハンドラ
+   * @param threads  ワーカースレッドの数
+   * @param capacity キュー全体の長さの目安（これを超えると背圧をかける）
+   * @param limit    キュー全体の長さの上限（これを超える通知は断る）
+   */
+  NotificationDispatcher(Handler handler, size_t threads = 4,
+                         size_t capacity = 1024, size_t limit = 4096)
+      : handler(kj::mv(handler)),
+        capacity(capacity),
+        limit(std::max(capacity, limit)) {
+    const auto count = std::max<size_t>(1, threads);
+    for (size_t i = 0; i < count; ++i) {
+      workers.push_back(std::make_unique<Worker>());
+    }
+    for (auto& worker : workers) {
+      worker->thread = std::thread([this, w = worker.get()]() { run(*w); });
+    }
+  }
+
+  ~NotificationDispatcher() {
+    for (auto& worker : workers) {
+      {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->stopping = true;
+      }
+      worker->cv.notify_one();
+    }
+    for (auto& worker : workers) {
+      if (worker->thread.joinable()) worker->thread.join();
+    }
+  }
+
+  KJ_DISALLOW_COPY_AND_MOVE(NotificationDispatcher);
+
+  /**
+   * @brief 通知を保持してワーカーのキューに積む
+   * @details イベントループのスレッドから呼ぶこと
+   *
+   * @param notification 受信した通知
+   * @return kj::Promise<void> キューに空きがあれば直ちに完了するプロミス。
+   *         limit を超えるなら積まずに OVERLOADED で失敗する
+   */
+  kj::Promise<void> enqueue(Notification::Reader notification) {
+    if (!admits(1)) return overloaded();
+    push(notification);
+    return waitForSpace();
+  }
+
+  /**
+   * @brief バッチで届いた通知をまとめてキューに積む
+   * @details 先にすべて積んでから背圧をかけるので、後から届いた通知に
+   * 追い越されない
+   *
+   * @param notifications 受信した通知（id 昇順）
+   * @return kj::Promise<void> キューに空きがあれば直ちに完了するプロミス。
+   *         limit を超えるなら 1 件も積まずに OVERLOADED で失敗する
+   */
+  kj::Promise<void> enqueueAll(
+      capnp::List<Notification>::Reader notifications) {
+    if (!admits(notifications.size())) return overloaded();
+    for (const auto notification : notifications) push(notification);
+    return waitForSpace();
+  }
+
+  /**
+   * @brief internKinds 購読で届いた kind の番号の対応を登録する
+   * @details イベントループのスレッドから呼ぶこと
+   *
+   * @param bindings 番号と文字列の対応
+   */
+  void bindKinds(capnp::List<KindBinding>::Reader bindings) {
+    kinds.bind(bindings);
+  }
+
+  /// @brief キューに積まれて未処理の通知の数
+  size_t getDepth() const { return depth.load(); }
+
+  /// @brief これまでで最大のキューの長さ
+  size_t getMaxDepth() const { return maxDepth.load(); }
+
+  /// @brief 処理し終えた通知の数
+  uint64_t getProcessed() const { return processed.load(); }
+
+  /// @brief 背圧をかけた（応答を遅らせた）回数
+  uint64_t getBackpressured() const { return backpressured.load(); }
+
+  /// @brief limit を超えるため断った通知の数
+  uint64_t getRejected() const { return rejected.load(); }
+
+  /// @brief ワーカーごとの未処理の通知の数
+  std::vector<size_t> getWorkerDepths() const {
+    std::vector<size_t> depths;
+    for (const auto& worker : workers) {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      depths.push_back(worker->queue.size());
+    }
+    return depths;
+  }
+
+ private:
+  /// ワーカー 1 本分のキューとスレッド
+  struct Worker {
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<kj::Own<const RetainedNotification>> queue;
+    bool stopping = false;
+    std::thread thread;
+  };
+
+  /**
+   * @brief count 件を積んでも limit を超えないか
+   * @details キューが空なら limit より大きなバッチも受け付ける（断り
+   * 続けて進まなくなるのを防ぐ）
+   */
+  bool admits(size_t count) {
+    const auto current = depth.load();
+    if (current == 0 || current + count <= limit) return true;
+    rejected += count;
+    return false;
+  }
+
+  static kj::Promise<void> overloaded() {
+    return KJ_EXCEPTION(OVERLOADED, "notification queue is full");
+  }
+
+  /// @brief kind で決まるワーカーのキューに通知を積む
+  void push(Notification::Reader notification) {
+    // 番号だけで届いた kind も文字列に戻し、1 つの kind を 1 つの
+    // ワーカーに決める（対応が未登録なら空文字列として扱う）
+    const auto kind = kinds.kindOf(notification);
+    const auto hash = std::hash<std::string_view>()(
+        std::string_view(kind.begin(), kind.size()));
+    auto& worker = *workers[hash % workers.size()];
+    {
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      worker.queue.push_back(RetainedNotification::retain(notification));
+    }
+    worker.cv.notify_one();
+
+    const auto current = depth.fetch_add(1) + 1;
+    auto observed = maxDepth.load();
+    while (current > observed &&
+           !maxDepth.compare_exchange_weak(observed, current)) {
+    }
+  }
+
+  /// @brief キューが capacity 以下になるまで待つ
+  kj::Promise<void> waitForSpace() {
+    if (depth.load() <= capacity) return kj::READY_NOW;
+
+    // 空きができるまで RPC の応答を遅らせる
+    ++backpressured;
+    auto paf = kj::newPromiseAndCrossThreadFulfiller<void>();
+    std::lock_guard<std::mutex> lock(waitersMutex);
+    // 待ちを登録する前にワーカーが追いついていたら、そのまま返す
+    if (depth.load() <= capacity) return kj::READY_NOW;
+    waiters.push_back(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
+  }
+
+  /// @brief ワーカースレッドの本体。停止時は残りを処理してから抜ける
+  void run(Worker& worker) {
+    while (true) {
+      kj::Own<const RetainedNotification> notification;
+      {
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.cv.wait(lock, [&] {
+          return worker.stopping || !worker.queue.empty();
+        });
+        if (worker.queue.empty()) return;
+        notification = kj::mv(worker.queue.front());
+        worker.queue.pop_front();
+      }
+
+      try {
+        handler(notification->get());
+      } catch (const std::exception& e) {
+        LOG_COUT << "[Dispatcher] handler failed: " << e.what() << std::endl;
+      } catch (const kj::Exception& e) {
+        LOG_COUT << "[Dispatcher] handler failed: "
+                 << e.getDescription().cStr() << std::endl;
+      }
+      ++processed;
+      if (depth.fetch_sub(1) - 1 <= capacity) releaseWaiters();
+    }
+  }
+
+  /// @brief 背圧で待たせている受信をすべて再開する
+  void releaseWaiters() {
+    std::lock_guard<std::mutex> lock(waitersMutex);
+    for (auto& waiter : waiters) waiter->fulfill();
+    waiters.clear();
+  }
+
+  Handler handler;
+  const size_t capacity;
+  const size_t limit;
+  std::vector<std::unique_ptr<Worker>> workers;
+  KindDictionary kinds;  ///< kind の番号の対応（イベントループのみで使う）
+
+  std::atomic<size_t> depth{0};
+  std::atomic<size_t> maxDepth{0};
+  std::atomic<uint64_t> processed{0};
+  std::atomic<uint64_t> backpressured{0};
+  std::atomic<uint64_t> rejected{0};
+
+  std::mutex waitersMutex;
+  std::vector<kj::Own<kj::CrossThreadPromiseFulfiller<void>>> waiters;
+};
+
+/**
+ * @brief 受信した通知を NotificationDispatcher に渡すだけの受信側
+ * @details 処理の完了を待たずに応答するため、遅いハンドラが
+ * サーバーへの応答や ack を止めない。credits を渡すと、キューに
+ * 積み終えた（背圧が解けた）分だけクレジットを返す。キューが一杯で
+ * 断った呼び出しは何も保持しないので、そのクレジットも返し（再送にも
+ * クレジットが要る）、失敗をサーバーに返して再送させる
+ */
+class DispatchingReceiverImpl final
+    : public PollingNotificationReceiver::Server {
+ public:
+  explicit DispatchingReceiverImpl(NotificationDispatcher& dispatcher)
+      : dispatcher(dispatcher) {}
+
+  /**
+   * @brief クレジットの返却器を設定する（フロー制御あり購読時）
+   * @param c 使用するクレジット返却器のポインタ
+   */
+  void setCreditReplenisher(CreditReplenisher* c) { credits = c; }
+
+  kj::Promise<void> onKinds(OnKindsContext context) override {
+    dispatcher.bindKinds(context.getParams().getBindings());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> onNotification(OnNotificationContext context) override {
+    return settle(dispatcher.enqueue(context.getParams().getNotification()),
+                  1);
+  }
+
+  kj::Promise<void> onNotifications(OnNotificationsContext context) override {
+    const auto notifications = context.getParams().getNotifications();
+    return settle(dispatcher.enqueueAll(notifications), notifications.size());
+  }
+
+ private:
+  /// @brief 積み終えても断られても count 件分のクレジットを返す
+  kj::Promise<void> settle(kj::Promise<void> queued, size_t count) {
+    return queued.then([this, count]() { consumed(count); },
+                       [this, count](kj::Exception&& e) {
+                         consumed(count);
+                         kj::throwFatalException(kj::mv(e));
+                       });
+  }
+
+  void consumed(size_t count) {
+    if (credits == nullptr) return;
+    for (size_t i = 0; i < count; ++i) credits->consumed();
+  }
+
+  NotificationDispatcher& dispatcher;
+  CreditReplenisher* credits = nullptr;
+};
+
+#endif  // NOTIFICATION_DISPATCHER_HPP
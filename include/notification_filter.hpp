@@ -0,0 +1,84 @@
+#ifndef NOTIFICATION_FILTER_HPP
+#define NOTIFICATION_FILTER_HPP
+
+#include <kj/string.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * @brief 購読フィルタが通知の種類に一致するかを判定する
+ *
+ * - 空文字列または "*" はすべての種類に一致
+ * - 末尾が '*' なら前方一致（例: "sensor.*"）
+ * - それ以外は完全一致
+ *
+ * @param filter 購読フィルタ
+ * @param kind   通知の種類
+ * @return bool 一致すれば true
+ */
+inline bool matchesFilter(kj::StringPtr filter, kj::StringPtr kind) {
+  if (filter.size() == 0 || filter == "*") return true;
+  if (filter.endsWith("*")) {
+    const auto prefix = filter.size() - 1;
+    return kind.size() >= prefix &&
+           std::memcmp(kind.begin(), filter.begin(), prefix) == 0;
+  }
+  return filter == kind;
+}
+
+/**
+ * @brief 1 つの購読が持つフィルタの集合
+ *
+ * `subscribeMany` では複数のフィルタを 1 つの購読にまとめるため、
+ * 一致したフィルタの番号を通知に付けて返す。
+ */
+class FilterSet {
+ public:
+  /// 一致するフィルタがないことを表す番号
+  static constexpr int32_t kNoMatch = -1;
+
+  FilterSet() = default;
+
+  /**
+   * @brief フィルタを 1 つだけ持つ集合を作る
+   *
+   * @param filter 購読フィルタ
+   */
+  explicit FilterSet(std::string filter) { filters_.push_back(kj::mv(filter)); }
+
+  /**
+   * @brief フィルタを追加する
+   *
+   * @param filter 購読フィルタ
+   */
+  void add(std::string filter) { filters_.push_back(kj::mv(filter)); }
+
+  /**
+   * @brief 通知の種類に最初に一致したフィルタの番号を返す
+   *
+   * @param kind 通知の種類
+   * @return int32_t フィルタの番号。一致しなければ kNoMatch
+   */
+  int32_t match(kj::StringPtr kind) const {
+    for (size_t i = 0; i < filters_.size(); ++i) {
+      if (matchesFilter(filters_[i].c_str(), kind)) {
+        return static_cast<int32_t>(i);
+      }
+    }
+    return kNoMatch;
+  }
+
+  /// @brief フィルタの数
+  size_t size() const { return filters_.size(); }
+
+  /// @brief 番号 i のフィルタ
+  const std::string& operator[](size_t i) const { return filters_[i]; }
+
+ private:
+  std::vector<std::string> filters_;
+};
+
+#endif  // NOTIFICATION_FILTER_HPP
@@ -0,0 +1,70 @@
+#ifndef NOTIFICATION_LITE_HPP
+#define NOTIFICATION_LITE_HPP
+
+#include <kj/common.h>
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include "notification.capnp.h"
+
+/**
+ * @brief NotificationLite に埋め込んだペイロード
+ * @details payload0 / payload1 の 2 ワードをバイト列に戻したもの
+ */
+struct LitePayload {
+  std::array<kj::byte, LITE_PAYLOAD_BYTES> bytes{};
+  uint8_t size = 0;
+
+  /// @brief 有効なバイト列
+  kj::ArrayPtr<const kj::byte> asBytes() const {
+    return kj::arrayPtr(bytes.data(), size);
+  }
+};
+
+/**
+ * @brief ペイロードを NotificationLite の data ワードに詰める
+ *
+ * @param builder 書き込み先
+ * @param payload ペイロード（LITE_PAYLOAD_BYTES 以下）
+ */
+inline void setLitePayload(NotificationLite::Builder builder,
+                           kj::ArrayPtr<const kj::byte> payload) {
+  KJ_REQUIRE(payload.size() <= LITE_PAYLOAD_BYTES,
+             "payload too large for NotificationLite", payload.size());
+  uint64_t words[2] = {0, 0};
+  if (payload.size() > 0) std::memcpy(words, payload.begin(), payload.size());
+  builder.setPayload0(words[0]);
+  builder.setPayload1(words[1]);
+  builder.setPayloadSize(static_cast<uint8_t>(payload.size()));
+}
+
+/**
+ * @brief NotificationLite のペイロードをバイト列に戻す
+ *
+ * @param lite 受信した通知
+ * @return LitePayload ペイロード
+ */
+inline LitePayload getLitePayload(NotificationLite::Reader lite) {
+  LitePayload payload;
+  const uint64_t words[2] = {lite.getPayload0(), lite.getPayload1()};
+  payload.size = static_cast<uint8_t>(
+      std::min<uint32_t>(lite.getPayloadSize(), LITE_PAYLOAD_BYTES));
+  std::memcpy(payload.bytes.data(), words, payload.size);
+  return payload;
+}
+
+/**
+ * @brief NotificationLite の絶対時刻（ミリ秒）
+ *
+ * @param lite 受信した通知
+ * @param base リストの baseTimestamp
+ */
+inline int64_t liteTimestamp(NotificationLite::Reader lite, int64_t base) {
+  return base + lite.getTimestampDelta();
+}
+
+#endif  // NOTIFICATION_LITE_HPP
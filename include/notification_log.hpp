@@ -0,0 +1,380 @@
+#ifndef NOTIFICATION_LOG_HPP
+#define NOTIFICATION_LOG_HPP
+
+#include <capnp/list.h>
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <blob_store.hpp>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <notification_lite.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "notification.capnp.h"
+
+/// 通知のペイロードをどの形で送るか
+enum class PayloadForm : uint8_t {
+  RAW,         ///< そのままのバイト列
+  COMPRESSED,  ///< 辞書で圧縮したもの（payloadDictionary）
+  BLOB,        ///< 中身のハッシュ（payloadBlob）
+  CHUNKED,     ///< 中身は後から分けて送る（payloadChunked）
+};
+
+/**
+ * @brief 通知ログの 1 エントリ
+ *
+ * RPC メッセージから切り離して保持するため、各フィールドを所有型で持つ。
+ */
+struct LogEntry {
+  uint64_t id = 0;
+  uint64_t kind_seq = 0;  ///< kind ごとの連番（1 始まり）
+  uint32_t kind_id = 0;   ///< このサーバーで kind に割り当てた番号
+  int64_t timestamp = 0;
+  std::string kind;
+  /// そのままのペイロード。blob.blob があれば空で、中身はそちらにある
+  std::vector<uint8_t> payload;
+  uint32_t dictionary_id = 0;       ///< 0 でなければ compressed が有効
+  std::vector<uint8_t> compressed;  ///< 辞書で圧縮したペイロード
+  BlobStore::Ref blob;              ///< 大きなペイロードの共有の中身
+
+  /// @brief そのままのペイロード（共有の中身があればそれを指す）
+  kj::ArrayPtr<const kj::byte> rawPayload() const {
+    if (blob.blob != nullptr) {
+      return kj::arrayPtr(blob.blob->bytes.data(), blob.blob->bytes.size());
+    }
+    return kj::arrayPtr(payload.data(), payload.size());
+  }
+
+  /**
+   * @brief Notification::Reader からエントリを作成する
+   *
+   * @param reader 受信した通知
+   * @return LogEntry 所有型にコピーしたエントリ
+   */
+  static LogEntry fromReader(::Notification::Reader reader) {
+    LogEntry entry;
+    entry.id = reader.getId();
+    entry.kind_seq = reader.getKindSeq();
+    entry.timestamp = reader.getTimestamp();
+    entry.kind = reader.getKind().cStr();
+    const auto payload = reader.getPayload();
+    entry.payload.assign(payload.begin(), payload.end());
+    return entry;
+  }
+
+  /**
+   * @brief エントリの内容を Notification::Builder に書き込む
+   *
+   * @param builder   書き込み先の通知
+   * @param with_kind false なら kind の文字列を省き、kindId だけを送る
+   *                  （maxKindIds 以上の kindId は受信側が引けないので
+   *                  省かない）
+   * @param form      ペイロードの形（その形を持っていなければそのまま送る）
+   */
+  void fill(::Notification::Builder builder, bool with_kind = true,
+            PayloadForm form = PayloadForm::RAW) const {
+    builder.setId(id);
+    builder.setKindSeq(kind_seq);
+    builder.setKindId(kind_id);
+    builder.setTimestamp(timestamp);
+    if (with_kind || kind_id >= MAX_KIND_IDS) builder.setKind(kind.c_str());
+    form = available(form);
+    const auto bytes = payloadBytes(form);
+    if (bytes.size() > 0) builder.setPayload(bytes);
+    if (form == PayloadForm::COMPRESSED) {
+      builder.setPayloadDictionary(dictionary_id);
+    } else if (form == PayloadForm::BLOB) {
+      builder.setPayloadBlob(true);
+    } else if (form == PayloadForm::CHUNKED) {
+      builder.setPayloadChunked(rawPayload().size());
+    } else {
+      builder.setPayloadRegistered(registered(form));
+    }
+  }
+
+  /// @brief form の形で送る中身が BlobStore に登録したものか
+  bool registered(PayloadForm form) const {
+    form = available(form);
+    return blob.blob != nullptr &&
+           (form == PayloadForm::RAW || form == PayloadForm::COMPRESSED);
+  }
+
+  /// @brief form の形を持っていればそれを、なければ RAW を返す
+  PayloadForm available(PayloadForm form) const {
+    if (form == PayloadForm::COMPRESSED && dictionary_id == 0) {
+      return PayloadForm::RAW;
+    }
+    // 分けて送る中身は、ログから捨てられても送り終えられるよう共有の
+    // 中身から読む
+    if ((form == PayloadForm::BLOB || form == PayloadForm::CHUNKED) &&
+        blob.blob == nullptr) {
+      return PayloadForm::RAW;
+    }
+    return form;
+  }
+
+  /// @brief form の形で送るペイロードのバイト列
+  kj::ArrayPtr<const kj::byte> payloadBytes(PayloadForm form) const {
+    switch (available(form)) {
+      case PayloadForm::COMPRESSED:
+        return kj::arrayPtr(compressed.data(), compressed.size());
+      case PayloadForm::BLOB:
+        return kj::arrayPtr(blob.blob->hash.data(), blob.blob->hash.size());
+      case PayloadForm::CHUNKED:
+        return nullptr;
+      case PayloadForm::RAW:
+        break;
+    }
+    return rawPayload();
+  }
+
+  /// @brief NotificationLite で送れるか（ペイロードが埋め込める大きさで、
+  /// kindId を受信側が引けるか）
+  bool fitsLite() const {
+    return rawPayload().size() <= LITE_PAYLOAD_BYTES && kind_id < MAX_KIND_IDS;
+  }
+
+  /**
+   * @brief baseTimestamp が base のリストに NotificationLite で入れられるか
+   * @details timestampDelta は符号なし 32 bit なので、base より前の
+   * タイムスタンプ（時計の巻き戻りやレプリケーションで起こる）は
+   * 表せない
+   *
+   * @param base リストの baseTimestamp
+   */
+  bool fitsLite(int64_t base) const {
+    return fitsLite() && timestamp >= base &&
+           static_cast<uint64_t>(timestamp) - static_cast<uint64_t>(base) <=
+               UINT32_MAX;
+  }
+
+  /**
+   * @brief エントリの内容を NotificationLite::Builder に書き込む
+   *
+   * @param builder 書き込み先
+   * @param base    リストの baseTimestamp（fitsLite(base) であること）
+   */
+  void fillLite(::NotificationLite::Builder builder, int64_t base) const {
+    KJ_REQUIRE(fitsLite(base), "entry does not fit in NotificationLite", id,
+               timestamp, base);
+    builder.setId(id);
+    builder.setKindId(kind_id);
+    builder.setKindSeq(static_cast<uint32_t>(kind_seq));
+    builder.setTimestampDelta(
+        static_cast<uint32_t>(static_cast<uint64_t>(timestamp) -
+                              static_cast<uint64_t>(base)));
+    setLitePayload(builder, rawPayload());
+  }
+};
+
+/**
+ * @brief 直近の通知を保持する固定長のリングログ
+ *
+ * id は単調増加で連続している前提。容量を超えると古いものから捨てる。
+ * 購読の再開（fromId 指定）とフォロワーへのレプリケーションの両方で使う。
+ */
+class NotificationLog {
+ public:
+  /**
+   * @brief コンストラクタ
+   *
+   * @param capacity 保持する最大エントリ数
+   */
+  explicit NotificationLog(size_t capacity = 4096) : capacity_(capacity) {}
+
+  /**
+   * @brief 新しい通知を採番して追記する（リーダー側）
+   * @details id とあわせて kind ごとの連番も採番する
+   *
+   * @param kind      通知の種類
+   * @param payload   ペイロード（blob に預けたなら空）
+   * @param timestamp タイムスタンプ（ミリ秒）
+   * @param dictionary_id 圧縮に使った辞書の番号（0 なら非圧縮）
+   * @param compressed    圧縮したペイロード
+   * @param blob          BlobStore に登録した中身
+   * @return const LogEntry& 追記したエントリ
+   */
+  const LogEntry& append(std::string kind, std::vector<uint8_t> payload,
+                         int64_t timestamp, uint32_t dictionary_id = 0,
+                         std::vector<uint8_t> compressed = {},
+                         BlobStore::Ref blob = {}) {
+    LogEntry entry;
+    entry.id = next_id_;
+    entry.kind_seq = ++kind_seqs_[kind];
+    entry.kind_id = intern(kind);
+    entry.timestamp = timestamp;
+    entry.kind = std::move(kind);
+    entry.payload = std::move(payload);
+    entry.dictionary_id = dictionary_id;
+    entry.compressed = std::move(compressed);
+    entry.blob = std::move(blob);
+    return push(std::move(entry));
+  }
+
+  /**
+   * @brief 採番済みのエントリを追記する（フォロワー側）
+   *
+   * @details 順序通りに適用されていることを id の連続性で検証する。
+   * 既に適用済みの id は無視する（再送への備え）。
+   * @param entry 追記するエントリ
+   * @return bool 追記した場合 true、重複で無視した場合 false
+   */
+  bool applyReplicated(LogEntry entry) {
+    if (entry.id < next_id_) return false;
+    KJ_REQUIRE(entries_.empty() || entry.id == next_id_,
+               "replication gap detected", entry.id, next_id_);
+    next_id_ = entry.id;
+    // 昇格後も連番が続くよう、kind ごとの最新値を追う
+    auto& seq = kind_seqs_[entry.kind];
+    seq = std::max(seq, entry.kind_seq);
+    // kind の番号はサーバーごとに振り直す
+    entry.kind_id = intern(entry.kind);
+    push(std::move(entry));
+    return true;
+  }
+
+  /**
+   * @brief 指定した id 以降のエントリを順に列挙する
+   *
+   * @param fromId 列挙を開始する id
+   * @param limit  列挙する最大件数
+   * @param fn     各エントリに対して呼ばれる関数
+   * @return size_t 列挙した件数
+   */
+  size_t forEachFrom(uint64_t fromId, size_t limit,
+                     const std::function<void(const LogEntry&)>& fn) const {
+    if (entries_.empty() || fromId >= next_id_) return 0;
+    const auto first = entries_.front().id;
+    const size_t offset = fromId > first ? fromId - first : 0;
+    size_t count = 0;
+    for (size_t i = offset; i < entries_.size() && count < limit; ++i) {
+      fn(entries_[i]);
+      ++count;
+    }
+    return count;
+  }
+
+  /**
+   * @brief 指定した id 以降のエントリを、fn が false を返すまで列挙する
+   *
+   * @param fromId 列挙を開始する id
+   * @param fn     各エントリに対して呼ばれる関数。false で打ち切る
+   * @return size_t 列挙した件数（打ち切ったエントリを含む）
+   */
+  size_t scanFrom(uint64_t fromId,
+                  const std::function<bool(const LogEntry&)>& fn) const {
+    if (entries_.empty() || fromId >= next_id_) return 0;
+    const auto first = entries_.front().id;
+    const size_t offset = fromId > first ? fromId - first : 0;
+    size_t count = 0;
+    for (size_t i = offset; i < entries_.size(); ++i) {
+      ++count;
+      if (!fn(entries_[i])) break;
+    }
+    return count;
+  }
+
+  /**
+   * @brief 指定 id のエントリを取得する
+   *
+   * @param id 取得したい id
+   * @return const LogEntry* 見つからない（既に捨てられた）場合は nullptr
+   */
+  const LogEntry* find(uint64_t id) const {
+    if (entries_.empty() || id < entries_.front().id || id >= next_id_) {
+      return nullptr;
+    }
+    return &entries_[id - entries_.front().id];
+  }
+
+  /**
+   * @brief kind と連番の範囲でエントリを列挙する
+   *
+   * @param kind    通知の種類
+   * @param fromSeq 範囲の先頭の連番
+   * @param toSeq   範囲の末尾の連番（含む）
+   * @param fn      各エントリに対して呼ばれる関数（連番の昇順）
+   * @return size_t 列挙した件数
+   */
+  size_t forEachKindSeq(const std::string& kind, uint64_t fromSeq,
+                        uint64_t toSeq,
+                        const std::function<void(const LogEntry&)>& fn) const {
+    size_t count = 0;
+    for (const auto& entry : entries_) {
+      if (entry.kind_seq < fromSeq || entry.kind_seq > toSeq ||
+          entry.kind != kind) {
+        continue;
+      }
+      fn(entry);
+      ++count;
+      if (entry.kind_seq == toSeq) break;
+    }
+    return count;
+  }
+
+  /// @brief kind の最新の連番（まだなければ 0）
+  uint64_t lastKindSeq(const std::string& kind) const {
+    auto it = kind_seqs_.find(kind);
+    return it == kind_seqs_.end() ? 0 : it->second;
+  }
+
+  /**
+   * @brief kind に番号を割り当てる（割り当て済みならその番号）
+   *
+   * @param kind 通知の種類
+   * @return uint32_t 1 始まりの番号
+   */
+  uint32_t intern(const std::string& kind) {
+    auto [it, inserted] = kind_ids_.try_emplace(
+        kind, static_cast<uint32_t>(kind_names_.size() + 1));
+    if (inserted) kind_names_.push_back(kind);
+    return it->second;
+  }
+
+  /// @brief 番号の kind（未割り当てなら空文字列）
+  const std::string& kindName(uint32_t id) const {
+    static const std::string kEmpty;
+    return id == 0 || id > kind_names_.size() ? kEmpty : kind_names_[id - 1];
+  }
+
+  /// @brief 番号を割り当てた kind の数（番号は 1..kindCount()）
+  uint32_t kindCount() const {
+    return static_cast<uint32_t>(kind_names_.size());
+  }
+
+  /// @brief 保持している最古の id（空なら次に採番される id）
+  uint64_t firstId() const {
+    return entries_.empty() ? next_id_ : entries_.front().id;
+  }
+
+  /// @brief 次に採番される id
+  uint64_t nextId() const { return next_id_; }
+
+  /// @brief 保持しているエントリ数
+  size_t size() const { return entries_.size(); }
+
+ private:
+  const LogEntry& push(LogEntry entry) {
+    entries_.push_back(std::move(entry));
+    next_id_ = entries_.back().id + 1;
+    while (entries_.size() > capacity_) {
+      entries_.pop_front();
+    }
+    return entries_.back();
+  }
+
+  size_t capacity_;
+  std::deque<LogEntry> entries_;
+  uint64_t next_id_ = 0;
+  /// kind ごとの最新の連番
+  std::unordered_map<std::string, uint64_t> kind_seqs_;
+  /// kind の番号（1 始まり）と、番号から引くための一覧
+  std::unordered_map<std::string, uint32_t> kind_ids_;
+  std::vector<std::string> kind_names_;
+};
+
+#endif  // NOTIFICATION_LOG_HPP
@@ -0,0 +1,144 @@
+#ifndef NOTIFICATION_STORE_HPP
+#define NOTIFICATION_STORE_HPP
+
+#include <capnp/message.h>
+#include <kj/debug.h>
+#include <kj/refcount.h>
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+
+#include "notification.capnp.h"
+
+/**
+ * @brief RPC 呼び出しの外まで保持できる、受信した通知のメッセージ
+ *
+ * 呼び出しコンテキストの `Notification::Reader` は、その呼び出しが
+ * 完了するとメッセージごと解放される。`retain()` は通知を 1 つの
+ * セグメントにちょうど収まる大きさで 1 度だけ写し、以降は参照カウント
+ * 付きのハンドル（`kj::Own<const RetainedNotification>`）で共有する。
+ * ハンドルの複製は `addRef()` で、メッセージのコピーは発生しない。
+ * 参照カウントはアトミックなので、ワーカースレッドへ渡してもよい。
+ */
+class RetainedNotification final : public kj::AtomicRefcounted {
+ public:
+  /**
+   * @brief 受信した通知を保持する
+   *
+   * @param notification 呼び出しコンテキストの通知
+   * @return kj::Own<const RetainedNotification> 保持した通知へのハンドル
+   */
+  static kj::Own<const RetainedNotification> retain(
+      Notification::Reader notification) {
+    return kj::atomicRefcounted<RetainedNotification>(notification);
+  }
+
+  /**
+   * @brief ペイロードを差し替えた通知を保持する
+   * @details 圧縮やハッシュで受け取ったペイロードを戻すときに使う。
+   * payloadDictionary・payloadBlob・payloadChunked は元に戻した状態
+   * （0・false・0）にする
+   *
+   * @param notification 受信した通知
+   * @param payload      元のペイロード
+   * @return kj::Own<const RetainedNotification> 保持した通知へのハンドル
+   */
+  static kj::Own<const RetainedNotification> withPayload(
+      Notification::Reader notification,
+      kj::ArrayPtr<const kj::byte> payload) {
+    capnp::MallocMessageBuilder message(notification.totalSize().wordCount +
+                                        payload.size() / 8 + 2);
+    message.setRoot(notification);
+    auto copy = message.getRoot<Notification>();
+    copy.setPayload(payload);
+    copy.setPayloadDictionary(0);
+    copy.setPayloadBlob(false);
+    copy.setPayloadChunked(0);
+    return retain(copy.asReader());
+  }
+
+  /// @brief ハンドルを複製する（メッセージは共有）
+  kj::Own<const RetainedNotification> addRef() const {
+    return kj::atomicAddRef(*this);
+  }
+
+  /// @brief 保持している通知。ハンドルがある間は有効
+  Notification::Reader get() const { return root; }
+
+  explicit RetainedNotification(Notification::Reader notification)
+      : message(notification.totalSize().wordCount + 1) {
+    message.setRoot(notification);
+    root = message.getRoot<Notification>().asReader();
+  }
+
+ private:
+  capnp::MallocMessageBuilder message;
+  Notification::Reader root;
+};
+
+/**
+ * @brief 受信した通知を新しい順に capacity 件まで保持するストア
+ * @details 上限を超えると古いものから捨てる。id で引ける。
+ */
+class NotificationStore {
+ public:
+  explicit NotificationStore(size_t capacity = 1024) : capacity(capacity) {}
+
+  /**
+   * @brief 通知を保持する
+   * @details 同じ id が既にあれば置き換える
+   *
+   * @param notification 保持する通知
+   */
+  void put(kj::Own<const RetainedNotification> notification) {
+    const auto id = notification->get().getId();
+    auto [it, inserted] = entries.insert_or_assign(id, kj::mv(notification));
+    if (!inserted) return;
+    order.push_back(id);
+    while (order.size() > capacity) {
+      entries.erase(order.front());
+      order.pop_front();
+      ++evicted;
+    }
+  }
+
+  /**
+   * @brief id で通知を引く
+   *
+   * @param id 通知の id
+   * @return kj::Maybe<kj::Own<const RetainedNotification>> 保持していれば
+   * そのハンドル
+   */
+  kj::Maybe<kj::Own<const RetainedNotification>> find(uint64_t id) const {
+    auto it = entries.find(id);
+    if (it == entries.end()) return kj::none;
+    return it->second->addRef();
+  }
+
+  /**
+   * @brief 保持している通知を古い順に列挙する
+   *
+   * @param fn 各通知に対して呼ばれる関数
+   */
+  template <typename Fn>
+  void forEach(Fn&& fn) const {
+    for (const auto id : order) {
+      fn(entries.at(id)->get());
+    }
+  }
+
+  /// @brief 保持している件数
+  size_t size() const { return order.size(); }
+
+  /// @brief 上限を超えて捨てた件数
+  uint64_t getEvicted() const { return evicted; }
+
+ private:
+  const size_t capacity;
+  std::unordered_map<uint64_t, kj::Own<const RetainedNotification>> entries;
+  std::deque<uint64_t> order;  ///< 受け取った順の id
+  uint64_t evicted = 0;
+};
+
+#endif  // NOTIFICATION_STORE_HPP
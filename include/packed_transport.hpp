@@ -0,0 +1,380 @@
+#ifndef PACKED_TRANSPORT_HPP
+#define PACKED_TRANSPORT_HPP
+
+#include <capnp/message.h>
+#include <capnp/rpc-twoparty.h>
+#include <capnp/serialize-async.h>
+#include <capnp/serialize-packed.h>
+#include <capnp/serialize.h>
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/io.h>
+
+#include <cstdint>
+#include <cstring>
+
+#include "utility.hpp"
+
+/**
+ * @brief RPC メッセージの枠付け方式
+ */
+enum class WireFormat : uint8_t {
+  PLAIN = 0,   ///< 通常のセグメント表＋セグメント
+  PACKED = 1,  ///< Cap'n Proto の packed 符号化（ゼロのバイトを詰める）
+};
+
+/// @brief 表示用の名前
+inline const char* wireFormatName(WireFormat format) {
+  return format == WireFormat::PACKED ? "packed" : "plain";
+}
+
+/**
+ * @brief 枠付け方式の交渉で接続の先頭に送る 4 バイト
+ * @details 通常の枠付けでは先頭 4 バイトが「セグメント数 - 1」なので、
+ * この値（約 12 億セグメント）で始まる通常のメッセージはない
+ */
+constexpr kj::byte kWireFormatMagic[4] = {'C', 'P', 'N', 'G'};
+
+/**
+ * @brief packed 符号化したメッセージを長さ付きの枠で送受信する MessageStream
+ *
+ * 1 メッセージは「packed 後のバイト数（4 バイト、リトルエンディアン）」と
+ * packed したセグメント表＋セグメントからなる。
+ * packed 符号化は 8 バイトごとにゼロのバイトをタグ 1 バイトへ詰めるので、
+ * id・timestamp の上位バイトやポインタの空きが多い通知ほど小さくなる。
+ * 代わりに送受信ともに 1 バイトずつの符号化・復号の CPU を使う。
+ */
+class PackedMessageStream final : public capnp::MessageStream {
+ public:
+  explicit PackedMessageStream(kj::AsyncIoStream& stream) : stream(stream) {}
+
+  kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> tryReadMessage(
+      kj::ArrayPtr<kj::AutoCloseFd> fdSpace, capnp::ReaderOptions options,
+      kj::ArrayPtr<capnp::word> scratchSpace) override {
+    return readFrame(options);
+  }
+
+  kj::Promise<void> writeMessage(
+      kj::ArrayPtr<const int> fds,
+      kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> segments) override {
+    KJ_REQUIRE(fds.size() == 0, "packed transport cannot send fds");
+    auto frame = encodeFrame(segments);
+    auto bytes = frame.asPtr();
+    return stream.write(bytes.begin(), bytes.size()).attach(kj::mv(frame));
+  }
+
+  kj::Promise<void> writeMessages(
+      kj::ArrayPtr<kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>>>
+          messages) override {
+    // 複数のメッセージは 1 つのバッファにつないで 1 回で書く
+    kj::VectorOutputStream out;
+    for (const auto segments : messages) {
+      const auto frame = encodeFrame(segments);
+      out.write(frame.begin(), frame.size());
+    }
+    auto bytes = kj::heapArray<kj::byte>(out.getArray());
+    auto ptr = bytes.asPtr();
+    return stream.write(ptr.begin(), ptr.size()).attach(kj::mv(bytes));
+  }
+
+  kj::Maybe<int> getSendBufferSize() override { return kj::none; }
+
+  kj::Promise<void> end() override {
+    stream.shutdownWrite();
+    return kj::READY_NOW;
+  }
+
+  /**
+   * @brief セグメントを packed 符号化し、長さ付きの枠にする
+   *
+   * @param segments メッセージのセグメント
+   * @return kj::Array<kj::byte> 送信する枠
+   */
+  static kj::Array<kj::byte> encodeFrame(
+      kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> segments) {
+    kj::VectorOutputStream packed;
+    capnp::writePackedMessage(packed, segments);
+    const auto body = packed.getArray();
+    const auto size = static_cast<uint32_t>(body.size());
+    auto frame = kj::heapArray<kj::byte>(sizeof(size) + body.size());
+    std::memcpy(frame.begin(), &size, sizeof(size));
+    std::memcpy(frame.begin() + sizeof(size), body.begin(), body.size());
+    return frame;
+  }
+
+ private:
+  kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> readFrame(
+      capnp::ReaderOptions options) {
+    uint32_t size = 0;
+    const auto n = co_await stream.tryRead(&size, sizeof(size), sizeof(size));
+    if (n == 0) co_return kj::none;  // 相手が閉じた
+    KJ_REQUIRE(n == sizeof(size), "truncated packed frame header");
+    // packed は 1 ワードあたり最大 10 バイトなので、上限の 2 倍で抑える
+    KJ_REQUIRE(size <= options.traversalLimitInWords * sizeof(capnp::word) * 2,
+               "packed frame too large", size);
+
+    auto bytes = kj::heapArray<kj::byte>(size);
+    co_await stream.read(bytes.begin(), bytes.size());
+    auto input = kj::heap<kj::ArrayInputStream>(bytes);
+    auto reader = kj::heap<capnp::PackedMessageReader>(*input, options);
+    co_return capnp::MessageReaderAndFds{
+        kj::mv(reader).attach(kj::mv(input), kj::mv(bytes)), nullptr};
+  }
+
+  kj::AsyncIoStream& stream;
+};
+
+/**
+ * @brief 先に読んでしまった最初のメッセージを返してから、残りを
+ * 別の MessageStream に任せる MessageStream
+ * @details 交渉しないクライアントの接続で、交渉の有無を見るために
+ * 読んだ最初のメッセージを RPC に渡すために使う
+ */
+class ReplayMessageStream final : public capnp::MessageStream {
+ public:
+  ReplayMessageStream(kj::Own<capnp::MessageReader> first,
+                      kj::Own<capnp::MessageStream> inner)
+      : first(kj::mv(first)), inner(kj::mv(inner)) {}
+
+  kj::Promise<kj::Maybe<capnp::MessageReaderAndFds>> tryReadMessage(
+      kj::ArrayPtr<kj::AutoCloseFd> fdSpace, capnp::ReaderOptions options,
+      kj::ArrayPtr<capnp::word> scratchSpace) override {
+    KJ_IF_SOME(reader, first) {
+      auto own = kj::mv(reader);
+      first = kj::none;
+      return kj::Maybe<capnp::MessageReaderAndFds>(
+          capnp::MessageReaderAndFds{kj::mv(own), nullptr});
+    }
+    return inner->tryReadMessage(fdSpace, options, scratchSpace);
+  }
+
+  kj::Promise<void> writeMessage(
+      kj::ArrayPtr<const int> fds,
+      kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> segments) override {
+    return inner->writeMessage(fds, segments);
+  }
+
+  kj::Promise<void> writeMessages(
+      kj::ArrayPtr<kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>>>
+          messages) override {
+    return inner->writeMessages(messages);
+  }
+
+  kj::Maybe<int> getSendBufferSize() override {
+    return inner->getSendBufferSize();
+  }
+
+  kj::Promise<void> end() override { return inner->end(); }
+
+ private:
+  kj::Maybe<kj::Own<capnp::MessageReader>> first;
+  kj::Own<capnp::MessageStream> inner;
+};
+
+/**
+ * @brief 接続ごとに枠付け方式を交渉する 2 者間の RPC 接続
+ *
+ * クライアントは接続直後に kWireFormatMagic と希望する方式（1 バイト）を
+ * 送り、サーバーは採用した方式（1 バイト）を返す。以降の RPC メッセージは
+ * その方式で枠付けする。サーバーが packed を許可していなければ plain に
+ * なる。
+ *
+ * 交渉をしない従来のクライアント（EzRpcClient など）の接続は、先頭 4 バイトが
+ * kWireFormatMagic でないことで見分け、そのまま plain として受け付ける。
+ */
+class NegotiatedConnection {
+ public:
+  /**
+   * @brief サーバーへ接続し、枠付け方式を交渉する
+   *
+   * @param network 接続に使うネットワーク
+   * @param host    接続先（"host" または "host:port"）
+   * @param port    host にポートがない場合のポート
+   * @param want    希望する方式
+   * @return kj::Promise<kj::Own<NegotiatedConnection>> 交渉済みの接続
+   */
+  static kj::Promise<kj::Own<NegotiatedConnection>> connect(
+      kj::Network& network, kj::String host, uint32_t port, WireFormat want) {
+    auto address = co_await network.parseAddress(host, port);
+    auto stream = co_await address->connect();
+
+    const kj::byte hello[5] = {kWireFormatMagic[0], kWireFormatMagic[1],
+                               kWireFormatMagic[2], kWireFormatMagic[3],
+                               static_cast<kj::byte>(want)};
+    co_await stream->write(hello, sizeof(hello));
+    kj::byte reply = 0;
+    co_await stream->read(&reply, 1);
+    const auto format = static_cast<WireFormat>(reply);
+    KJ_REQUIRE(format == WireFormat::PLAIN || format == WireFormat::PACKED,
+               "unknown wire format", reply);
+
+    auto messages = makeMessageStream(*stream, format);
+    co_return kj::heap<NegotiatedConnection>(
+        kj::mv(stream), kj::mv(messages), capnp::rpc::twoparty::Side::CLIENT,
+        format, kj::none);
+  }
+
+  /**
+   * @brief 受け付けた接続で枠付け方式を交渉する
+   *
+   * @param stream       受け付けた接続
+   * @param bootstrap    クライアントに渡す capability
+   * @param allow_packed packed を許可するか
+   * @return kj::Promise<kj::Own<NegotiatedConnection>> 交渉済みの接続
+   */
+  static kj::Promise<kj::Own<NegotiatedConnection>> accept(
+      kj::Own<kj::AsyncIoStream> stream, capnp::Capability::Client bootstrap,
+      bool allow_packed) {
+    kj::byte head[4];
+    co_await stream->read(head, sizeof(head));
+
+    if (std::memcmp(head, kWireFormatMagic, sizeof(head)) != 0) {
+      // 交渉しないクライアント。読んだ 4 バイトは最初のメッセージの先頭
+      uint32_t segments_minus_one = 0;
+      std::memcpy(&segments_minus_one, head, sizeof(head));
+      auto first = co_await readPlainMessage(*stream, segments_minus_one);
+      kj::Own<capnp::MessageStream> messages = kj::heap<ReplayMessageStream>(
+          kj::mv(first), kj::heap<capnp::AsyncIoMessageStream>(*stream));
+      co_return kj::heap<NegotiatedConnection>(
+          kj::mv(stream), kj::mv(messages),
+          capnp::rpc::twoparty::Side::SERVER, WireFormat::PLAIN,
+          kj::mv(bootstrap));
+    }
+
+    kj::byte want = 0;
+    co_await stream->read(&want, 1);
+    const auto format =
+        allow_packed && want == static_cast<kj::byte>(WireFormat::PACKED)
+            ? WireFormat::PACKED
+            : WireFormat::PLAIN;
+    const auto reply = static_cast<kj::byte>(format);
+    co_await stream->write(&reply, 1);
+
+    auto messages = makeMessageStream(*stream, format);
+    co_return kj::heap<NegotiatedConnection>(
+        kj::mv(stream), kj::mv(messages), capnp::rpc::twoparty::Side::SERVER,
+        format, kj::mv(bootstrap));
+  }
+
+  NegotiatedConnection(kj::Own<kj::AsyncIoStream> stream,
+                       kj::Own<capnp::MessageStream> messages,
+                       capnp::rpc::twoparty::Side side, WireFormat format,
+                       kj::Maybe<capnp::Capability::Client> bootstrap)
+      : stream(kj::mv(stream)),
+        messages(kj::mv(messages)),
+        network(*this->messages, side),
+        rpc(makeRpcSystem(network, kj::mv(bootstrap))),
+        format(format) {}
+
+  KJ_DISALLOW_COPY_AND_MOVE(NegotiatedConnection);
+
+  /// @brief 相手（サーバー）の bootstrap capability
+  template <typename T>
+  typename T::Client bootstrap() {
+    capnp::MallocMessageBuilder message(4);
+    auto vat_id = message.getRoot<capnp::rpc::twoparty::VatId>();
+    vat_id.setSide(capnp::rpc::twoparty::Side::SERVER);
+    return rpc.bootstrap(vat_id).castAs<T>();
+  }
+
+  /// @brief 切断で完了するプロミス
+  kj::Promise<void> onDisconnect() { return network.onDisconnect(); }
+
+  /// @brief 交渉で決まった枠付け方式
+  WireFormat getFormat() const { return format; }
+
+ private:
+  static kj::Own<capnp::MessageStream> makeMessageStream(
+      kj::AsyncIoStream& stream, WireFormat format) {
+    if (format == WireFormat::PACKED) {
+      return kj::heap<PackedMessageStream>(stream);
+    }
+    return kj::heap<capnp::AsyncIoMessageStream>(stream);
+  }
+
+  static capnp::RpcSystem<capnp::rpc::twoparty::VatId> makeRpcSystem(
+      capnp::TwoPartyVatNetwork& network,
+      kj::Maybe<capnp::Capability::Client> bootstrap) {
+    KJ_IF_SOME(cap, bootstrap) {
+      return capnp::makeRpcServer(network, kj::mv(cap));
+    }
+    return capnp::makeRpcClient(network);
+  }
+
+  /**
+   * @brief 先頭 4 バイトを読んだ後の、通常の枠付けのメッセージを読む
+   *
+   * @param stream             接続
+   * @param segments_minus_one 読んだ先頭 4 バイト（セグメント数 - 1）
+   */
+  static kj::Promise<kj::Own<capnp::MessageReader>> readPlainMessage(
+      kj::AsyncIoStream& stream, uint32_t segments_minus_one) {
+    const capnp::ReaderOptions options;
+    KJ_REQUIRE(segments_minus_one < 512, "too many segments",
+               segments_minus_one);
+    const uint32_t count = segments_minus_one + 1;
+
+    // 残りのセグメント表: サイズ × count と、8 バイト境界までの詰め物
+    const size_t table_bytes = count * 4 + (count % 2 == 0 ? 4 : 0);
+    auto table = kj::heapArray<kj::byte>(table_bytes);
+    co_await stream.read(table.begin(), table.size());
+
+    auto sizes = kj::heapArray<uint32_t>(count);
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      std::memcpy(&sizes[i], table.begin() + i * 4, 4);
+      total += sizes[i];
+    }
+    KJ_REQUIRE(total <= options.traversalLimitInWords, "message too large",
+               total);
+
+    auto words = kj::heapArray<capnp::word>(total);
+    if (total > 0) {
+      co_await stream.read(words.begin(), total * sizeof(capnp::word));
+    }
+    auto segments = kj::heapArray<kj::ArrayPtr<const capnp::word>>(count);
+    size_t offset = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      segments[i] = words.slice(offset, offset + sizes[i]);
+      offset += sizes[i];
+    }
+    auto reader =
+        kj::heap<capnp::SegmentArrayMessageReader>(segments.asPtr(), options);
+    co_return kj::mv(reader).attach(kj::mv(segments), kj::mv(words));
+  }
+
+  kj::Own<kj::AsyncIoStream> stream;
+  kj::Own<capnp::MessageStream> messages;
+  capnp::TwoPartyVatNetwork network;
+  capnp::RpcSystem<capnp::rpc::twoparty::VatId> rpc;
+  WireFormat format;
+};
+
+/**
+ * @brief 接続を受け付け、交渉した方式で bootstrap を提供し続ける
+ *
+ * @param listener     待ち受け
+ * @param bootstrap    各接続に渡す capability
+ * @param allow_packed packed を許可するか
+ * @param tasks        接続ごとの処理の追加先（接続は切断まで保持される）
+ * @return kj::Promise<void> 待ち受けを続けるプロミス
+ */
+inline kj::Promise<void> serveNegotiated(kj::ConnectionReceiver& listener,
+                                         capnp::Capability::Client bootstrap,
+                                         bool allow_packed,
+                                         kj::TaskSet& tasks) {
+  while (true) {
+    auto stream = co_await listener.accept();
+    tasks.add(NegotiatedConnection::accept(kj::mv(stream), bootstrap,
+                                           allow_packed)
+                  .then([](kj::Own<NegotiatedConnection> connection) {
+                    LOG_COUT << "[Transport] accepted connection ("
+                             << wireFormatName(connection->getFormat()) << ")"
+                             << std::endl;
+                    auto disconnected = connection->onDisconnect();
+                    return disconnected.attach(kj::mv(connection));
+                  }));
+  }
+}
+
+#endif  // PACKED_TRANSPORT_HPP
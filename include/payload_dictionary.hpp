@@ -0,0 +1,425 @@
+#ifndef PAYLOAD_DICTIONARY_HPP
+#define PAYLOAD_DICTIONARY_HPP
+
+#include <capnp/message.h>
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <notification_store.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "notification.capnp.h"
+
+/**
+ * @brief 共有辞書を使うペイロードの圧縮と、辞書の学習
+ *
+ * 形式は LZ77 系の単純なもので、辞書の後ろに入力が続いているとみなして
+ * 一致を探す。辞書に頻出の断片があるので、1 件ごとの短いペイロードでも
+ * 最初から一致が見つかる。
+ *
+ * 圧縮データ: 元の長さ（varint）の後に、次の組を繰り返す
+ * - リテラル長（varint）とリテラル
+ * - （元の長さに達していなければ）一致長 - 4（varint）と距離（varint）。
+ *   距離は「辞書＋復元済みの出力」の末尾から数える
+ */
+class PayloadCodec {
+ public:
+  /// 一致とみなす最短の長さ
+  static constexpr size_t kMinMatch = 4;
+  /// 一致を探すハッシュ表の大きさ（2 の冪）
+  static constexpr uint32_t kTableBits = 12;
+  static constexpr size_t kTableSize = size_t{1} << kTableBits;
+
+  /// 学習済みの辞書と、圧縮用に前計算したハッシュ表
+  struct Dictionary {
+    uint32_t id = 0;
+    std::string kind;
+    std::vector<uint8_t> bytes;
+    std::vector<int32_t> table;  ///< 4 バイト列のハッシュ → 辞書内の位置
+  };
+
+  /**
+   * @brief 辞書を作る（ハッシュ表も前計算する）
+   *
+   * @param id    辞書の番号（サーバー全体で一意）
+   * @param kind  辞書を使う kind
+   * @param bytes 辞書の中身
+   */
+  static Dictionary makeDictionary(uint32_t id, std::string kind,
+                                   std::vector<uint8_t> bytes) {
+    Dictionary dictionary{id, std::move(kind), std::move(bytes),
+                          std::vector<int32_t>(kTableSize, -1)};
+    const auto& b = dictionary.bytes;
+    for (size_t p = 0; p + kMinMatch <= b.size(); ++p) {
+      dictionary.table[hash(read32(b.data() + p))] = static_cast<int32_t>(p);
+    }
+    return dictionary;
+  }
+
+  /**
+   * @brief 辞書を使って圧縮する
+   *
+   * @param dictionary 辞書
+   * @param input      元のペイロード
+   * @return std::vector<uint8_t> 圧縮データ
+   */
+  static std::vector<uint8_t> compress(const Dictionary& dictionary,
+                                       const std::vector<uint8_t>& input) {
+    const auto& dict = dictionary.bytes;
+    const size_t base = dict.size();
+    const size_t n = input.size();
+    // 辞書と入力を続けて読むための窓（位置 p は辞書の先頭から数える）
+    auto at = [&](size_t p) { return p < base ? dict[p] : input[p - base]; };
+    auto word = [&](size_t p) {
+      uint32_t v = 0;
+      for (size_t k = 0; k < 4; ++k) v |= uint32_t{at(p + k)} << (8 * k);
+      return v;
+    };
+
+    std::vector<uint8_t> out;
+    out.reserve(n / 2 + 16);
+    putVarint(out, n);
+    auto table = dictionary.table;
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + kMinMatch <= n) {
+      const size_t pos = base + i;
+      const auto h = hash(word(pos));
+      const auto candidate = table[h];
+      table[h] = static_cast<int32_t>(pos);
+      if (candidate < 0 || word(candidate) != word(pos)) {
+        ++i;
+        continue;
+      }
+      size_t length = kMinMatch;
+      while (i + length < n && at(candidate + length) == at(pos + length)) {
+        ++length;
+      }
+      putVarint(out, i - anchor);
+      out.insert(out.end(), input.begin() + anchor, input.begin() + i);
+      putVarint(out, length - kMinMatch);
+      putVarint(out, pos - candidate);
+      i += length;
+      anchor = i;
+    }
+    putVarint(out, n - anchor);
+    out.insert(out.end(), input.begin() + anchor, input.end());
+    return out;
+  }
+
+  /**
+   * @brief 圧縮データを復元する
+   *
+   * @param dict  圧縮に使った辞書の中身
+   * @param input 圧縮データ
+   * @param limit 復元後の長さの上限
+   * @return std::vector<uint8_t> 元のペイロード
+   */
+  static std::vector<uint8_t> decompress(kj::ArrayPtr<const kj::byte> dict,
+                                         kj::ArrayPtr<const kj::byte> input,
+                                         size_t limit = 64 << 20) {
+    size_t in = 0;
+    const auto size = getVarint(input, in);
+    KJ_REQUIRE(size <= limit, "decompressed payload too large", size);
+    std::vector<uint8_t> out;
+    out.reserve(size);
+    const size_t base = dict.size();
+    while (true) {
+      const auto literals = getVarint(input, in);
+      KJ_REQUIRE(literals <= input.size() - in &&
+                     literals <= size - out.size(),
+                 "corrupt compressed payload");
+      out.insert(out.end(), input.begin() + in, input.begin() + in + literals);
+      in += literals;
+      if (out.size() == size) break;
+
+      const auto length = getVarint(input, in) + kMinMatch;
+      const auto distance = getVarint(input, in);
+      const size_t end = base + out.size();
+      KJ_REQUIRE(distance >= 1 && distance <= end &&
+                     length <= size - out.size(),
+                 "corrupt compressed payload");
+      // 一致は重なってよいので 1 バイトずつ写す
+      for (size_t p = end - distance, k = 0; k < length; ++p, ++k) {
+        out.push_back(p < base ? dict[p] : out[p - base]);
+      }
+    }
+    return out;
+  }
+
+  /**
+   * @brief 標本から辞書を学習する
+   * @details 複数の標本に現れる 8 バイト列を、現れた標本の数の多い順に
+   * 選び、最初に現れた位置から 32 バイトの断片を辞書に入れる。よく使う
+   * 断片ほど辞書の末尾（＝距離が短く符号が小さくなる側）に置く
+   *
+   * @param samples   最近のペイロード
+   * @param max_bytes 辞書の最大バイト数
+   * @return std::vector<uint8_t> 辞書の中身
+   */
+  static std::vector<uint8_t> train(
+      const std::deque<std::vector<uint8_t>>& samples, size_t max_bytes) {
+    constexpr size_t kGram = 8;
+    constexpr size_t kSegment = 32;
+    struct Candidate {
+      uint32_t count = 0;
+      size_t sample = 0;
+      size_t pos = 0;
+      size_t last_seen = SIZE_MAX;
+    };
+    std::unordered_map<uint64_t, Candidate> grams;
+    for (size_t s = 0; s < samples.size(); ++s) {
+      const auto& sample = samples[s];
+      for (size_t p = 0; p + kGram <= sample.size(); ++p) {
+        uint64_t key = 0;
+        std::memcpy(&key, sample.data() + p, kGram);
+        auto& c = grams[key];
+        if (c.last_seen == s) continue;  // 標本ごとに 1 回だけ数える
+        if (c.count == 0) {
+          c.sample = s;
+          c.pos = p;
+        }
+        c.last_seen = s;
+        ++c.count;
+      }
+    }
+
+    std::vector<const Candidate*> ranked;
+    for (const auto& [key, c] : grams) {
+      if (c.count >= 2) ranked.push_back(&c);
+    }
+    std::sort(ranked.begin(), ranked.end(),
+              [](const Candidate* a, const Candidate* b) {
+                return a->count != b->count ? a->count > b->count
+                                            : a->pos < b->pos;
+              });
+
+    std::string picked;
+    std::vector<std::string> segments;
+    for (const auto* c : ranked) {
+      const auto& sample = samples[c->sample];
+      const std::string gram(sample.begin() + c->pos,
+                             sample.begin() + c->pos + kGram);
+      if (picked.find(gram) != std::string::npos) continue;
+      const auto end = std::min(sample.size(), c->pos + kSegment);
+      if (picked.size() + (end - c->pos) > max_bytes) break;
+      segments.emplace_back(sample.begin() + c->pos, sample.begin() + end);
+      picked += segments.back();
+    }
+
+    std::vector<uint8_t> dictionary;
+    for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+      dictionary.insert(dictionary.end(), it->begin(), it->end());
+    }
+    return dictionary;
+  }
+
+ private:
+  static uint32_t read32(const uint8_t* p) {
+    uint32_t v = 0;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static size_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - kTableBits);
+  }
+
+  static void putVarint(std::vector<uint8_t>& out, uint64_t v) {
+    while (v >= 0x80) {
+      out.push_back(static_cast<uint8_t>(v | 0x80));
+      v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+  }
+
+  static uint64_t getVarint(kj::ArrayPtr<const kj::byte> in, size_t& pos) {
+    uint64_t v = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7) {
+      KJ_REQUIRE(pos < in.size(), "truncated compressed payload");
+      const auto b = in[pos++];
+      v |= uint64_t{b & 0x7fu} << shift;
+      if ((b & 0x80) == 0) return v;
+    }
+    KJ_FAIL_REQUIRE("varint too long");
+  }
+};
+
+/**
+ * @brief kind ごとに辞書を学習し、ペイロードを圧縮するサーバー側の辞書管理
+ *
+ * kind ごとに最近のペイロードを標本として持ち、一定件数ごとに辞書を
+ * 学習し直して新しい番号（版）を振る。通知が参照している古い版も
+ * しばらく残すが、上限を超えて捨てた版を参照する通知は非圧縮で送る。
+ *
+ * 圧縮は通知の発行時に 1 回だけ行い、結果をログに持たせる。購読者ごとには
+ * 圧縮しない。
+ */
+class PayloadDictionaryTrainer {
+ public:
+  struct Options {
+    size_t samples = 64;            ///< kind ごとに持つ標本の数
+    size_t retrain_every = 256;     ///< この件数ごとに学習し直す
+    size_t dictionary_bytes = 4096; ///< 辞書の最大バイト数
+    size_t min_payload = 32;        ///< これより短いペイロードは圧縮しない
+    size_t max_payload = 64 << 10;  ///< これより長いペイロードも圧縮しない
+    size_t versions = 4;            ///< kind ごとに残す版の数
+  };
+
+  /// 圧縮の結果
+  struct Compressed {
+    uint32_t dictionary_id = 0;  ///< 0 なら圧縮しなかった
+    std::vector<uint8_t> bytes;
+  };
+
+  PayloadDictionaryTrainer() : PayloadDictionaryTrainer(Options{}) {}
+  explicit PayloadDictionaryTrainer(Options options) : options(options) {}
+
+  /**
+   * @brief ペイロードを kind の現在の辞書で圧縮し、学習用の標本に加える
+   * @details 辞書がない・短い・長い・縮まない場合は圧縮しない。長い
+   * ペイロードは標本にも加えない（分けて送る大きな中身など）
+   *
+   * @param kind    通知の種類
+   * @param payload 元のペイロード
+   * @return Compressed 圧縮の結果
+   */
+  Compressed compress(const std::string& kind,
+                      const std::vector<uint8_t>& payload) {
+    Compressed result;
+    if (payload.size() < options.min_payload ||
+        payload.size() > options.max_payload) {
+      return result;
+    }
+    auto& state = kinds[kind];
+    if (!state.versions.empty()) {
+      const auto& dictionary = dictionaries.at(state.versions.back());
+      auto bytes = PayloadCodec::compress(dictionary, payload);
+      if (bytes.size() < payload.size()) {
+        result.dictionary_id = dictionary.id;
+        result.bytes = std::move(bytes);
+      }
+    }
+    observe(kind, state, payload);
+    return result;
+  }
+
+  /**
+   * @brief 番号 id の辞書
+   *
+   * @return const PayloadCodec::Dictionary* 捨てた版なら nullptr
+   */
+  const PayloadCodec::Dictionary* find(uint32_t id) const {
+    auto it = dictionaries.find(id);
+    return it == dictionaries.end() ? nullptr : &it->second;
+  }
+
+  /**
+   * @brief 各 kind の最新の辞書を列挙する
+   */
+  void forEachCurrent(
+      const std::function<void(const PayloadCodec::Dictionary&)>& fn) const {
+    for (const auto& [kind, state] : kinds) {
+      if (!state.versions.empty()) fn(dictionaries.at(state.versions.back()));
+    }
+  }
+
+  /// @brief 学習した回数
+  uint64_t getTrained() const { return trained; }
+
+ private:
+  struct KindState {
+    std::deque<std::vector<uint8_t>> samples;
+    size_t since_training = 0;
+    std::deque<uint32_t> versions;  ///< 残している版（古い順）
+  };
+
+  void observe(const std::string& kind, KindState& state,
+               const std::vector<uint8_t>& payload) {
+    state.samples.push_back(payload);
+    if (state.samples.size() > options.samples) state.samples.pop_front();
+    // 最初の辞書は標本がそろった時点で、以降は retrain_every 件ごとに作る
+    const auto due = state.versions.empty() ? options.samples
+                                            : options.retrain_every;
+    if (++state.since_training < due) return;
+    state.since_training = 0;
+
+    auto bytes = PayloadCodec::train(state.samples, options.dictionary_bytes);
+    if (bytes.empty()) return;
+    const auto id = next_id++;
+    dictionaries.emplace(
+        id, PayloadCodec::makeDictionary(id, kind, std::move(bytes)));
+    state.versions.push_back(id);
+    while (state.versions.size() > options.versions) {
+      dictionaries.erase(state.versions.front());
+      state.versions.pop_front();
+    }
+    ++trained;
+  }
+
+  Options options;
+  std::unordered_map<std::string, KindState> kinds;
+  std::unordered_map<uint32_t, PayloadCodec::Dictionary> dictionaries;
+  uint32_t next_id = 1;
+  uint64_t trained = 0;
+};
+
+/**
+ * @brief onDictionaries で受け取った辞書で、圧縮されたペイロードを戻す
+ * クライアント側の辞書
+ */
+class PayloadDecompressor {
+ public:
+  /**
+   * @brief 届いた辞書を登録する
+   * @details 同じ kind の古い版は kMaxVersions 個まで残す
+   */
+  void add(capnp::List<PayloadDictionary>::Reader list) {
+    for (const auto dictionary : list) {
+      if (dictionaries.count(dictionary.getId()) > 0) continue;
+      const auto data = dictionary.getData();
+      dictionaries[dictionary.getId()].assign(data.begin(), data.end());
+      auto& versions = by_kind[dictionary.getKind().cStr()];
+      versions.push_back(dictionary.getId());
+      while (versions.size() > kMaxVersions) {
+        dictionaries.erase(versions.front());
+        versions.pop_front();
+      }
+    }
+  }
+
+  /**
+   * @brief ペイロードを戻した通知を保持する
+   * @details 圧縮されていなければそのまま保持する
+   *
+   * @param notification 受信した通知
+   * @return kj::Own<const RetainedNotification> 非圧縮の通知
+   */
+  kj::Own<const RetainedNotification> decode(
+      Notification::Reader notification) const {
+    const auto id = notification.getPayloadDictionary();
+    if (id == 0) return RetainedNotification::retain(notification);
+    auto it = dictionaries.find(id);
+    KJ_REQUIRE(it != dictionaries.end(), "unknown payload dictionary", id);
+
+    const auto payload = PayloadCodec::decompress(
+        kj::arrayPtr(it->second.data(), it->second.size()),
+        notification.getPayload());
+    return RetainedNotification::withPayload(
+        notification, kj::arrayPtr(payload.data(), payload.size()));
+  }
+
+ private:
+  static constexpr size_t kMaxVersions = 8;
+
+  std::unordered_map<uint32_t, std::vector<uint8_t>> dictionaries;
+  std::unordered_map<std::string, std::deque<uint32_t>> by_kind;
+};
+
+#endif  // PAYLOAD_DICTIONARY_HPP
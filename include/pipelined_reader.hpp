@@ -0,0 +1,147 @@
+#ifndef PIPELINED_READER_HPP
+#define PIPELINED_READER_HPP
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+
+#include "notification.capnp.h"
+#include "utility.hpp"
+
+/**
+ * @brief NotificationStream に対して複数の read() を同時に投げておくクラス
+ *
+ * `read()` を 1 件ずつ待つと、受信量は 1 往復あたり 1 件で頭打ちになる。
+ * このクラスは常に `window` 件の `read()` を送信済みにしておき、結果は
+ * 送った順に `next()` で返す。
+ *
+ * window はリトルの法則に従って調整する。1 件あたりの最小の往復時間
+ * (minRtt) と、結果が届く間隔 (interval) の移動平均から
+ * `minRtt / interval + 1`（帯域遅延積）を求める。往復がボトルネックの間は
+ * interval が rtt / window なので window が 1 ずつ広がり、サーバーの
+ * 送出速度が上限になったところで止まる。平均の往復時間は待ち行列での
+ * 待ちを含み、window を広げるほど伸びて window をさらに広げてしまうので
+ * 使わない。最小値は kMinRttWindow ごとに測り直し、経路の変化に追従する。
+ *
+ * stream には `subscribe()` のパイプライン結果をそのまま渡してよい。
+ * その場合、最初の read() は subscribe の応答を待たずに送られる。
+ */
+class PipelinedStreamReader {
+ public:
+  using Response = capnp::Response<NotificationStream::ReadResults>;
+
+  /**
+   * @brief コンストラクタ
+   *
+   * @param stream    読み出し元のストリーム
+   * @param timer     往復時間の測定に使うタイマー
+   * @param minWindow 同時に送る read() の下限
+   * @param maxWindow 同時に送る read() の上限
+   */
+  PipelinedStreamReader(NotificationStream::Client stream, kj::Timer& timer,
+                        uint32_t minWindow = 1, uint32_t maxWindow = 64)
+      : stream(kj::mv(stream)),
+        timer(timer),
+        minWindow(std::max<uint32_t>(1, minWindow)),
+        maxWindow(std::max(this->minWindow, maxWindow)),
+        window(this->minWindow) {
+    fill();
+  }
+
+  KJ_DISALLOW_COPY_AND_MOVE(PipelinedStreamReader);
+
+  /**
+   * @brief 次の read() の結果を送信順に受け取る
+   * @details 結果を受け取るたびに window まで read() を補充する。
+   * `hasResult()` が false の結果はストリームの終端で、以降は補充しない。
+   *
+   * @return kj::Promise<Response> read() の結果
+   */
+  kj::Promise<Response> next() {
+    fill();
+    KJ_REQUIRE(!inflight.empty(), "stream ended");
+    auto promise = kj::mv(inflight.front());
+    inflight.pop_front();
+    return promise.then([this](Response&& response) {
+      if (response.hasResult()) {
+        fill();
+      } else {
+        ended = true;
+      }
+      return kj::mv(response);
+    });
+  }
+
+  /// @brief 現在の window
+  uint32_t getWindow() const { return window; }
+
+  /// @brief 往復時間の移動平均
+  kj::Duration getRtt() const { return rtt; }
+
+  /// @brief 直近 kMinRttWindow の最小の往復時間
+  kj::Duration getMinRtt() const { return minRtt; }
+
+ private:
+  /// 最小の往復時間を測り直す間隔
+  static constexpr kj::Duration kMinRttWindow = 10 * kj::SECONDS;
+
+  /// @brief window に達するまで read() を送る
+  void fill() {
+    while (!ended && inflight.size() < window) {
+      const auto sent_at = timer.now();
+      inflight.push_back(stream.readRequest().send().then(
+          [this, sent_at](Response&& response) {
+            onCompleted(sent_at);
+            return kj::mv(response);
+          }));
+    }
+  }
+
+  /**
+   * @brief read() 1 件の完了を記録し、window を調整する
+   *
+   * @param sent_at その read() を送った時刻
+   */
+  void onCompleted(kj::TimePoint sent_at) {
+    const auto now = timer.now();
+    const auto sample = now - sent_at;
+    rtt = rtt == 0 * kj::NANOSECONDS ? sample : (rtt * 7 + sample) / 8;
+    if (minRtt == 0 * kj::NANOSECONDS || sample <= minRtt ||
+        now - minRttAt > kMinRttWindow) {
+      minRtt = sample;
+      minRttAt = now;
+    }
+    KJ_IF_SOME(last, lastArrival) {
+      const auto gap = now - last;
+      interval =
+          interval == 0 * kj::NANOSECONDS ? gap : (interval * 7 + gap) / 8;
+    }
+    lastArrival = now;
+
+    if (interval > 0 * kj::NANOSECONDS) {
+      const auto target = minRtt / interval + 1;
+      window = static_cast<uint32_t>(std::clamp<int64_t>(
+          target, static_cast<int64_t>(minWindow),
+          static_cast<int64_t>(maxWindow)));
+    }
+  }
+
+  NotificationStream::Client stream;
+  kj::Timer& timer;
+  const uint32_t minWindow;
+  const uint32_t maxWindow;
+  uint32_t window;  ///< 同時に送る read() の数
+  bool ended = false;
+
+  std::deque<kj::Promise<Response>> inflight;  ///< 送信済みの read()（送信順）
+  kj::Duration rtt = 0 * kj::NANOSECONDS;       ///< 往復時間の移動平均
+  kj::Duration minRtt = 0 * kj::NANOSECONDS;    ///< 最小の往復時間
+  kj::TimePoint minRttAt = kj::origin<kj::TimePoint>();  ///< minRtt の測定時刻
+  kj::Duration interval = 0 * kj::NANOSECONDS;  ///< 到着間隔の移動平均
+  kj::Maybe<kj::TimePoint> lastArrival;
+};
+
+#endif  // PIPELINED_READER_HPP
@@ -0,0 +1,287 @@
+#ifndef RESILIENT_SESSION_HPP
+#define RESILIENT_SESSION_HPP
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <dedup_window.hpp>
+#include <functional>
+#include <packed_transport.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "notification.capnp.h"
+#include "utility.hpp"
+
+/**
+ * @brief 切断されても自動で再接続し、続きから購読を再開するセッション
+ *
+ * 接続が切れると、指数バックオフにフルジッタ（0 から上限までの一様乱数）を
+ * かけた時間だけ待って再接続する。多数のクライアントが同時に切断されても
+ * 再接続の時刻がばらけるので、サーバーの復帰直後に接続が殺到しない。
+ *
+ * 再接続後は `subscribeMany` で全フィルタを 1 回の呼び出しで購読し直し、
+ * 最後に受け取った id の次から配信させる。サーバーのログに残っている
+ * 範囲なら、切断中の通知だけが再送される。既に受け取った id は
+ * DedupWindow で捨てる。
+ *
+ * 再起動したサーバーは id を振り直し、ログも失っているので、切断中の
+ * 通知は再送できない。購読の前に getEpoch でエポックを比べ、変わって
+ * いたら受け取った id を忘れて、新しいサーバーに残っている最も古い
+ * 通知から受け取る（前の id のままでは新しい通知を重複として捨てて
+ * しまう）。フォロワーはリーダーのエポックを引き継ぐので、切り替えでは
+ * そのまま続きから再開する。
+ *
+ * EzRpcClient は切断を通知しないため、NegotiatedConnection で接続を張り、
+ * onDisconnect() で切断を検知する。枠付け方式は接続のたびに交渉する。
+ */
+class ResilientSession {
+ public:
+  /// 通知を受け取るハンドラ（イベントループのスレッドで呼ばれる）
+  using Handler = std::function<void(Notification::Reader)>;
+
+  /// 再接続の設定
+  struct Options {
+    kj::Duration initialBackoff = 100 * kj::MILLISECONDS;
+    kj::Duration maxBackoff = 30 * kj::SECONDS;
+    WireFormat format = WireFormat::PLAIN;  ///< 希望する枠付け方式
+  };
+
+  /**
+   * @brief コンストラクタ
+   *
+   * @param io      ネットワークとタイマーの提供元
+   * @param host    接続先のホスト
+   * @param port    接続先のポート
+   * @param filters 購読するフィルタ（再接続時もまとめて復元する）
+   * @param handler 通知を受け取るハンドラ
+   * @param options 再接続の設定
+   */
+  ResilientSession(kj::AsyncIoProvider& io, std::string host, uint32_t port,
+                   std::vector<std::string> filters, Handler handler,
+                   Options options)
+      : io(io),
+        host(kj::mv(host)),
+        port(port),
+        filters(kj::mv(filters)),
+        handler(kj::mv(handler)),
+        options(options),
+        random(std::random_device()()) {
+    KJ_REQUIRE(!this->filters.empty(), "at least one filter is required");
+  }
+
+  ResilientSession(kj::AsyncIoProvider& io, std::string host, uint32_t port,
+                   std::vector<std::string> filters, Handler handler)
+      : ResilientSession(io, kj::mv(host), port, kj::mv(filters),
+                         kj::mv(handler), Options{}) {}
+
+  KJ_DISALLOW_COPY_AND_MOVE(ResilientSession);
+
+  /**
+   * @brief 接続・購読・再接続を stop() まで繰り返す
+   *
+   * @return kj::Promise<void> stop() 後に完了するプロミス
+   */
+  kj::Promise<void> run() {
+    while (!stopped) {
+      try {
+        co_await canceler.wrap(connectOnce());
+      } catch (kj::Exception& e) {
+        if (!stopped) {
+          LOG_COUT << "[Session] connection failed: "
+                   << e.getDescription().cStr() << std::endl;
+        }
+      }
+      subscription = kj::none;
+      if (stopped) break;
+
+      const auto delay = nextBackoff();
+      LOG_COUT << "[Session] reconnecting in " << delay / kj::MILLISECONDS
+               << " ms" << std::endl;
+      co_await canceler.wrap(io.getTimer().afterDelay(delay))
+          .catch_([](kj::Exception&&) {});
+    }
+  }
+
+  /**
+   * @brief 購読を cancel し、run() を終わらせる
+   * @details 接続も閉じるので、cancel が届かなくてもサーバーは切断として
+   * 購読を回収する
+   */
+  void stop() {
+    stopped = true;
+    KJ_IF_SOME(s, subscription) {
+      // 切断で失敗しても構わないので結果は待たない
+      (void)s.cancelRequest().send().ignoreResult();
+    }
+    canceler.cancel("session stopped");
+  }
+
+  /// @brief 最後に受け取った通知の id
+  uint64_t getLastId() const { return lastId; }
+
+  /// @brief 購読に成功した回数（初回を含む）
+  uint64_t getConnects() const { return connects; }
+
+  /// @brief 再送で届いた受信済みの通知を捨てた数
+  uint64_t getDuplicates() const {
+    return dedup.getDuplicates() + dedup.getStale();
+  }
+
+ private:
+  /// @brief 受信した通知をセッションへ渡す受信側
+  class ReceiverImpl final : public PollingNotificationReceiver::Server {
+   public:
+    explicit ReceiverImpl(ResilientSession& session) : session(session) {}
+
+    kj::Promise<void> onNotification(OnNotificationContext context) override {
+      session.received(context.getParams().getNotification());
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> onNotifications(
+        OnNotificationsContext context) override {
+      for (const auto n : context.getParams().getNotifications()) {
+        session.received(n);
+      }
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> onClosed(OnClosedContext context) override {
+      session.closed(context.getParams().getReason());
+      return kj::READY_NOW;
+    }
+
+   private:
+    ResilientSession& session;
+  };
+
+  /**
+   * @brief 1 回分の接続: 接続して購読し、切断されるか、サーバーが購読を
+   * 打ち切るまで待つ
+   * @details stop() で中断されると接続ごと破棄される。打ち切られたときも
+   * 接続を破棄し、run() が続きから購読し直す
+   */
+  kj::Promise<void> connectOnce() {
+    auto connection = co_await NegotiatedConnection::connect(
+        io.getNetwork(), kj::str(host.c_str()), port, options.format);
+    auto notifier = connection->bootstrap<PollingNotifier>();
+    auto closedPaf = kj::newPromiseAndFulfiller<void>();
+    closedFulfiller = kj::mv(closedPaf.fulfiller);
+
+    auto from = co_await subscribe(notifier);
+    KJ_IF_SOME(id, from) {
+      LOG_COUT << "[Session] connected ("
+               << wireFormatName(connection->getFormat()) << "), resume from "
+               << id << std::endl;
+    } else {
+      LOG_COUT << "[Session] connected ("
+               << wireFormatName(connection->getFormat()) << "), live"
+               << std::endl;
+    }
+    attempt = 0;
+    ++connects;
+
+    co_await connection->onDisconnect().exclusiveJoin(
+        kj::mv(closedPaf.promise));
+    LOG_COUT << "[Session] disconnected" << std::endl;
+  }
+
+  /**
+   * @brief 全フィルタを 1 回の呼び出しで、最後の id の次から購読する
+   * @details サーバーのエポックが変わっていれば受け取った id を忘れ、
+   * そのサーバーの最も古い通知から購読する
+   * @return kj::Promise<kj::Maybe<uint64_t>> 再開した id（ライブなら none）
+   */
+  kj::Promise<kj::Maybe<uint64_t>> subscribe(
+      PollingNotifier::Client notifier) {
+    auto epochResponse = co_await notifier.getEpochRequest().send();
+    const auto current = epochResponse.getEpoch();
+    kj::Maybe<uint64_t> from;
+    if (hasReceived) from = lastId + 1;
+    if (epoch != 0 && current != epoch) {
+      LOG_COUT << "[Session] server restarted (epoch changed), forgetting "
+               << "ids up to " << lastId << std::endl;
+      dedup.reset();
+      lastId = 0;
+      hasReceived = false;
+      from = uint64_t{0};  // 残っている最も古い通知から
+    }
+    epoch = current;
+
+    auto req = notifier.subscribeManyRequest();
+    auto list = req.initParams(static_cast<uint32_t>(filters.size()));
+    for (uint32_t i = 0; i < filters.size(); ++i) {
+      list[i].setFilter(filters[i]);
+    }
+    KJ_IF_SOME(id, from) {
+      list[0].getStart().setFromId(id);
+      list[0].setEpoch(epoch);
+    }
+    req.setReceiver(kj::heap<ReceiverImpl>(*this));
+    auto response = co_await req.send();
+    subscription = response.getSubscription();
+    co_return from;
+  }
+
+  /// @brief サーバーが購読を打ち切ったので、今の接続を終わらせる
+  void closed(capnp::Text::Reader reason) {
+    LOG_COUT << "[Session] subscription closed: " << reason.cStr()
+             << std::endl;
+    KJ_IF_SOME(f, closedFulfiller) {
+      f->fulfill();
+      closedFulfiller = kj::none;
+    }
+  }
+
+  /// @brief 通知 1 件を受け取り、既に受け取った id なら捨てる
+  void received(Notification::Reader notification) {
+    if (!dedup.accept(notification.getId())) return;
+    lastId = dedup.getHighest();
+    hasReceived = true;
+    handler(notification);
+  }
+
+  /**
+   * @brief 次の再接続までの待ち時間
+   * @details min(maxBackoff, initialBackoff * 2^attempt) を上限とする
+   * 一様乱数（フルジッタ）
+   */
+  kj::Duration nextBackoff() {
+    auto ceiling = options.initialBackoff;
+    for (uint32_t i = 0; i < attempt && ceiling < options.maxBackoff; ++i) {
+      ceiling = ceiling * 2;
+    }
+    ceiling = std::min(ceiling, options.maxBackoff);
+    ++attempt;
+    std::uniform_int_distribution<int64_t> jitter(0,
+                                                  ceiling / kj::NANOSECONDS);
+    return jitter(random) * kj::NANOSECONDS;
+  }
+
+  kj::AsyncIoProvider& io;
+  std::string host;
+  uint32_t port;
+  std::vector<std::string> filters;
+  Handler handler;
+  Options options;
+
+  std::mt19937_64 random;
+  kj::Canceler canceler;  ///< stop() で待機中の処理を中断する
+  kj::Maybe<PollingSubscription::Client> subscription;
+  /// 今の接続の購読が打ち切られたら満たす
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> closedFulfiller;
+  bool stopped = false;
+  uint32_t attempt = 0;  ///< 連続して失敗した回数
+
+  DedupWindow<> dedup;  ///< 受信済みの id
+  uint64_t lastId = 0;  ///< 受け取った最大の id
+  uint64_t epoch = 0;   ///< lastId を振ったサーバーのエポック（0 は未接続）
+  bool hasReceived = false;
+  uint64_t connects = 0;
+};
+
+#endif  // RESILIENT_SESSION_HPP
@@ -0,0 +1,62 @@
+#ifndef ROUTING_RECEIVER_HPP
+#define ROUTING_RECEIVER_HPP
+
+#include <kj/async.h>
+
+#include <kind_router.hpp>
+
+#include "notification.capnp.h"
+
+#if KJ_HAS_COROUTINE
+#include <notification_cursor.hpp>
+#endif
+
+/**
+ * @brief 受信した通知を KindRouter で振り分ける受信側
+ * @details internKinds 購読で届く kind の番号の対応は、受け取った時点で
+ * router に結び付ける
+ */
+class RoutingReceiverImpl final : public PollingNotificationReceiver::Server {
+ public:
+  explicit RoutingReceiverImpl(KindRouter& router) : router(router) {}
+
+  kj::Promise<void> onKinds(OnKindsContext context) override {
+    for (const auto binding : context.getParams().getBindings()) {
+      router.bind(binding.getId(), binding.getKind());
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> onNotification(OnNotificationContext context) override {
+    router.dispatch(context.getParams().getNotification());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> onNotifications(OnNotificationsContext context) override {
+    for (const auto notification : context.getParams().getNotifications()) {
+      router.dispatch(notification);
+    }
+    return kj::READY_NOW;
+  }
+
+ private:
+  KindRouter& router;
+};
+
+#if KJ_HAS_COROUTINE
+/**
+ * @brief ストリームの終端まで読み、各通知を KindRouter で振り分ける
+ *
+ * @param cursor 読み出しに使うカーソル
+ * @param router 振り分け先
+ * @return kj::Promise<void> ストリームの終端で完了するプロミス
+ */
+inline kj::Promise<void> routeStream(NotificationCursor& cursor,
+                                     const KindRouter& router) {
+  while (co_await cursor.next()) {
+    router.dispatch(cursor.get());
+  }
+}
+#endif  // KJ_HAS_COROUTINE
+
+#endif  // ROUTING_RECEIVER_HPP
@@ -0,0 +1,275 @@
+#ifndef SUBSCRIPTION_HUB_HPP
+#define SUBSCRIPTION_HUB_HPP
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <notification_filter.hpp>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "notification.capnp.h"
+#include "utility.hpp"
+
+/**
+ * @brief 1 つのクライアントプロセス内で上流の購読を共有するハブ
+ *
+ * ローカルの利用者が何人いても、どのフィルタを購読していても、サーバーへの
+ * 購読は `subscribeMany` の 1 本にまとめる。上流の購読には利用中の
+ * フィルタをすべて渡し、届いた通知は filterIndex で振り分ける。
+ * サーバーは最初に一致したフィルタの番号だけを付けるので、重なる
+ * パターン（"polling_*" と "*" など）は filterIndex 以降のフィルタを
+ * 手元で照合して、一致したすべてのフィルタの利用者に 1 回ずつ渡す。
+ * 受信した通知は `Notification::Reader` のまま渡すため、利用者の数だけ
+ * コピーは発生しない。
+ *
+ * フィルタが増減したら上流の購読を張り替える。新しい購読は最後に
+ * 受け取った id の次から始め、張り替えの前後で重複した id は捨てる。
+ * サーバーが購読を打ち切った（onClosed）ときも同じように張り直す。
+ * 最後の利用者が `unsubscribe()` した時点で上流の購読を cancel する。
+ *
+ * ハンドラに渡す Reader は呼び出し中だけ有効。保持したい場合は
+ * ハンドラ側でコピーすること。破棄時に cancel を taskSet へ積むので、
+ * ハブは taskSet より先に破棄すること。
+ */
+class SubscriptionHub {
+ public:
+  /// ローカルの通知ハンドラ
+  using Handler = std::function<void(Notification::Reader)>;
+
+  /**
+   * @brief コンストラクタ
+   *
+   * @param notifier 上流の PollingNotifier
+   * @param taskSet  購読・cancel の送信タスクを管理する TaskSet
+   */
+  SubscriptionHub(PollingNotifier::Client notifier, kj::TaskSet& taskSet)
+      : notifier(kj::mv(notifier)), taskSet(taskSet) {}
+
+  ~SubscriptionHub() {
+    // 残っている上流の購読を閉じる
+    if (upstream != nullptr) closeUpstream(*upstream);
+  }
+
+  KJ_DISALLOW_COPY_AND_MOVE(SubscriptionHub);
+
+  /**
+   * @brief ローカルの利用者を登録する
+   * @details 新しいフィルタなら上流の購読を張り替える
+   *
+   * @param filter  購読フィルタ
+   * @param handler 通知を受け取るハンドラ
+   * @return uint64_t unsubscribe() に渡す id
+   */
+  uint64_t subscribe(const std::string& filter, Handler handler) {
+    auto [group, added] = groups.try_emplace(filter);
+    const auto id = nextId++;
+    group->second.push_back({id, std::make_shared<Handler>(kj::mv(handler))});
+    owners.emplace(id, filter);
+    if (added) reopen();
+    return id;
+  }
+
+  /**
+   * @brief ローカルの利用者を外す
+   * @details そのフィルタの利用者がいなくなれば上流の購読を張り替え、
+   * 誰もいなくなれば cancel する
+   *
+   * @param id subscribe() が返した id
+   */
+  void unsubscribe(uint64_t id) {
+    auto owner = owners.find(id);
+    if (owner == owners.end()) return;
+    auto filter = kj::mv(owner->second);
+    owners.erase(owner);
+
+    auto it = groups.find(filter);
+    KJ_ASSERT(it != groups.end());
+    auto& handlers = it->second;
+    handlers.erase(
+        std::remove_if(handlers.begin(), handlers.end(),
+                       [id](const auto& h) { return h.first == id; }),
+        handlers.end());
+    if (handlers.empty()) {
+      LOG_COUT << "[Hub] last subscriber left: filter=" << filter << std::endl;
+      groups.erase(it);
+      reopen();
+    }
+  }
+
+  /// @brief 張っている上流購読の数（0 か 1）
+  size_t upstreamCount() const { return upstream != nullptr ? 1 : 0; }
+
+  /// @brief 上流の購読に渡しているフィルタの数
+  size_t filterCount() const { return groups.size(); }
+
+  /// @brief 登録されているローカル利用者の数
+  size_t localCount() const { return owners.size(); }
+
+ private:
+  using Handlers = std::vector<std::pair<uint64_t, std::shared_ptr<Handler>>>;
+
+  /// 上流の購読 1 本と、filterIndex からフィルタへの対応
+  struct Upstream {
+    kj::Maybe<PollingSubscription::Client> subscription;
+    std::vector<std::string> filters;  ///< 上流に渡した順のフィルタ
+    bool closed = false;
+  };
+
+  /**
+   * @brief 上流からの通知をハブに中継する受信側
+   * @details 張り替えや破棄で閉じられた Upstream に届いた通知は捨てる
+   */
+  class ReceiverImpl final : public PollingNotificationReceiver::Server {
+   public:
+    ReceiverImpl(SubscriptionHub& hub, std::weak_ptr<Upstream> upstream)
+        : hub(hub), upstream(kj::mv(upstream)) {}
+
+    kj::Promise<void> onNotification(OnNotificationContext context) override {
+      if (auto target = active()) {
+        hub.dispatch(*target, context.getParams().getNotification());
+      }
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> onNotifications(
+        OnNotificationsContext context) override {
+      if (auto target = active()) {
+        const auto notifications = context.getParams().getNotifications();
+        for (const auto notification : notifications) {
+          if (target->closed) break;
+          hub.dispatch(*target, notification);
+        }
+      }
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> onClosed(OnClosedContext context) override {
+      if (active() != nullptr) {
+        LOG_COUT << "[Hub] upstream closed by server: "
+                 << context.getParams().getReason().cStr() << std::endl;
+        hub.reopen();
+      }
+      return kj::READY_NOW;
+    }
+
+   private:
+    /// @brief まだ閉じられていない Upstream（閉じられていれば nullptr）
+    std::shared_ptr<Upstream> active() const {
+      auto target = upstream.lock();
+      return target && !target->closed ? target : nullptr;
+    }
+
+    SubscriptionHub& hub;
+    std::weak_ptr<Upstream> upstream;
+  };
+
+  /**
+   * @brief 受信した通知 1 件を、一致したフィルタの利用者全員に渡す
+   * @details filterIndex より前のフィルタは一致しなかったもの。
+   * 以降のフィルタは手元で照合し、重なるパターンにも渡す
+   */
+  void dispatch(const Upstream& source, Notification::Reader notification) {
+    const auto id = notification.getId();
+    if (hasReceived && id <= lastId) return;  // 張り替え前に受け取った分
+    lastId = id;
+    hasReceived = true;
+
+    // ハンドラ内で unsubscribe() されても走査が壊れないよう、
+    // ハンドラへの参照だけを控えてから呼ぶ
+    const auto kind = notification.getKind();
+    Handlers snapshot;
+    for (size_t i = notification.getFilterIndex(); i < source.filters.size();
+         ++i) {
+      const auto& filter = source.filters[i];
+      if (i != notification.getFilterIndex() &&
+          !matchesFilter(filter.c_str(), kind)) {
+        continue;
+      }
+      auto group = groups.find(filter);
+      if (group == groups.end()) continue;
+      snapshot.insert(snapshot.end(), group->second.begin(),
+                      group->second.end());
+    }
+    for (const auto& [owner, handler] : snapshot) {
+      if (owners.count(owner) == 0) continue;  // 途中で抜けた
+      (*handler)(notification);
+    }
+  }
+
+  /**
+   * @brief 今のフィルタの集合で上流の購読を張り直す
+   * @details 前の購読は cancel し、以降に届いた通知は捨てる。
+   * 新しい購読は最後に受け取った id の次から始める
+   */
+  void reopen() {
+    if (upstream != nullptr) closeUpstream(*upstream);
+    upstream = nullptr;
+    if (groups.empty()) return;
+
+    auto next = std::make_shared<Upstream>();
+    for (const auto& [filter, handlers] : groups) {
+      next->filters.push_back(filter);
+    }
+    openUpstream(next);
+    upstream = kj::mv(next);
+  }
+
+  /**
+   * @brief 上流の購読を subscribeMany で張る
+   * @details subscription はパイプラインで受け取るため、応答を待たずに
+   * cancel() を送れる
+   */
+  void openUpstream(const std::shared_ptr<Upstream>& target) {
+    LOG_COUT << "[Hub] subscribe upstream: filters=" << target->filters.size()
+             << std::endl;
+    auto req = notifier.subscribeManyRequest();
+    auto list =
+        req.initParams(static_cast<uint32_t>(target->filters.size()));
+    for (uint32_t i = 0; i < target->filters.size(); ++i) {
+      list[i].setFilter(target->filters[i]);
+    }
+    if (hasReceived) {
+      list[0].getStart().setFromId(lastId + 1);
+    }
+    req.setReceiver(kj::heap<ReceiverImpl>(*this, target));
+    auto promise = req.send();
+    target->subscription = promise.getSubscription();
+    taskSet.add(promise.ignoreResult().catch_([](kj::Exception&& e) {
+      LOG_COUT << "[Hub] upstream subscribe failed: "
+               << e.getDescription().cStr() << std::endl;
+    }));
+  }
+
+  /// @brief 上流購読を cancel し、以降の通知を捨てる
+  void closeUpstream(Upstream& target) {
+    target.closed = true;
+    KJ_IF_SOME(subscription, target.subscription) {
+      taskSet.add(subscription.cancelRequest().send().ignoreResult().catch_(
+          [](kj::Exception&& e) {
+            LOG_COUT << "[Hub] upstream cancel failed: "
+                     << e.getDescription().cStr() << std::endl;
+          }));
+    }
+    target.subscription = kj::none;
+  }
+
+  PollingNotifier::Client notifier;
+  kj::TaskSet& taskSet;
+  /// フィルタごとのローカルのハンドラ
+  std::unordered_map<std::string, Handlers> groups;
+  /// ローカル利用者の id から、所属するフィルタへの対応
+  std::unordered_map<uint64_t, std::string> owners;
+  std::shared_ptr<Upstream> upstream;  ///< 今の上流の購読（なければ null）
+  uint64_t nextId = 0;
+  uint64_t lastId = 0;  ///< 受け取った最大の通知 id
+  bool hasReceived = false;
+};
+
+#endif  // SUBSCRIPTION_HUB_HPP
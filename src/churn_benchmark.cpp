@@ -0,0 +1,124 @@
+// churn_benchmark.cpp
+// 購読の接続・切断を大量に繰り返し、サーバーが切断された購読を回収できて
+// いるかを確認するベンチマーク
+//
+// 使い方:
+//   churn_benchmark [clients] [concurrency] [server-pid]
+//   server-pid を指定すると /proc から polling_server の RSS を測定する
+
+#include <capnp/ez-rpc.h>
+#include <kj/async.h>
+#include <kj/debug.h>
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <utility.hpp>
+#include <vector>
+
+#include "schema/notification.capnp.h"
+
+/**
+ * @brief 受け取った通知を捨てるだけの受信側
+ */
+class DiscardingReceiverImpl final
+    : public PollingNotificationReceiver::Server {
+ public:
+  kj::Promise<void> onNotification(OnNotificationContext context) override {
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> onNotifications(OnNotificationsContext context) override {
+    return kj::READY_NOW;
+  }
+};
+
+/**
+ * @brief プロセスの常駐メモリ量（KiB）を取得する
+ *
+ * @param pid 対象プロセスの pid
+ * @return long VmRSS の値。取得できなければ -1
+ */
+long readRssKiB(const std::string& pid) {
+  std::ifstream status("/proc/" + pid + "/status");
+  std::string key;
+  while (status >> key) {
+    if (key == "VmRSS:") {
+      long value = -1;
+      status >> value;
+      return value;
+    }
+    status.ignore(4096, '\n');
+  }
+  return -1;
+}
+
+/**
+ * @brief サーバーの統計情報を取得してログに出力する
+ *
+ * @param label 出力用のラベル
+ * @param pid   RSS を測る対象の pid（空なら測らない）
+ * @return uint32_t アクティブな購読数
+ */
+uint32_t reportStats(const char* label, const std::string& pid) {
+  capnp::EzRpcClient client("localhost", 5924);
+  auto& ws = client.getWaitScope();
+  auto resp = client.getMain<PollingNotifier>().getStatsRequest().send().wait(
+      ws);
+  const auto stats = resp.getStats();
+  LOG_COUT << "[Churn] " << label
+           << ": active=" << stats.getActiveSubscriptions()
+           << ", evicted=" << stats.getEvictedSubscriptions()
+           << (pid.empty() ? std::string()
+                           : ", rssKiB=" + std::to_string(readRssKiB(pid)))
+           << std::endl;
+  return stats.getActiveSubscriptions();
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    const int total = argc > 1 ? std::stoi(argv[1]) : 5000;
+    const int concurrency = argc > 2 ? std::stoi(argv[2]) : 100;
+    const std::string pid = argc > 3 ? argv[3] : "";
+
+    const auto baseline = reportStats("baseline", pid);
+    const auto start = std::chrono::steady_clock::now();
+
+    // concurrency 個ずつ接続して購読し、cancel() せずに接続ごと破棄する
+    for (int done = 0; done < total; done += concurrency) {
+      std::vector<kj::Own<capnp::EzRpcClient>> clients;
+      for (int i = 0; i < concurrency && done + i < total; ++i) {
+        auto client = kj::heap<capnp::EzRpcClient>("localhost", 5924);
+        auto req = client->getMain<PollingNotifier>().subscribeRequest();
+        req.setFilter("churn");
+        req.setReceiver(kj::heap<DiscardingReceiverImpl>());
+        req.send().wait(client->getWaitScope());
+        clients.push_back(kj::mv(client));
+      }
+      clients.clear();  // 切断
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+    LOG_COUT << "[Churn] " << total << " clients connected and dropped in "
+             << elapsed << " ms" << std::endl;
+
+    // サーバーが切断を処理し終えるのを少し待つ
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    const auto after = reportStats("after churn", pid);
+    if (after > baseline) {
+      LOG_COUT << "[Churn] FAILED: " << after - baseline
+               << " subscriptions leaked" << std::endl;
+      return 1;
+    }
+    LOG_COUT << "[Churn] OK: subscriptions returned to baseline" << std::endl;
+  } catch (kj::Exception& e) {
+    LOG_COUT << "Churn exception: " << e.getDescription().cStr() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,84 @@
+// dispatching_client.cpp
+// 受信した通知をワーカースレッドで処理するクライアントの例
+// 遅いハンドラがあっても、RPC の応答はキューに積んだ時点で返る
+// クレジット付きで購読し、積み終えた分だけ返すのでキューは伸び続けない
+//
+// 使い方:
+//   dispatching_client [threads] [handler-ms]
+
+#include <capnp/ez-rpc.h>
+#include <kj/async.h>
+#include <kj/debug.h>
+
+#include <chrono>
+#include <credit_replenisher.hpp>
+#include <notification_dispatcher.hpp>
+#include <string>
+#include <thread>
+#include <utility.hpp>
+
+#include "schema/notification.capnp.h"
+
+/**
+ * @brief タスク失敗時にログを出力するエラーハンドラクラス
+ */
+class SimpleErrorHandler final : public kj::TaskSet::ErrorHandler {
+ public:
+  void taskFailed(kj::Exception&& e) override {
+    LOG_COUT << "Task failed: " << e.getDescription().cStr() << std::endl;
+  }
+};
+
+int main(int argc, char* argv[]) {
+  try {
+    const size_t threads = argc > 1 ? std::stoul(argv[1]) : 4;
+    const int handler_ms = argc > 2 ? std::stoi(argv[2]) : 50;
+
+    capnp::EzRpcClient client("localhost", 5924);
+    auto& ws = client.getWaitScope();
+    auto& timer = client.getIoProvider().getTimer();
+    SimpleErrorHandler errorHandler;
+    kj::TaskSet task_set(errorHandler);
+
+    // アプリケーションの処理（ここでは遅い処理を sleep で模擬する）
+    NotificationDispatcher dispatcher(
+        [handler_ms](Notification::Reader n) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(handler_ms));
+          LOG_COUT << "[Worker] id=" << n.getId()
+                   << ", kind=" << n.getKind().cStr() << std::endl;
+        },
+        threads);
+
+    // サーバーが送る量をクレジットの窓で抑える。クレジットはキューに
+    // 積み終えた分だけ返す
+    constexpr uint32_t kCreditWindow = 256;
+    auto req = client.getMain<PollingNotifier>().subscribeWithParamsRequest();
+    auto params = req.initParams();
+    params.setFilter("*");
+    params.setCredits(kCreditWindow);
+    auto receiver = kj::heap<DispatchingReceiverImpl>(dispatcher);
+    auto* receiverRaw = receiver.get();
+    req.setReceiver(kj::mv(receiver));
+    auto promise = req.send();
+    CreditReplenisher credits(promise.getSubscription(), task_set,
+                              kCreditWindow);
+    receiverRaw->setCreditReplenisher(&credits);
+    auto subscription = promise.wait(ws).getSubscription();
+
+    // 1 秒ごとにキューの状態を出力する
+    for (int i = 0; i < 10; ++i) {
+      timer.afterDelay(1 * kj::SECONDS).wait(ws);
+      LOG_COUT << "[Dispatcher] depth=" << dispatcher.getDepth()
+               << ", maxDepth=" << dispatcher.getMaxDepth()
+               << ", processed=" << dispatcher.getProcessed()
+               << ", backpressured=" << dispatcher.getBackpressured()
+               << ", rejected=" << dispatcher.getRejected() << std::endl;
+    }
+
+    subscription.cancelRequest().send().wait(ws);
+  } catch (kj::Exception& e) {
+    LOG_COUT << "Client exception: " << e.getDescription().cStr() << std::endl;
+  }
+
+  return 0;
+}
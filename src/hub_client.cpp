@@ -0,0 +1,66 @@
+// hub_client.cpp
+// SubscriptionHub を使い、複数のコンポーネントで上流の購読を共有する例
+// 利用者とフィルタがいくつあっても、サーバーへの購読は subscribeMany の 1 本
+
+#include <capnp/ez-rpc.h>
+#include <kj/async.h>
+#include <kj/debug.h>
+
+#include <subscription_hub.hpp>
+#include <utility.hpp>
+
+#include "schema/notification.capnp.h"
+
+/**
+ * @brief タスク失敗時にログを出力するエラーハンドラクラス
+ */
+class SimpleErrorHandler final : public kj::TaskSet::ErrorHandler {
+ public:
+  void taskFailed(kj::Exception&& e) override {
+    LOG_COUT << "Task failed: " << e.getDescription().cStr() << std::endl;
+  }
+};
+
+int main() {
+  try {
+    capnp::EzRpcClient client("localhost", 5924);
+    auto& ws = client.getWaitScope();
+    auto& timer = client.getIoProvider().getTimer();
+    SimpleErrorHandler errorHandler;
+    kj::TaskSet task_set(errorHandler);
+
+    {
+      SubscriptionHub hub(client.getMain<PollingNotifier>(), task_set);
+
+      // 3 つのコンポーネントが 2 つの重なるフィルタで購読するが、上流の
+      // 購読は subscribeMany の 1 本にまとまる
+      const auto logger = hub.subscribe("polling_*", [](auto n) {
+        LOG_COUT << "[Logger] id=" << n.getId() << std::endl;
+      });
+      const auto metrics = hub.subscribe("polling_*", [](auto n) {
+        LOG_COUT << "[Metrics] kind=" << n.getKind().cStr() << std::endl;
+      });
+      const auto audit = hub.subscribe("*", [](auto n) {
+        LOG_COUT << "[Audit] id=" << n.getId() << std::endl;
+      });
+      LOG_COUT << "[Hub] local=" << hub.localCount()
+               << ", filters=" << hub.filterCount()
+               << ", upstream=" << hub.upstreamCount() << std::endl;
+
+      // 利用者が順に抜け、最後の 1 人が抜けた時点で上流の購読を閉じる
+      timer.afterDelay(3 * kj::SECONDS).wait(ws);
+      hub.unsubscribe(logger);
+      timer.afterDelay(3 * kj::SECONDS).wait(ws);
+      hub.unsubscribe(metrics);
+      hub.unsubscribe(audit);
+      LOG_COUT << "[Hub] local=" << hub.localCount()
+               << ", upstream=" << hub.upstreamCount() << std::endl;
+    }
+
+    task_set.onEmpty().wait(ws);
+  } catch (kj::Exception& e) {
+    LOG_COUT << "Client exception: " << e.getDescription().cStr() << std::endl;
+  }
+
+  return 0;
+}
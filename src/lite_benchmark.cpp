@@ -0,0 +1,219 @@
+// lite_benchmark.cpp
+// Notification・NotificationLite のリストと DeltaBatch をエンコード・
+// デコードし、1 件あたりのバイト数と 1 秒あたりの処理件数を比べる
+// ベンチマーク
+// （RPC は使わず、メッセージのシリアライズだけを測る）
+//
+// 使い方:
+//   lite_benchmark [messages] [batch]
+
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <delta_batch.hpp>
+#include <notification_lite.hpp>
+#include <string>
+#include <utility.hpp>
+#include <vector>
+
+#include "notification.capnp.h"
+
+namespace {
+
+constexpr const char* kKind = "telemetry.cpu";
+constexpr uint32_t kKindId = 1;
+constexpr int64_t kBaseTimestamp = 1700000000000;
+
+/// 測定結果
+struct Result {
+  uint64_t bytes = 0;     ///< シリアライズ後のバイト数の合計
+  double seconds = 0;     ///< エンコードとデコードにかかった時間
+  uint64_t checksum = 0;  ///< 最適化で処理が消えないようにするための値
+};
+
+/// @brief 通知 i の 8 バイトのペイロード（計測値を模したもの）
+uint64_t payloadOf(uint64_t i) { return i * 2654435761u; }
+
+/**
+ * @brief messages 件を batch 件ずつのリストにして、エンコード・デコードする
+ *
+ * @param messages 全件数
+ * @param batch    1 メッセージに入れる件数
+ * @param encode   (builder, first, count) でリストを書くエンコーダ
+ * @param decode   (reader) で読んだ値の和を返すデコーダ
+ */
+template <typename Encode, typename Decode>
+Result run(uint64_t messages, uint32_t batch, Encode&& encode,
+           Decode&& decode) {
+  Result result;
+  const auto started = std::chrono::steady_clock::now();
+  for (uint64_t first = 0; first < messages; first += batch) {
+    const auto count =
+        static_cast<uint32_t>(std::min<uint64_t>(batch, messages - first));
+    capnp::MallocMessageBuilder builder;
+    encode(builder, first, count);
+    const auto flat = capnp::messageToFlatArray(builder);
+    result.bytes += flat.asBytes().size();
+
+    capnp::FlatArrayMessageReader reader(flat);
+    result.checksum += decode(reader);
+  }
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+  return result;
+}
+
+/// @brief 通常の Notification のリスト（with_kind なら kind の文字列付き）
+Result runFull(uint64_t messages, uint32_t batch, bool with_kind) {
+  return run(
+      messages, batch,
+      [with_kind](capnp::MessageBuilder& builder, uint64_t first,
+                  uint32_t count) {
+        auto list = builder.initRoot<PollingNotificationReceiver::
+                                         OnNotificationsParams>()
+                        .initNotifications(count);
+        for (uint32_t i = 0; i < count; ++i) {
+          const auto id = first + i;
+          auto n = list[i];
+          n.setId(id);
+          n.setTimestamp(kBaseTimestamp + static_cast<int64_t>(id));
+          n.setKindId(kKindId);
+          n.setKindSeq(id + 1);
+          if (with_kind) n.setKind(kKind);
+          const auto value = payloadOf(id);
+          n.setPayload(kj::arrayPtr(
+              reinterpret_cast<const kj::byte*>(&value), sizeof(value)));
+        }
+      },
+      [](capnp::MessageReader& reader) {
+        uint64_t sum = 0;
+        const auto list =
+            reader.getRoot<PollingNotificationReceiver::OnNotificationsParams>()
+                .getNotifications();
+        for (const auto n : list) {
+          sum += n.getId() + static_cast<uint64_t>(n.getTimestamp()) +
+                 n.getKindId() + n.getPayload().size() + n.getKind().size();
+        }
+        return sum;
+      });
+}
+
+/// @brief NotificationLite のリスト
+Result runLite(uint64_t messages, uint32_t batch) {
+  return run(
+      messages, batch,
+      [](capnp::MessageBuilder& builder, uint64_t first, uint32_t count) {
+        auto params =
+            builder.initRoot<PollingNotificationReceiver::OnLiteParams>();
+        params.setBaseTimestamp(kBaseTimestamp + static_cast<int64_t>(first));
+        auto list = params.initNotifications(count);
+        for (uint32_t i = 0; i < count; ++i) {
+          const auto id = first + i;
+          auto n = list[i];
+          n.setId(id);
+          n.setTimestampDelta(i);
+          n.setKindId(kKindId);
+          n.setKindSeq(static_cast<uint32_t>(id + 1));
+          const auto value = payloadOf(id);
+          setLitePayload(n, kj::arrayPtr(reinterpret_cast<const kj::byte*>(
+                                             &value),
+                                         sizeof(value)));
+        }
+      },
+      [](capnp::MessageReader& reader) {
+        uint64_t sum = 0;
+        const auto params =
+            reader.getRoot<PollingNotificationReceiver::OnLiteParams>();
+        const auto base = params.getBaseTimestamp();
+        for (const auto n : params.getNotifications()) {
+          sum += n.getId() + static_cast<uint64_t>(liteTimestamp(n, base)) +
+                 n.getKindId() + getLitePayload(n).size;
+        }
+        return sum;
+      });
+}
+
+/// @brief id・timestamp・kindSeq を差分でビット詰めした DeltaBatch
+Result runDelta(uint64_t messages, uint32_t batch) {
+  return run(
+      messages, batch,
+      [](capnp::MessageBuilder& builder, uint64_t first, uint32_t count) {
+        auto params =
+            builder.initRoot<PollingNotificationReceiver::OnDeltaBatchParams>()
+                .initBatch();
+        std::vector<uint64_t> ids(count), timestamps(count), seqs(count);
+        params.setCount(count);
+        auto kind_ids = params.initKindIds(count);
+        params.initFilterIndexes(count);
+        auto payloads = params.initPayloads(count);
+        for (uint32_t i = 0; i < count; ++i) {
+          const auto id = first + i;
+          ids[i] = id;
+          timestamps[i] = static_cast<uint64_t>(kBaseTimestamp) + id;
+          seqs[i] = id + 1;
+          kind_ids.set(i, kKindId);
+          const auto value = payloadOf(id);
+          payloads.set(i, kj::arrayPtr(reinterpret_cast<const kj::byte*>(
+                                           &value),
+                                       sizeof(value)));
+        }
+        KJ_ASSERT(DeltaColumnCodec::encode(params.initIds(), ids));
+        KJ_ASSERT(
+            DeltaColumnCodec::encode(params.initTimestamps(), timestamps));
+        KJ_ASSERT(DeltaColumnCodec::encode(params.initKindSeqs(), seqs));
+      },
+      [](capnp::MessageReader& reader) {
+        uint64_t sum = 0;
+        const auto batch =
+            reader.getRoot<PollingNotificationReceiver::OnDeltaBatchParams>()
+                .getBatch();
+        const auto count = batch.getCount();
+        std::vector<uint64_t> ids(count), timestamps(count);
+        DeltaColumnCodec::decode(batch.getIds(), count, ids.data());
+        DeltaColumnCodec::decode(batch.getTimestamps(), count,
+                                 timestamps.data());
+        const auto kind_ids = batch.getKindIds();
+        const auto payloads = batch.getPayloads();
+        for (uint32_t i = 0; i < count; ++i) {
+          sum += ids[i] + timestamps[i] + kind_ids[i] + payloads[i].size();
+        }
+        return sum;
+      });
+}
+
+void report(const char* label, uint64_t messages, const Result& result) {
+  LOG_COUT << "[LiteBench] " << label << ": bytesPerMessage="
+           << static_cast<double>(result.bytes) / messages
+           << ", messagesPerSec="
+           << static_cast<uint64_t>(messages / result.seconds)
+           << " (checksum " << result.checksum << ")" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    const uint64_t messages = argc > 1 ? std::stoull(argv[1]) : 1000000;
+    const auto batch =
+        static_cast<uint32_t>(argc > 2 ? std::stoul(argv[2]) : 64);
+    KJ_REQUIRE(messages > 0 && batch > 0, "messages and batch must be > 0");
+    LOG_COUT << "[LiteBench] messages=" << messages << ", batch=" << batch
+             << ", payload=8 bytes" << std::endl;
+
+    report("Notification (kind text)", messages,
+           runFull(messages, batch, true));
+    report("Notification (kindId)", messages, runFull(messages, batch, false));
+    report("NotificationLite", messages, runLite(messages, batch));
+    report("DeltaBatch", messages, runDelta(messages, batch));
+  } catch (kj::Exception& e) {
+    LOG_COUT << "Benchmark exception: " << e.getDescription().cStr()
+             << std::endl;
+    return 1;
+  }
+}
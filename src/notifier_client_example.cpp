@@ -9,6 +9,8 @@
 
 #include <chrono>
 #include <iostream>
+#include <notification_cursor.hpp>
+#include <routing_receiver.hpp>
 #include <thread>
 #include <utility.hpp>
 
@@ -36,6 +38,22 @@ void printNotification(::Notification::Reader n) {
            << ", timestamp=" << n.getTimestamp() << std::endl;
 }
 
+/**
+ * @brief ストリームの終端まで通知を読み続けるコルーチン
+ *
+ * @param cursor 読み出しに使うカーソル
+ * @return kj::Promise<void> ストリームの終端で完了するプロミス
+ */
+kj::Promise<void> consume(NotificationCursor& cursor) {
+  KindRouter router;
+  router.on<"demo">([&cursor](::Notification::Reader n) {
+    printNotification(n);
+    LOG_COUT << "[Client] read window=" << cursor.getWindow() << std::endl;
+  });
+  co_await routeStream(cursor, router);
+  std::cout << "[Client] Stream ended." << std::endl;
+}
+
 int main() {
   try {
     LOG_COUT << "Starting Notifier client..." << std::endl;
@@ -65,14 +83,14 @@ int main() {
     // ── Subscribe リクエスト送信 ──
     LOG_COUT << "Sending Subscribe request..." << std::endl;
     auto req = notifier.subscribeRequest();
-    req.getParams().setFilter("Notifier");
+    req.getParams().setFilter("demo");
 
-    auto resp = req.send().wait(ws);
+    // stream / subscription はパイプラインで受け取り、subscribe の応答を
+    // 待たずに最初の read() を送っておく
+    auto promise = req.send();
     LOG_COUT << "Subscribe request sent." << std::endl;
-    auto stream = resp.getStream();
-    auto session = resp.getSubscription();
-
-    LOG_COUT << "Subscribe response received." << std::endl;
+    NotificationCursor cursor(promise.getStream(), timer);
+    auto session = promise.getSubscription();
 
     // ── 5秒後にキャンセルを送信（Timer使用） ──
     auto timer_promise =
@@ -84,15 +102,7 @@ int main() {
 
     LOG_COUT << "Waiting for notifications..." << std::endl;
 
-    while (true) {
-      auto nResp = stream.readRequest().send().wait(ws);
-      if (nResp.hasResult()) {
-        printNotification(nResp.getResult());
-      } else {
-        std::cout << "[Client] Stream ended." << std::endl;
-        break;
-      }
-    }
+    consume(cursor).wait(ws);
 
     task_set.onEmpty().wait(ws);
   } catch (kj::Exception& e) {
@@ -3,9 +3,16 @@
 #include <capnp/ez-rpc.h>
 #include <kj/debug.h>
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <deque>
+#include <memory>
+#include <notification_filter.hpp>
+#include <notification_log.hpp>
+#include <unordered_map>
 #include <utility.hpp>
+#include <vector>
 
 #include "notification.capnp.h"
 
@@ -13,28 +20,57 @@
 // 共有状態
 //------------------------------------------------------------
 struct SharedState {
+  /// ack 待ちの通知（atLeastOnce のみ）
+  struct Unacked {
+    LogEntry entry;
+    kj::TimePoint sent_at;
+  };
+
+  explicit SharedState(uint64_t id) : id(id) {}
+
+  const uint64_t id;  ///< NotifierImpl の登録簿でのキー
   std::atomic<bool> cancelled{false};
+  FilterSet filters;  ///< 購読フィルタ（subscribeMany では複数）
+  DeliveryMode delivery = DeliveryMode::AT_MOST_ONCE;
+  std::deque<Unacked> unacked;  ///< read() で返したが未 ack の通知
+  kj::Canceler canceler;        ///< 待機中の read() をまとめて中断する
 };
 
+class NotifierImpl;
+
 //------------------------------------------------------------
 // Subscription
 //------------------------------------------------------------
 class SubscriptionImpl final : public Subscription::Server {
  public:
-  explicit SubscriptionImpl(SharedState &s) : state(s) {}
-
-  kj::Promise<void> cancel(CancelContext context) override {
-    if (state.cancelled.load()) {
-      LOG_COUT << "[Subscription] already cancelled\n";
-    } else {
-      LOG_COUT << "[Subscription] cancel()\n";
-      state.cancelled.store(true);
+  SubscriptionImpl(NotifierImpl &n, std::shared_ptr<SharedState> s)
+      : notifier(n), state(kj::mv(s)) {}
+
+  /**
+   * @brief capability が解放されたら購読を片付ける
+   * @details cancel() せずに手放された場合や切断された場合も、待機中の
+   * read() を失敗させて登録簿から外す
+   */
+  ~SubscriptionImpl();
+
+  kj::Promise<void> cancel(CancelContext context) override;
+
+  kj::Promise<void> ack(AckContext context) override {
+    // 累積 ack: upToId 以下をウィンドウから外す
+    const auto up_to = context.getParams().getUpToId();
+    while (!state->unacked.empty() &&
+           state->unacked.front().entry.id <= up_to) {
+      state->unacked.pop_front();
     }
     return kj::READY_NOW;
   }
 
  private:
-  SharedState &state;
+  /// @brief 待機中の read() を失敗させ、通知を解放して登録簿から外す
+  void release();
+
+  NotifierImpl &notifier;
+  std::shared_ptr<SharedState> state;
 };
 
 //------------------------------------------------------------
@@ -42,28 +78,167 @@ class SubscriptionImpl final : public Subscription::Server {
 //------------------------------------------------------------
 class StreamImpl final : public NotificationStream::Server {
  public:
-  StreamImpl(SharedState &s, kj::Timer &t) : state(s), timer(t) {}
+  /// atLeastOnce で ack されない通知を再び read() で返すまでの時間
+  static constexpr kj::Duration kRedeliveryTimeout = 5 * kj::SECONDS;
+  /// このサーバーが生成する通知の種類
+  static constexpr const char *kKind = "demo";
+  /// readLite で kKind に割り当てる番号
+  static constexpr uint32_t kKindId = 1;
+  /// readLite 1 回で返す最大件数
+  static constexpr uint32_t kMaxLiteCount = 256;
+  /// atLeastOnce で保持する未 ack 通知の上限。達したら新しい通知は返さない
+  static constexpr size_t kMaxUnacked = 1024;
+  /// 新しい通知を返す・未 ack に空きができたか調べる間隔
+  static constexpr kj::Duration kPollInterval = 200 * kj::MILLISECONDS;
+
+  StreamImpl(std::shared_ptr<SharedState> s, kj::Timer &t)
+      : state(kj::mv(s)), timer(t) {}
   kj::Promise<void> read(ReadContext ctx) override {
-    if (state.cancelled.load()) {
+    if (state->cancelled.load()) {
       LOG_COUT << "[Stream] stream closed\n";
       KJ_FAIL_REQUIRE("stream closed");
     }
-    return timer.afterDelay(200 * kj::MILLISECONDS)
-        .then([this, ctx = kj::mv(ctx)]() mutable {
-          auto n = ctx.getResults().initResult();
-          n.setId(counter++);
-          auto ts = std::chrono::duration_cast<std::chrono::milliseconds>(
-                        std::chrono::system_clock::now().time_since_epoch())
-                        .count();
-          n.setTimestamp(ts);
-          n.setKind("demo");
-        });
+    const auto index = state->filters.match(kKind);
+    if (index == FilterSet::kNoMatch) {
+      // 一致する通知は来ないので、cancel() されるまで待たせておく
+      return state->canceler.wrap(kj::Promise<void>(kj::NEVER_DONE));
+    }
+    // 待機中に cancel() されたら canceler 経由で即座に失敗させる
+    return state->canceler.wrap(
+        timer.afterDelay(kPollInterval)
+            .then([this, index, ctx = kj::mv(ctx)]() mutable {
+              return produce(kj::mv(ctx), index);
+            }));
+  }
+
+  kj::Promise<void> readLite(ReadLiteContext ctx) override {
+    if (state->cancelled.load()) {
+      LOG_COUT << "[Stream] stream closed\n";
+      KJ_FAIL_REQUIRE("stream closed");
+    }
+    const auto index = state->filters.match(kKind);
+    if (index == FilterSet::kNoMatch) {
+      return state->canceler.wrap(kj::Promise<void>(kj::NEVER_DONE));
+    }
+    const auto count = std::clamp<uint32_t>(ctx.getParams().getMaxCount(), 1,
+                                            kMaxLiteCount);
+    return state->canceler.wrap(
+        timer.afterDelay(kPollInterval)
+            .then([this, index, count, ctx = kj::mv(ctx)]() mutable {
+              // 再送する通知を先に、残りを新しい通知で埋める
+              std::vector<LogEntry> entries;
+              size_t fresh = count;
+              if (state->delivery == DeliveryMode::AT_LEAST_ONCE) {
+                for (auto &u : state->unacked) {
+                  if (entries.size() == count) break;
+                  if (timer.now() - u.sent_at >= kRedeliveryTimeout) {
+                    u.sent_at = timer.now();
+                    entries.push_back(u.entry);
+                  }
+                }
+                // 未 ack が上限に達したら新しい通知は返さない
+                fresh = kMaxUnacked - std::min(kMaxUnacked,
+                                               state->unacked.size());
+              }
+              const auto ts =
+                  std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+              while (entries.size() < count && fresh > 0) {
+                --fresh;
+                LogEntry entry;
+                entry.id = counter++;
+                entry.kind_seq = counter;
+                entry.kind_id = kKindId;
+                entry.timestamp = ts;
+                entry.kind = kKind;
+                if (state->delivery == DeliveryMode::AT_LEAST_ONCE) {
+                  state->unacked.push_back({entry, timer.now()});
+                }
+                entries.push_back(kj::mv(entry));
+              }
+
+              if (entries.empty()) {
+                // 返せる通知がない。ack で空くまで待って読み直す
+                return timer.afterDelay(kPollInterval)
+                    .then([this, ctx = kj::mv(ctx)]() mutable {
+                      return readLite(kj::mv(ctx));
+                    });
+              }
+
+              auto results = ctx.getResults();
+              if (!lite_announced) {
+                lite_announced = true;
+                auto bindings = results.initBindings(1);
+                bindings[0].setId(kKindId);
+                bindings[0].setKind(kKind);
+              }
+              int64_t base = entries.front().timestamp;
+              for (const auto &entry : entries) {
+                base = std::min(base, entry.timestamp);
+              }
+              results.setBaseTimestamp(base);
+              auto list = results.initNotifications(
+                  static_cast<uint32_t>(entries.size()));
+              for (uint32_t i = 0; i < entries.size(); ++i) {
+                entries[i].fillLite(list[i], base);
+                list[i].setFilterIndex(static_cast<uint16_t>(index));
+              }
+              return kj::Promise<void>(kj::READY_NOW);
+            }));
   }
 
  private:
-  SharedState &state;
+  /**
+   * @brief read() 1 回分の通知を返す
+   * @details ack されずにタイムアウトした通知があれば先に再送する。
+   * 未 ack が kMaxUnacked に達していれば、ack で空くか再送の時刻が
+   * 来るまで新しい通知を返さずに待つ
+   */
+  kj::Promise<void> produce(ReadContext ctx, int32_t index) {
+    const bool at_least_once =
+        state->delivery == DeliveryMode::AT_LEAST_ONCE;
+    if (at_least_once) {
+      for (auto &u : state->unacked) {
+        if (timer.now() - u.sent_at >= kRedeliveryTimeout) {
+          LOG_COUT << "[Stream] redeliver id=" << u.entry.id << "\n";
+          u.sent_at = timer.now();
+          auto n = ctx.getResults().initResult();
+          u.entry.fill(n);
+          n.setFilterIndex(static_cast<uint32_t>(index));
+          return kj::READY_NOW;
+        }
+      }
+      if (state->unacked.size() >= kMaxUnacked) {
+        return timer.afterDelay(kPollInterval)
+            .then([this, index, ctx = kj::mv(ctx)]() mutable {
+              return produce(kj::mv(ctx), index);
+            });
+      }
+    }
+
+    auto n = ctx.getResults().initResult();
+    n.setFilterIndex(static_cast<uint32_t>(index));
+    n.setId(counter++);
+    // 生成する kind は 1 種類なので、kind ごとの連番は id + 1
+    n.setKindSeq(counter);
+    auto ts = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::system_clock::now().time_since_epoch())
+                  .count();
+    n.setTimestamp(ts);
+    n.setKind(kKind);
+
+    if (at_least_once) {
+      state->unacked.push_back(
+          {LogEntry::fromReader(n.asReader()), timer.now()});
+    }
+    return kj::READY_NOW;
+  }
+
+  std::shared_ptr<SharedState> state;
   kj::Timer &timer;
   uint64_t counter = 0;
+  bool lite_announced = false;  ///< readLite で kind の対応を返したか
 };
 
 //------------------------------------------------------------
@@ -80,20 +255,90 @@ class NotifierImpl final : public Notifier::Server {
     const auto params = ctx.getParams();
     LOG_COUT << "[Notifier] subscribe: filter="
              << params.getParams().getFilter().cStr() << std::endl;
-    state_ = kj::heap<SharedState>();
+    auto state = std::make_shared<SharedState>(next_subscription_id_++);
+    state->filters.add(params.getParams().getFilter().cStr());
+    state->delivery = params.getParams().getDelivery();
+    registerSubscription(ctx.getResults(), kj::mv(state));
+    return kj::READY_NOW;
+  }
 
-    ctx.getResults().setStream(kj::heap<StreamImpl>(*state_, *timer_ptr_));
-    ctx.getResults().setSubscription(kj::heap<SubscriptionImpl>(*state_));
+  kj::Promise<void> subscribeMany(SubscribeManyContext ctx) override {
+    KJ_REQUIRE(timer_ptr_ != nullptr, "Timer not set!");
+    const auto list = ctx.getParams().getParams();
+    KJ_REQUIRE(list.size() > 0, "subscribeMany needs at least one filter");
+    LOG_COUT << "[Notifier] subscribeMany: filters=" << list.size()
+             << std::endl;
 
-    LOG_COUT << "[Notifier] new subscription\n";
+    // フィルタはすべての要素から、配信オプションは先頭の要素から取る
+    auto state = std::make_shared<SharedState>(next_subscription_id_++);
+    for (const auto params : list) {
+      state->filters.add(params.getFilter().cStr());
+    }
+    state->delivery = list[0].getDelivery();
+    registerSubscription(ctx.getResults(), kj::mv(state));
     return kj::READY_NOW;
   }
 
+  /**
+   * @brief 購読を登録簿から外す
+   *
+   * @param id 外す購読の id
+   */
+  void removeSubscription(uint64_t id) {
+    subscriptions_.erase(id);
+    LOG_COUT << "[Notifier] active subscriptions: " << subscriptions_.size()
+             << "\n";
+  }
+
  private:
+  /**
+   * @brief 購読を登録簿に加え、Subscription と Stream を結果に設定する
+   *
+   * @tparam Results subscribe / subscribeMany の結果 Builder
+   * @param results 結果の設定先
+   * @param state   新しい購読の状態
+   */
+  template <typename Results>
+  void registerSubscription(Results results,
+                            std::shared_ptr<SharedState> state) {
+    subscriptions_.emplace(state->id, state);
+    results.setStream(kj::heap<StreamImpl>(state, *timer_ptr_));
+    results.setSubscription(kj::heap<SubscriptionImpl>(*this, kj::mv(state)));
+    LOG_COUT << "[Notifier] new subscription\n";
+  }
+
   kj::Timer *timer_ptr_ = nullptr;
-  kj::Own<SharedState> state_;
+  /// 購読の登録簿。状態の所有は Subscription / Stream の capability が持つ
+  std::unordered_map<uint64_t, std::weak_ptr<SharedState>> subscriptions_;
+  uint64_t next_subscription_id_ = 0;
 };
 
+SubscriptionImpl::~SubscriptionImpl() {
+  if (state->cancelled.load()) return;
+  LOG_COUT << "[Subscription] released without cancel()\n";
+  release();
+}
+
+kj::Promise<void> SubscriptionImpl::cancel(CancelContext context) {
+  if (state->cancelled.load()) {
+    LOG_COUT << "[Subscription] already cancelled\n";
+    return kj::READY_NOW;
+  }
+  LOG_COUT << "[Subscription] cancel()\n";
+  release();
+  return kj::READY_NOW;
+}
+
+void SubscriptionImpl::release() {
+  state->cancelled.store(true);
+
+  // 待機中の read() を同じターンで失敗させ、保持していた通知を解放して
+  // 登録簿からも外す
+  state->canceler.cancel("subscription cancelled");
+  std::deque<SharedState::Unacked>().swap(state->unacked);
+  notifier.removeSubscription(state->id);
+}
+
 //------------------------------------------------------------
 // main
 //------------------------------------------------------------
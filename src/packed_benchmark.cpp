@@ -0,0 +1,161 @@
+// packed_benchmark.cpp
+// 通知のバッチを plain と packed で枠付けし、ペイロードの大きさごとに
+// 1 件あたりのバイト数と符号化・復号の時間を比べるベンチマーク
+// （RPC は使わず、PackedMessageStream と同じ枠付けだけを測る）
+//
+// 使い方:
+//   packed_benchmark [batches] [batch]
+
+#include <capnp/message.h>
+#include <capnp/serialize-packed.h>
+#include <capnp/serialize.h>
+#include <kj/debug.h>
+#include <kj/io.h>
+
+#include <chrono>
+#include <cstdint>
+#include <packed_transport.hpp>
+#include <string>
+#include <utility.hpp>
+#include <vector>
+
+#include "notification.capnp.h"
+
+namespace {
+
+constexpr int64_t kBaseTimestamp = 1700000000000;
+
+/// 測定結果
+struct Result {
+  uint64_t bytes = 0;     ///< 枠付け後のバイト数の合計
+  double encode = 0;      ///< 符号化にかかった時間（秒）
+  double decode = 0;      ///< 復号にかかった時間（秒）
+  uint64_t checksum = 0;  ///< 最適化で処理が消えないようにするための値
+};
+
+/// @brief JSON 風のペイロード（計測値のレコードを模したもの）
+std::vector<kj::byte> makePayload(size_t size, uint64_t seed) {
+  const std::string record = "{\"host\":\"node-" + std::to_string(seed % 97) +
+                             "\",\"cpu\":0." + std::to_string(seed % 1000) +
+                             ",\"mem\":" + std::to_string(seed % 65536) + "}";
+  std::vector<kj::byte> payload(size);
+  for (size_t i = 0; i < size; ++i) payload[i] = record[i % record.size()];
+  return payload;
+}
+
+/// @brief batch 件の通知を onNotifications の引数として書く
+void fillBatch(capnp::MessageBuilder& builder, uint64_t first, uint32_t batch,
+               const std::vector<std::vector<kj::byte>>& payloads) {
+  auto list =
+      builder.initRoot<PollingNotificationReceiver::OnNotificationsParams>()
+          .initNotifications(batch);
+  for (uint32_t i = 0; i < batch; ++i) {
+    const auto id = first + i;
+    auto n = list[i];
+    n.setId(id);
+    n.setTimestamp(kBaseTimestamp + static_cast<int64_t>(id));
+    n.setKind("polling_demo");
+    n.setKindSeq(id + 1);
+    const auto& payload = payloads[id % payloads.size()];
+    if (!payload.empty()) {
+      n.setPayload(kj::arrayPtr(payload.data(), payload.size()));
+    }
+  }
+}
+
+/// @brief 復号したバッチを走査する
+uint64_t traverse(capnp::MessageReader& reader) {
+  uint64_t sum = 0;
+  const auto list =
+      reader.getRoot<PollingNotificationReceiver::OnNotificationsParams>()
+          .getNotifications();
+  for (const auto n : list) {
+    sum += n.getId() + n.getKind().size() + n.getPayload().size();
+  }
+  return sum;
+}
+
+double since(std::chrono::steady_clock::time_point started) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       started)
+      .count();
+}
+
+/**
+ * @brief batches 回、batch 件のバッチを符号化・復号する
+ *
+ * @param format   枠付け方式
+ * @param batches  バッチの数
+ * @param batch    1 バッチの件数
+ * @param payloads 通知に順に割り当てるペイロード
+ */
+Result run(WireFormat format, uint64_t batches, uint32_t batch,
+           const std::vector<std::vector<kj::byte>>& payloads) {
+  Result result;
+  for (uint64_t b = 0; b < batches; ++b) {
+    capnp::MallocMessageBuilder builder;
+    fillBatch(builder, b * batch, batch, payloads);
+
+    auto started = std::chrono::steady_clock::now();
+    if (format == WireFormat::PACKED) {
+      const auto frame =
+          PackedMessageStream::encodeFrame(builder.getSegmentsForOutput());
+      result.encode += since(started);
+      result.bytes += frame.size();
+
+      started = std::chrono::steady_clock::now();
+      kj::ArrayInputStream input(frame.slice(4, frame.size()));
+      capnp::PackedMessageReader reader(input);
+      result.checksum += traverse(reader);
+      result.decode += since(started);
+    } else {
+      const auto flat = capnp::messageToFlatArray(builder);
+      result.encode += since(started);
+      result.bytes += flat.asBytes().size();
+
+      started = std::chrono::steady_clock::now();
+      capnp::FlatArrayMessageReader reader(flat);
+      result.checksum += traverse(reader);
+      result.decode += since(started);
+    }
+  }
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    const uint64_t batches = argc > 1 ? std::stoull(argv[1]) : 20000;
+    const auto batch =
+        static_cast<uint32_t>(argc > 2 ? std::stoul(argv[2]) : 64);
+    KJ_REQUIRE(batches > 0 && batch > 0, "batches and batch must be > 0");
+    const auto messages = static_cast<double>(batches * batch);
+    LOG_COUT << "[PackedBench] batches=" << batches << ", batch=" << batch
+             << std::endl;
+
+    for (const size_t size : {0, 16, 64, 256, 1024, 4096}) {
+      std::vector<std::vector<kj::byte>> payloads;
+      for (uint64_t seed = 0; seed < 16; ++seed) {
+        payloads.push_back(makePayload(size, seed));
+      }
+      const auto plain = run(WireFormat::PLAIN, batches, batch, payloads);
+      const auto packed = run(WireFormat::PACKED, batches, batch, payloads);
+
+      LOG_COUT << "[PackedBench] payload=" << size
+               << " plain: bytesPerMessage=" << plain.bytes / messages
+               << ", encodeNs=" << plain.encode * 1e9 / messages
+               << ", decodeNs=" << plain.decode * 1e9 / messages
+               << " | packed: bytesPerMessage=" << packed.bytes / messages
+               << ", encodeNs=" << packed.encode * 1e9 / messages
+               << ", decodeNs=" << packed.decode * 1e9 / messages
+               << " | ratio=" << static_cast<double>(packed.bytes) / plain.bytes
+               << " (checksum " << plain.checksum + packed.checksum << ")"
+               << std::endl;
+    }
+  } catch (kj::Exception& e) {
+    LOG_COUT << "Benchmark exception: " << e.getDescription().cStr()
+             << std::endl;
+    return 1;
+  }
+}
@@ -1,13 +1,29 @@
 // polling_client.cpp
 // ポーリング方式の通知クライアント実装
 // Context経由で通知を受信
+//
+// 使い方:
+//   polling_client [--packed]   --packed で packed 符号化の接続を希望する
 
-#include <capnp/ez-rpc.h>
-#include <kj/async.h>
+#include <ack_batcher.hpp>
+#include <blob_cache.hpp>
+#include <chunk_assembler.hpp>
+#include <credit_replenisher.hpp>
+#include <dedup_window.hpp>
+#include <delta_batch.hpp>
+#include <gap_detector.hpp>
+#include <kj/async-io.h>
 #include <kj/debug.h>
 
 #include <chrono>
+#include <cstring>
 #include <iostream>
+#include <kind_dictionary.hpp>
+#include <kind_router.hpp>
+#include <notification_store.hpp>
+#include <packed_transport.hpp>
+#include <payload_dictionary.hpp>
+#include <set>
 #include <thread>
 #include <utility.hpp>
 
@@ -43,30 +59,296 @@ class NotificationReceiverImpl final
    * @return kj::Promise<void> 処理完了を示すプロミス
    */
   kj::Promise<void> onNotification(OnNotificationContext context) override {
-    const auto notification = context.getParams().getNotification();
+    handleNotification(context.getParams().getNotification());
+    return kj::READY_NOW;
+  }
+
+  /**
+   * @brief バッチ配信で複数の通知をまとめて受信する
+   * @param context 通知コンテキスト（id 昇順の通知リストを含む）
+   * @return kj::Promise<void> 処理完了を示すプロミス
+   */
+  kj::Promise<void> onNotifications(OnNotificationsContext context) override {
+    const auto notifications = context.getParams().getNotifications();
+    LOG_COUT << "[Context Notification] batch of " << notifications.size()
+             << std::endl;
+    for (const auto notification : notifications) {
+      handleNotification(notification);
+    }
+    return kj::READY_NOW;
+  }
+
+  /**
+   * @brief 差分でビット詰めしたバッチを受信する（deltaBatches 購読時）
+   * @details 通知のリストに戻してから、1 件ずつ通常の通知と同じく処理する
+   * @param context 通知コンテキスト（id 昇順のバッチを含む）
+   * @return kj::Promise<void> 処理完了を示すプロミス
+   */
+  kj::Promise<void> onDeltaBatch(OnDeltaBatchContext context) override {
+    const auto batch = context.getParams().getBatch();
+    LOG_COUT << "[Context Notification] delta batch of " << batch.getCount()
+             << " (" << context.getParams().totalSize().wordCount * 8
+             << " bytes)" << std::endl;
+    // 件数は列の長さと照らし合わせてから確保する
+    const auto count = validateDeltaBatch(batch);
+    capnp::MallocMessageBuilder message;
+    auto list = message.initRoot<PollingNotificationReceiver::
+                                     OnNotificationsParams>()
+                    .initNotifications(count);
+    expandDeltaBatch(batch, list);
+    for (const auto notification : list.asReader()) {
+      handleNotification(notification);
+    }
+    return kj::READY_NOW;
+  }
+
+  /**
+   * @brief kind の番号と文字列の対応を受け取る（internKinds 購読時）
+   * @details 対応する通知より先に届くので、辞書とルーターに登録しておく
+   * @param context 対応の一覧を含むコンテキスト
+   * @return kj::Promise<void> 処理完了を示すプロミス
+   */
+  kj::Promise<void> onKinds(OnKindsContext context) override {
+    const auto bindings = context.getParams().getBindings();
+    kinds.bind(bindings);
+    for (const auto binding : bindings) {
+      LOG_COUT << "[Context Notification] kind #" << binding.getId() << " = "
+               << binding.getKind().cStr() << std::endl;
+      if (router != nullptr) router->bind(binding.getId(), binding.getKind());
+    }
+    return kj::READY_NOW;
+  }
+
+  /**
+   * @brief ペイロードの辞書を受け取る（compression 購読時）
+   * @details 辞書を参照する通知より先に届くので、登録しておく
+   * @param context 辞書の一覧を含むコンテキスト
+   * @return kj::Promise<void> 処理完了を示すプロミス
+   */
+  kj::Promise<void> onDictionaries(OnDictionariesContext context) override {
+    const auto dictionaries = context.getParams().getDictionaries();
+    for (const auto dictionary : dictionaries) {
+      LOG_COUT << "[Context Notification] dictionary #" << dictionary.getId()
+               << " for " << dictionary.getKind().cStr() << " ("
+               << dictionary.getData().size() << " bytes)" << std::endl;
+    }
+    payloads.add(dictionaries);
+    return kj::READY_NOW;
+  }
 
-    LOG_COUT << "[Context Notification] id=" << notification.getId()
-             << ", kind=" << notification.getKind().cStr()
-             << ", timestamp=" << notification.getTimestamp() << std::endl;
+  /**
+   * @brief 分けて送られたペイロードの断片を受け取る（chunkBytes 購読時）
+   * @details 中身がそろった通知をアプリケーションに渡す。断片の間にも
+   * 他の通知は届くので、その通知は先に渡る
+   * @param context 断片を含むコンテキスト
+   * @return kj::Promise<void> 処理完了を示すプロミス
+   */
+  kj::Promise<void> onPayloadChunk(OnPayloadChunkContext context) override {
+    const auto params = context.getParams();
+    reclaimChunks();
+    KJ_IF_SOME(complete, chunks.add(params.getId(), params.getOffset(),
+                                    params.getData(), timer->now())) {
+      LOG_COUT << "[Context Notification] chunked payload id="
+               << params.getId() << " complete ("
+               << complete->get().getPayload().size() << " bytes)"
+               << std::endl;
+      deliver(kj::mv(complete));
+      materialized(params.getId());
+    }
+    return kj::READY_NOW;
+  }
+
+  /**
+   * @brief サーバーが購読を打ち切ったことを受け取る
+   * @details 以降は何も届かない。再接続して続きから購読し直す場合は
+   * ResilientSession を使う
+   * @param context 打ち切りの理由を含むコンテキスト
+   * @return kj::Promise<void> 処理完了を示すプロミス
+   */
+  kj::Promise<void> onClosed(OnClosedContext context) override {
+    LOG_COUT << "[Context Notification] subscription closed by server: "
+             << context.getParams().getReason().cStr() << std::endl;
+    return kj::READY_NOW;
+  }
+
+  /**
+   * @brief 受信した通知 1 件を処理する
+   * @param notification 受信した通知
+   */
+  void handleNotification(::Notification::Reader notification) {
+    const auto id = notification.getId();
+    reclaimChunks();
+    // 再送で重複した通知はアプリケーションに渡さない（ack とクレジットは返す）
+    if (dedup.accept(id)) {
+      detectGap(notification);
+      if (!handleNew(notification)) {
+        // 中身がそろうまで ack もクレジットの返却もしない
+        materializing.insert(id);
+        return;
+      }
+    } else if (notification.getPayloadChunked() == 0 && chunks.cancel(id)) {
+      // 断片の送信をやめたサーバーが、同じ通知を分けずに送り直してきた
+      LOG_COUT << "[Context Notification] id=" << id
+               << " redelivered unsplit" << std::endl;
+      if (handleNew(notification)) materialized(id);
+      return;
+    } else {
+      LOG_COUT << "[Context Notification] duplicate id=" << id
+               << ", total=" << dedup.getDuplicates() + dedup.getStale()
+               << std::endl;
+    }
+    completed(id);
+  }
+
+  /**
+   * @brief 中身の取得を待っていた通知を片付ける
+   * @details 取得に失敗した場合も呼ぶ。取り直し（replay）で届いた通知は
+   * 待ちに登録していないので何もしない
+   * @param id 通知の id
+   */
+  void materialized(uint64_t id) {
+    if (materializing.erase(id) > 0) completed(id);
+  }
+
+  /**
+   * @brief 断片が届かなくなった通知をあきらめ、ack を先へ進める
+   * @details ack しないでおけばサーバーは中身ごと再送し、断片は offset 0
+   * からやり直して同じ組み立てに入る。それでも届かない中身はあきらめる
+   */
+  void reclaimChunks() {
+    if (chunks.size() == 0) return;
+    for (const auto id : chunks.reclaim(timer->now())) {
+      LOG_COUT << "[Context Notification] chunked payload id=" << id
+               << " stalled, dropped" << std::endl;
+      materialized(id);
+    }
+  }
+
+  /**
+   * @brief 処理が終わった通知の ack とクレジットを記録する
+   * @details 累積 ack なので、中身の取得を待っている通知があれば
+   * その手前までしか ack しない
+   * @param id 処理が終わった通知の id
+   */
+  void completed(uint64_t id) {
+    completedUpTo = std::max(completedUpTo, id);
+    if (ackBatcher != nullptr) {
+      auto upTo = completedUpTo;
+      const bool held =
+          !materializing.empty() && *materializing.begin() <= upTo;
+      if (held) upTo = *materializing.begin() - 1;
+      if (!held || *materializing.begin() > 0) ackBatcher->received(upTo);
+    }
+    // 消費した分のクレジットをまとめて返却
+    if (credits != nullptr) {
+      credits->consumed();
+    }
+  }
+
+  /**
+   * @brief kind ごとの連番の飛びを調べ、欠けた範囲だけを取り直す
+   * @details 取り直した通知はフロー制御の対象外なので、ack も
+   * クレジットの返却もしない
+   * @param notification 受信した通知
+   */
+  void detectGap(::Notification::Reader notification) {
+    KJ_IF_SOME(gap, gaps.observe(kinds.kindOf(notification),
+                                 notification.getKindSeq())) {
+      LOG_COUT << "[Gap] kind=" << gap.kind << ", seq=" << gap.fromSeq << ".."
+               << gap.toSeq << std::endl;
+      if (notifier == nullptr) return;
+      auto req = notifier->replayRequest();
+      req.setKind(gap.kind);
+      req.setFromSeq(gap.fromSeq);
+      req.setToSeq(gap.toSeq);
+      taskSet->add(req.send().then([this](auto&& response) {
+        for (const auto n : response.getNotifications()) {
+          if (dedup.accept(n.getId())) handleNew(n);
+        }
+        if (!response.getComplete()) {
+          LOG_COUT << "[Gap] replay incomplete: "
+                   << "some notifications already left the server log"
+                   << std::endl;
+        }
+      }));
+    }
+  }
+
+  /**
+   * @brief 初めて受け取った通知をアプリケーションに渡す
+   * @param notification 受信した通知
+   * @return bool 渡し終えたら true、中身がそろってから渡すなら false
+   */
+  bool handleNew(::Notification::Reader notification) {
+    // 呼び出しの完了後も参照できるよう、メッセージごと保持する
+    // （圧縮されたペイロードはここで戻す）
+    auto retained = payloads.decode(notification);
+    if (retained->get().getPayloadChunked() > 0) {
+      // 中身は onPayloadChunk でそろってから渡す
+      const auto id = retained->get().getId();
+      if (chunks.begin(kj::mv(retained), timer->now())) return false;
+      LOG_COUT << "[Context Notification] chunked payload id=" << id
+               << " exceeds the assembly limit, dropped" << std::endl;
+      return true;
+    }
+    if (retained->get().getPayloadBlob()) {
+      KJ_IF_SOME(resolved, blobs.resolveCached(retained->get())) {
+        retained = kj::mv(resolved);
+      } else {
+        // 手元にない中身は取得してから渡す（その間に後続の通知が先に
+        // 渡ることがある）
+        KJ_REQUIRE(notifier != nullptr, "no notifier to fetch blobs from");
+        const auto id = retained->get().getId();
+        taskSet->add(blobs.fetch(*notifier, kj::mv(retained))
+                         .then([this](kj::Own<const RetainedNotification> n) {
+                           deliver(kj::mv(n));
+                         })
+                         .catch_([id](kj::Exception&& e) {
+                           LOG_COUT << "[Context Notification] blob for id="
+                                    << id << " lost: "
+                                    << e.getDescription().cStr() << std::endl;
+                         })
+                         .then([this, id]() { materialized(id); }));
+        return false;
+      }
+    } else {
+      blobs.observe(retained->get());
+    }
+    deliver(kj::mv(retained));
+    return true;
+  }
+
+  /**
+   * @brief ペイロードを戻した通知をアプリケーションに渡す
+   * @param retained 保持した通知
+   */
+  void deliver(kj::Own<const RetainedNotification> retained) {
+    // kind ごとのアプリケーション処理
+    if (router != nullptr) {
+      router->dispatch(retained->get());
+    }
 
     if (!is_start_) {
       is_start_ = true;
-      recursivePrint(notification);
+      recursivePrint(retained->addRef());
     }
-    return kj::READY_NOW;
+    store.put(kj::mv(retained));
   }
 
   /**
    * @brief 通知データを再帰的に処理する
-   * @details 100ミリ秒間隔で同じ通知データを継続的に出力し続ける
-   * @param reader 処理対象の通知データリーダー
-   */
-  void recursivePrint(const ::Notification::Reader& reader) {
-    LOG_COUT << "[recursivePrint] id=" << reader.getId() << std::endl;
-    auto promise =
-        timer->afterDelay(100 * kj::MILLISECONDS).then([this, reader]() {
-          recursivePrint(reader);
-        });
+   * @details 100ミリ秒間隔で同じ通知データを継続的に出力し続ける。
+   * RPC 呼び出しのメッセージは完了時に解放されるため、Reader ではなく
+   * 保持したハンドルをタイマーの継続に渡す
+   * @param notification 処理対象の通知のハンドル
+   */
+  void recursivePrint(kj::Own<const RetainedNotification> notification) {
+    LOG_COUT << "[recursivePrint] id=" << notification->get().getId()
+             << ", stored=" << store.size() << std::endl;
+    auto promise = timer->afterDelay(100 * kj::MILLISECONDS)
+                       .then([this, n = kj::mv(notification)]() mutable {
+                         recursivePrint(kj::mv(n));
+                       });
     taskSet->add(kj::mv(promise));
   }
 
@@ -82,9 +364,49 @@ class NotificationReceiverImpl final
    */
   void setTaskSet(kj::TaskSet* ts) { taskSet = ts; }
 
+  /**
+   * @brief 累積 ack の送信器を設定する（atLeastOnce 購読時）
+   * @param b 使用する ack 送信器のポインタ
+   */
+  void setAckBatcher(CumulativeAckBatcher<PollingSubscription::Client>* b) {
+    ackBatcher = b;
+  }
+
+  /**
+   * @brief クレジットの返却器を設定する（フロー制御あり購読時）
+   * @param c 使用するクレジット返却器のポインタ
+   */
+  void setCreditReplenisher(CreditReplenisher* c) { credits = c; }
+
+  /**
+   * @brief kind ごとの振り分け先を設定する
+   * @param r 使用するルーターのポインタ
+   */
+  void setRouter(KindRouter* r) { router = r; }
+
+  /**
+   * @brief 取りこぼしを取り直す先を設定する
+   * @param n 購読先の PollingNotifier のポインタ
+   */
+  void setNotifier(PollingNotifier::Client* n) { notifier = n; }
+
   bool is_start_ = false;  ///< 再帰処理が開始されたかを示すフラグ
   kj::Timer* timer;        ///< 遅延処理用のタイマーオブジェクト
   kj::TaskSet* taskSet;    ///< 非同期タスク管理用のタスクセット
+  CumulativeAckBatcher<PollingSubscription::Client>* ackBatcher =
+      nullptr;  ///< 累積 ack の送信器
+  CreditReplenisher* credits = nullptr;  ///< クレジットの返却器
+  KindRouter* router = nullptr;          ///< kind ごとの振り分け先
+  KindDictionary kinds;                  ///< kind の番号と文字列の対応
+  PayloadDecompressor payloads;          ///< 圧縮されたペイロードの辞書
+  BlobResolver blobs;                    ///< ハッシュで届いた中身の解決
+  ChunkAssembler chunks;                 ///< 分けて届く中身の組み立て
+  NotificationStore store{256};          ///< 直近に受信した通知
+  DedupWindow<> dedup;                   ///< 受信済みの通知 id
+  std::set<uint64_t> materializing;      ///< 中身の取得を待っている通知
+  uint64_t completedUpTo = 0;            ///< 処理を終えた最大の通知 id
+  GapDetector gaps;                      ///< kind ごとの連番の飛び
+  PollingNotifier::Client* notifier = nullptr;  ///< replay の送信先
 };
 
 /**
@@ -92,33 +414,85 @@ class NotificationReceiverImpl final
  * @details ポーリング通知クライアントを起動し、サーバーからの通知を受信する
  * @return int プログラムの終了コード��0: 正常終了、その他: エラー）
  */
-int main() {
+int main(int argc, char* argv[]) {
   try {
     LOG_COUT << "Starting Polling Notifier client..." << std::endl;
+    const bool packed = argc > 1 && std::strcmp(argv[1], "--packed") == 0;
 
-    // ポーリングサーバーに接続（ポート5924）
-    capnp::EzRpcClient client("localhost", 5924);
-    auto& ws = client.getWaitScope();
-    auto& timer = client.getIoProvider().getTimer();  // 参照で取得
+    // ポーリングサーバーに接続（ポート5924）し、枠付け方式を交渉する
+    auto io = kj::setupAsyncIo();
+    auto& ws = io.waitScope;
+    auto& timer = io.provider->getTimer();  // 参照で取得
+    auto connection =
+        NegotiatedConnection::connect(
+            io.provider->getNetwork(), kj::str("localhost"), 5924,
+            packed ? WireFormat::PACKED : WireFormat::PLAIN)
+            .wait(ws);
+    LOG_COUT << "Connected (" << wireFormatName(connection->getFormat())
+             << ")" << std::endl;
     SimpleErrorHandler errorHandler;
     kj::TaskSet task_set(errorHandler);
 
     // NotificationReceiver実装を作成
     auto receiverImpl = kj::heap<NotificationReceiverImpl>();
+    auto* receiverRaw = receiverImpl.get();
     receiverImpl->setTimer(&timer);
     receiverImpl->setTaskSet(&task_set);
+
+    // kind ごとの処理を登録（polling_demo はコンパイル時にハッシュ済み）
+    KindRouter router;
+    router
+        .on<"polling_demo">([](::Notification::Reader n) {
+          LOG_COUT << "[Context Notification] id=" << n.getId()
+                   << ", polling_demo #" << n.getKindSeq()
+                   << ", timestamp=" << n.getTimestamp() << std::endl;
+        })
+        .otherwise([](::Notification::Reader n) {
+          LOG_COUT << "[Context Notification] unhandled kind #"
+                   << n.getKindId() << std::endl;
+        });
+    receiverImpl->setRouter(&router);
     PollingNotificationReceiver::Client receiver(kj::mv(receiverImpl));
 
     // PollingNotifierに接続
-    auto pollingNotifier = client.getMain<PollingNotifier>();
+    auto pollingNotifier = connection->bootstrap<PollingNotifier>();
+    receiverRaw->setNotifier(&pollingNotifier);
 
-    // Subscribe リクエスト送信
+    // Subscribe リクエスト送信（atLeastOnce で累積 ack を返し、
+    // クレジット方式でサーバーの送信量を制限する）
+    constexpr uint32_t kCreditWindow = 256;
     LOG_COUT << "Sending Polling Subscribe request..." << std::endl;
-    auto req = pollingNotifier.subscribeRequest();
-    req.setFilter("PollingNotifier");
+    auto req = pollingNotifier.subscribeWithParamsRequest();
+    auto params = req.initParams();
+    params.setFilter("polling_*");
+    params.setDelivery(DeliveryMode::AT_LEAST_ONCE);
+    params.setCredits(kCreditWindow);
+    // kind は文字列ではなく番号で受け取り、バッチは id・timestamp を
+    // 差分でビット詰めした形で受け取る。ペイロードは共有辞書で圧縮させる
+    params.setInternKinds(true);
+    params.setDeltaBatches(true);
+    params.setCompression(true);
+    // 前にも届いた大きな中身はハッシュだけで受け取る
+    params.setBlobs(true);
+    // 64 KiB を超える中身は分けて受け取り、小さな通知を待たせない
+    params.setChunkBytes(64 * 1024);
+    // 低負荷時は即時、高負荷時は最大 64 件・遅延 500us までまとめて受け取る
+    auto batch = params.initBatch();
+    batch.setMaxSize(64);
+    batch.setMaxLatencyMicros(500);
     req.setReceiver(receiver);
 
-    auto resp = req.send().wait(ws);
+    // パイプライン化された subscription に対して ack 送信器を先に用意し、
+    // 最初の通知が届く前に receiver へ設定しておく
+    auto promise = req.send();
+    CumulativeAckBatcher<PollingSubscription::Client> ackBatcher(
+        promise.getSubscription(), timer, task_set);
+    receiverRaw->setAckBatcher(&ackBatcher);
+    CreditReplenisher credits(promise.getSubscription(), task_set,
+                              kCreditWindow);
+    receiverRaw->setCreditReplenisher(&credits);
+
+    auto resp = promise.wait(ws);
     LOG_COUT << "Polling Subscribe request sent." << std::endl;
     auto subscription = resp.getSubscription();
 
@@ -126,11 +500,13 @@ int main() {
 
     // 10秒後にキャンセルを送信
     auto timer_promise =
-        timer.afterDelay(10 * kj::SECONDS).then([subscription]() mutable {
-          LOG_COUT << "[Client] Cancelling polling subscription..."
-                   << std::endl;
-          (void)subscription.cancelRequest().send().ignoreResult();
-        });
+        timer.afterDelay(10 * kj::SECONDS)
+            .then([subscription, &ackBatcher]() mutable {
+              LOG_COUT << "[Client] Cancelling polling subscription..."
+                       << std::endl;
+              ackBatcher.flush();
+              (void)subscription.cancelRequest().send().ignoreResult();
+            });
     task_set.add(kj::mv(timer_promise));
 
     LOG_COUT << "[Client] Polling client finished." << std::endl;
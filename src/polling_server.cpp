@@ -1,13 +1,37 @@
 // polling_server.cpp
 // ポーリング方式の通知サーバー実装
 // Context経由で通知を送信
+//
+// 使い方:
+//   polling_server [port]                         リーダーとして起動
+//   polling_server [port] --follow host:port      フォロワーとして起動
+// オプション:
+//   --publish-ms N     デモ通知の発行間隔（既定 1000）
+//   --heartbeat-ms N   再送・リーダー監視の間隔（既定 1000、0 で無効。
+//                      フォロワーは昇格の判定に使うので 0 にできない）
+//   --slow-consumer A  遅い購読者への対処 none|conflate|sample|evict
+//                      （既定 conflate）
+//   --packed           packed 符号化を希望する接続に packed を許可する
+//                      （フォロワーはリーダーへも packed を希望する）
 
-#include <capnp/ez-rpc.h>
+#include <kj/async-io.h>
 #include <kj/debug.h>
 
+#include <algorithm>
 #include <atomic>
+#include <blob_store.hpp>
 #include <chrono>
+#include <cstring>
+#include <delta_batch.hpp>
+#include <deque>
 #include <memory>
+#include <notification_filter.hpp>
+#include <notification_log.hpp>
+#include <packed_transport.hpp>
+#include <payload_dictionary.hpp>
+#include <random>
+#include <string>
+#include <unordered_set>
 #include <utility.hpp>
 #include <vector>
 
@@ -28,39 +52,254 @@ class SimpleErrorHandler final : public kj::TaskSet::ErrorHandler {
   }
 };
 
+/**
+ * @brief 現在時刻をエポックからのミリ秒で取得する
+ */
+inline int64_t nowMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * @brief 起動ごとに異なる、0 以外の id の系列のエポックを作る
+ */
+inline uint64_t newEpoch() {
+  std::random_device device;
+  std::mt19937_64 random((uint64_t{device()} << 32) ^ device() ^
+                         static_cast<uint64_t>(nowMillis()));
+  uint64_t epoch = 0;
+  while (epoch == 0) epoch = random();
+  return epoch;
+}
+
 //------------------------------------------------------------
 // ポーリング購読状態
 //------------------------------------------------------------
-struct PollingSubscriptionState {
+struct PollingSubscriptionState
+    : std::enable_shared_from_this<PollingSubscriptionState> {
+  /// ack 待ちの通知（atLeastOnce のみ）
+  struct Unacked {
+    uint64_t id;
+    kj::TimePoint sent_at;
+  };
+
+  /// onPayloadChunk で送り終えていないペイロード
+  struct PendingChunks {
+    uint64_t id;
+    std::shared_ptr<const BlobStore::Blob> blob;
+    size_t offset = 0;  ///< 次に送る位置
+  };
+
   std::atomic<bool> cancelled{false};
   PollingNotificationReceiver::Client receiver;
-  std::string filter;
+  FilterSet filters;  ///< 購読フィルタ（subscribeMany では複数）
+  uint64_t next_id;  ///< 次に配信するログ上の id（購読ごとのカーソル）
+  /// 購読時点のログの先頭。これより前は再開のための追いつきで、遅れの
+  /// 判定に含めない
+  uint64_t catch_up_until = 0;
+  DeliveryMode delivery = DeliveryMode::AT_MOST_ONCE;
+  std::deque<Unacked> unacked;  ///< 送信済みで未 ack の通知（id 昇順）
+  uint64_t redelivered = 0;     ///< 再送した通知の累計
+
+  /// 1 購読が持てるクレジットの上限。送信中の通知数（＝購読ごとの
+  /// サーバー側メモリ）はこれで上から抑えられる
+  static constexpr uint32_t kMaxCredits = 4096;
+  bool flow_controlled = false;  ///< クレジット方式のフロー制御を行うか
+  uint32_t credits = 0;          ///< 残りクレジット（未消費で送れる数）
+
+  // バッチ配信（batch_max > 0 のときのみ）
+  uint32_t batch_max = 0;     ///< 1 バッチの最大件数
+  uint32_t batch_target = 1;  ///< RTT から見積もった目標バッチサイズ
+  kj::Duration latency_budget = 1 * kj::MILLISECONDS;  ///< 最古通知の許容遅延
+  uint32_t batches_inflight = 0;  ///< 応答待ちの onNotifications 数
+  bool has_pending = false;       ///< 未送信の通知があるか
+  kj::TimePoint pending_since = kj::origin<kj::TimePoint>();  ///< 最古の未送信
+  bool flush_timer_armed = false;  ///< 遅延上限のタイマーを設定済みか
+  kj::Duration rtt = 0 * kj::MILLISECONDS;  ///< onNotifications の RTT（EWMA）
+
+  /// 送信中の呼び出しとフラッシュ用タイマーをまとめて取り消す
+  kj::Canceler canceler;
+
+  /// 配信の粒度。遅い購読者は間引いた配信に降格される
+  enum class Level { FULL, CONFLATED, SAMPLED };
+  Level level = Level::FULL;
+  uint64_t skipped = 0;  ///< 間引きで送らなかった通知の累計
+
+  // kind の番号（LogEntry::kind_id）ごとの状態
+  bool intern_kinds = false;         ///< kind を番号で送るか
+  bool lite = false;  ///< NotificationLite で送るか（intern_kinds を含む）
+  bool delta_batches = false;  ///< バッチを DeltaBatch で送るか
+  bool compression = false;    ///< ペイロードを辞書で圧縮して送るか
+  bool blobs = false;  ///< 前にも送った大きな中身をハッシュで送るか
+  /// これを超えるペイロードを分けて送る（0 で無効。断片の送信に失敗すると
+  /// 0 に戻す）
+  uint32_t chunk_bytes = 0;
+  std::deque<PendingChunks> chunks;  ///< 分けて送る途中のペイロード（送る順）
+  bool chunk_in_flight = false;      ///< onPayloadChunk を送信中か
+  std::unordered_set<uint32_t> sent_dictionaries;  ///< 送った辞書の番号
+  std::vector<bool> announced;       ///< onKinds で対応を送った番号
+  std::vector<int32_t> match_cache;  ///< フィルタの照合結果
+  /// match_cache で未照合を表す値
+  static constexpr int32_t kUnmatched = -2;
+
+  PollingSubscriptionState(PollingNotificationReceiver::Client r, FilterSet f,
+                           uint64_t start_id)
+      : receiver(kj::mv(r)), filters(kj::mv(f)), next_id(start_id) {}
+
+  /**
+   * @brief 累積 ack を適用し、upToId 以下を未 ack ウィンドウから外す
+   *
+   * @param upToId 受信済みとされた最大の id
+   */
+  void ack(uint64_t upToId) {
+    while (!unacked.empty() && unacked.front().id <= upToId) {
+      unacked.pop_front();
+    }
+  }
+
+  /**
+   * @brief クレジットを加算する（上限 kMaxCredits）
+   *
+   * @param granted 返却されたクレジット数
+   */
+  void grant(uint32_t granted) {
+    credits = static_cast<uint32_t>(
+        std::min<uint64_t>(uint64_t{credits} + granted, kMaxCredits));
+  }
+
+  /**
+   * @brief エントリの kind に一致したフィルタの番号
+   * @details 照合結果は kind の番号ごとに覚えておくので、文字列の照合は
+   * kind ごとに 1 回だけ
+   * @return int32_t フィルタの番号。一致しなければ FilterSet::kNoMatch
+   */
+  int32_t match(const LogEntry& entry) {
+    return matchKind(entry.kind_id, entry.kind);
+  }
+
+  /// @brief 番号 kind_id の kind に一致したフィルタの番号
+  int32_t matchKind(uint32_t kind_id, const std::string& kind) {
+    if (kind_id >= match_cache.size()) {
+      match_cache.resize(kind_id + 1, kUnmatched);
+    }
+    auto& cached = match_cache[kind_id];
+    if (cached == kUnmatched) cached = filters.match(kind.c_str());
+    return cached;
+  }
 
-  PollingSubscriptionState(PollingNotificationReceiver::Client r,
-                           const std::string& f)
-      : receiver(kj::mv(r)), filter(f) {}
+  /**
+   * @brief 今すぐ送ってよい通知数
+   *
+   * @param limit フロー制御がない場合の上限
+   */
+  size_t sendBudget(size_t limit) const {
+    return flow_controlled ? std::min<size_t>(credits, limit) : limit;
+  }
 };
 
+//------------------------------------------------------------
+// 遅い購読者への対処方針
+//------------------------------------------------------------
+struct SlowConsumerPolicy {
+  /// 降格の閾値を超えたときの対処（CONFLATE・SAMPLE は atLeastOnce の
+  /// 購読には適用せず、そのままにする）
+  enum class Action {
+    NONE,      ///< 何もしない（計測のみ）
+    CONFLATE,  ///< 種類ごとに最新の通知だけを送る
+    SAMPLE,    ///< sample_every 件に 1 件と最新の通知だけを送る
+    EVICT,     ///< 購読を追い出す
+  };
+
+  Action demote_action = Action::CONFLATE;
+  uint64_t demote_queue_depth = 1000;  ///< 一致した未配信＋未 ack の件数
+  kj::Duration demote_pending_age = 2 * kj::SECONDS;  ///< 最古の未配信の経過
+  kj::Duration demote_rtt = 500 * kj::MILLISECONDS;   ///< 送信 RTT（EWMA）
+
+  /// これを超えたら対処に関係なく追い出す
+  uint64_t evict_queue_depth = 3500;
+  kj::Duration evict_pending_age = 10 * kj::SECONDS;
+
+  uint32_t sample_every = 10;
+};
+
+//------------------------------------------------------------
+// レプリケーション先（フォロワー）の状態
+//------------------------------------------------------------
+struct ReplicaState {
+  std::atomic<bool> cancelled{false};
+  ReplicationSink::Client sink;
+  uint64_t next_id;     ///< 次に送るログ上の id
+  uint32_t inflight{0};  ///< 応答待ちの append 呼び出し数
+
+  ReplicaState(ReplicationSink::Client s, uint64_t start_id)
+      : sink(kj::mv(s)), next_id(start_id) {}
+};
+
+class PollingNotifierImpl;
+
 //------------------------------------------------------------
 // PollingSubscription実装
 //------------------------------------------------------------
 class PollingSubscriptionImpl final : public PollingSubscription::Server {
  public:
-  explicit PollingSubscriptionImpl(std::shared_ptr<PollingSubscriptionState> s)
+  PollingSubscriptionImpl(PollingNotifierImpl& n,
+                          std::shared_ptr<PollingSubscriptionState> s)
+      : notifier(n), state(s) {}
+
+  /**
+   * @brief capability が解放されたら購読を片付ける
+   * @details クライアントが cancel() せずに購読を手放した場合や切断した
+   * 場合も、RPC システムが capability を解放した時点で登録簿から外れる。
+   * 追い出しとしては数えず、破棄の途中なので onClosed も送らない
+   */
+  ~PollingSubscriptionImpl();
+
+  kj::Promise<void> cancel(CancelContext context) override;
+
+  kj::Promise<void> ack(AckContext context) override;
+
+  kj::Promise<void> grantCredits(GrantCreditsContext context) override;
+
+  /// @brief 購読状態への参照
+  const std::shared_ptr<PollingSubscriptionState>& getState() const {
+    return state;
+  }
+
+ private:
+  PollingNotifierImpl& notifier;
+  std::shared_ptr<PollingSubscriptionState> state;
+};
+
+//------------------------------------------------------------
+// レプリケーション購読（リーダー側）。cancel でフォロワーへの転送を止める
+//------------------------------------------------------------
+class ReplicationSubscriptionImpl final : public PollingSubscription::Server {
+ public:
+  explicit ReplicationSubscriptionImpl(std::shared_ptr<ReplicaState> s)
       : state(s) {}
 
   kj::Promise<void> cancel(CancelContext context) override {
-    if (state->cancelled.load()) {
-      LOG_COUT << "[PollingSubscription] already cancelled\n";
-    } else {
-      LOG_COUT << "[PollingSubscription] cancel()\n";
-      state->cancelled.store(true);
-    }
+    LOG_COUT << "[Replication] replica cancel()\n";
+    state->cancelled.store(true);
     return kj::READY_NOW;
   }
 
  private:
-  std::shared_ptr<PollingSubscriptionState> state;
+  std::shared_ptr<ReplicaState> state;
+};
+
+//------------------------------------------------------------
+// ReplicationSink実装（フォロワー側）
+//------------------------------------------------------------
+class ReplicationSinkImpl final : public ReplicationSink::Server {
+ public:
+  explicit ReplicationSinkImpl(PollingNotifierImpl& n) : notifier(n) {}
+
+  kj::Promise<void> append(AppendContext ctx) override;
+
+ private:
+  PollingNotifierImpl& notifier;
 };
 
 //------------------------------------------------------------
@@ -68,15 +307,134 @@ class PollingSubscriptionImpl final : public PollingSubscription::Server {
 //------------------------------------------------------------
 class PollingNotifierImpl final : public PollingNotifier::Server {
  public:
+  /// 1 回の append で送る最大エントリ数
+  static constexpr uint32_t kReplicationBatchSize = 256;
+  /// フォロワーごとに同時に送っておく append 呼び出し数
+  static constexpr uint32_t kReplicationMaxInflight = 4;
+  /// この時間リーダーから何も届かなければフォロワーは昇格する
+  static constexpr kj::Duration kLeaderTimeout = 3 * kj::SECONDS;
+  /// atLeastOnce で ack されない通知を再送するまでの時間
+  static constexpr kj::Duration kRedeliveryTimeout = 5 * kj::SECONDS;
+  /// atLeastOnce で購読ごとに保持する未 ack 通知の上限
+  static constexpr size_t kMaxUnacked = 1024;
+  /// replay() 1 回で返す最大件数
+  static constexpr uint64_t kMaxReplay = 1024;
+  /// chunkBytes の下限（細かすぎる断片は呼び出しの負担の方が大きい）
+  static constexpr uint32_t kMinChunkBytes = 4096;
+
   PollingNotifierImpl() = default;
 
   void setTimer(kj::Timer& t) {
     timer_ptr_ = &t;
-    startNotificationLoop();
+    startHeartbeatLoop();
+  }
+
+  /**
+   * @brief ハートビートの間隔を設定する（setTimer より前に呼ぶ）
+   * @param interval 間隔。0 なら再送・リーダー監視のループを動かさない
+   */
+  void setHeartbeatInterval(kj::Duration interval) {
+    heartbeat_interval_ = interval;
+  }
+
+  /**
+   * @brief 遅い購読者への対処方針を設定する
+   * @param policy 閾値と対処
+   */
+  void setSlowConsumerPolicy(const SlowConsumerPolicy& policy) {
+    slow_policy_ = policy;
+  }
+
+  /**
+   * @brief 新しい通知をログに追記し、配信を予約する（リーダーのみ）
+   * @details 配信は同じターン内の publish をまとめて evalLater で行う
+   * @param kind    通知の種類
+   * @param payload ペイロード
+   */
+  void publish(std::string kind, std::vector<uint8_t> payload = {}) {
+    KJ_REQUIRE(is_leader_, "only the leader can publish");
+    // 圧縮とハッシュは発行時に 1 回だけ行い、購読者ごとには行わない
+    auto compressed = dictionaries_.compress(kind, payload);
+    auto blob = blobs_.put(payload);
+    const auto& entry = log_.append(
+        std::move(kind), std::move(payload), nowMillis(),
+        compressed.dictionary_id, std::move(compressed.bytes), std::move(blob));
+
+    /**
+     * @brief 作成された通知データの詳細をログ出力
+     */
+    LOG_COUT << "[Server] Notification created: id=" << entry.id
+             << ", timestamp=" << entry.timestamp << std::endl;
+
+    scheduleDelivery();
+    schedulePumpReplicas();
+  }
+
+  /**
+   * @brief デモ用に一定間隔で通知を発行する
+   * @param interval 発行間隔
+   */
+  void startDemoPublisher(kj::Duration interval) {
+    auto promise = timer_ptr_->afterDelay(interval)
+                       .then([this, interval]() {
+                         if (is_leader_) {
+                           publish("polling_demo", demoPayload());
+                           // ときどき変わらない設定のスナップショットを出す
+                           if (log_.nextId() % 5 == 0) {
+                             publish("polling_config", configSnapshot());
+                           }
+                           // ときどき分けて送られる大きな中身を出す
+                           if (log_.nextId() % 20 == 0) {
+                             publish("polling_bulk", bulkPayload());
+                           }
+                         }
+                         startDemoPublisher(interval);
+                       })
+                       .catch_([](kj::Exception&& e) {
+                         LOG_COUT << "Demo publisher error: "
+                                  << e.getDescription().cStr() << std::endl;
+                       });
+    task_set_->add(kj::mv(promise));
   }
 
   void setTaskSet(kj::TaskSet& t) { task_set_ = &t; }
 
+  /// @brief デモ用の JSON 風ペイロード（計測値のレコードを模したもの）
+  std::vector<uint8_t> demoPayload() const {
+    const auto seq = log_.nextId();
+    const std::string record =
+        "{\"host\":\"node-" + std::to_string(seq % 7) +
+        "\",\"metric\":\"cpu.utilization\",\"unit\":\"percent\","
+        "\"value\":" + std::to_string(seq * 37 % 100) + "}";
+    return {record.begin(), record.end()};
+  }
+
+  /// @brief デモ用の大きなペイロード（256 KiB、毎回違う中身）
+  std::vector<uint8_t> bulkPayload() const {
+    std::vector<uint8_t> payload(256 * 1024);
+    uint64_t x = log_.nextId() * 0x9E3779B97F4A7C15ULL + 1;
+    for (auto& b : payload) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      b = static_cast<uint8_t>(x);
+    }
+    return payload;
+  }
+
+  /// @brief デモ用の設定のスナップショット（毎回同じ中身の大きなペイロード）
+  static std::vector<uint8_t> configSnapshot() {
+    std::string snapshot = "{\"version\":42,\"nodes\":[";
+    for (int i = 0; i < 16; ++i) {
+      if (i > 0) snapshot += ",";
+      snapshot += "{\"name\":\"node-" + std::to_string(i) +
+                  "\",\"zone\":\"zone-" + std::to_string(i % 3) +
+                  "\",\"weight\":" + std::to_string(10 + i) + "}";
+    }
+    snapshot += "]}";
+    return {snapshot.begin(), snapshot.end()};
+  }
+
   kj::Promise<void> subscribe(SubscribeContext ctx) override {
     const auto params = ctx.getParams();
     const auto filter = params.getFilter();
@@ -85,40 +443,585 @@ class PollingNotifierImpl final : public PollingNotifier::Server {
     LOG_COUT << "[PollingNotifier] subscribe: filter=" << filter.cStr()
              << std::endl;
 
-    // 新しい購読状態を作成
-    auto state = std::make_shared<PollingSubscriptionState>(kj::mv(receiver),
-                                                            filter.cStr());
-    subscriptions_.push_back(state);
+    ctx.getResults().setSubscription(addSubscription(
+        kj::mv(receiver), FilterSet(filter.cStr()), log_.nextId()));
+    return kj::READY_NOW;
+  }
 
-    // Subscriptionオブジェクトを返す
-    ctx.getResults().setSubscription(kj::heap<PollingSubscriptionImpl>(state));
+  kj::Promise<void> subscribeWithParams(
+      SubscribeWithParamsContext ctx) override {
+    const auto params = ctx.getParams().getParams();
+    auto receiver = ctx.getParams().getReceiver();
+    const auto start_id = startIdOf(params);
 
-    LOG_COUT << "[PollingNotifier] new polling subscription created\n";
+    LOG_COUT << "[PollingNotifier] subscribeWithParams: filter="
+             << params.getFilter().cStr() << ", start=" << start_id
+             << ", atLeastOnce="
+             << (params.getDelivery() == DeliveryMode::AT_LEAST_ONCE)
+             << std::endl;
+
+    auto subscription =
+        addSubscription(kj::mv(receiver), FilterSet(params.getFilter().cStr()),
+                        start_id, params.getDelivery());
+    applyOptions(*subscription->getState(), params);
+    ctx.getResults().setSubscription(kj::mv(subscription));
     return kj::READY_NOW;
   }
 
- private:
-  void startNotificationLoop() {
-    if (!timer_ptr_) return;
+  kj::Promise<void> subscribeMany(SubscribeManyContext ctx) override {
+    const auto list = ctx.getParams().getParams();
+    auto receiver = ctx.getParams().getReceiver();
+    KJ_REQUIRE(list.size() > 0, "subscribeMany needs at least one filter");
+
+    // フィルタはすべての要素から、配信オプションは先頭の要素から取る
+    FilterSet filters;
+    for (const auto params : list) {
+      filters.add(params.getFilter().cStr());
+    }
+    const auto options = list[0];
+
+    LOG_COUT << "[PollingNotifier] subscribeMany: filters=" << filters.size()
+             << std::endl;
+
+    auto subscription =
+        addSubscription(kj::mv(receiver), kj::mv(filters), startIdOf(options),
+                        options.getDelivery());
+    applyOptions(*subscription->getState(), options);
+    ctx.getResults().setSubscription(kj::mv(subscription));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> replicate(ReplicateContext ctx) override {
+    const auto params = ctx.getParams();
+    const auto from_id =
+        params.getFromOldest() ? log_.firstId() : params.getFromId();
+    KJ_REQUIRE(from_id >= log_.firstId() || log_.size() == 0,
+               "requested entries are no longer in the log", from_id,
+               log_.firstId());
+
+    LOG_COUT << "[Replication] follower attached: fromId=" << from_id
+             << std::endl;
+
+    auto replica = std::make_shared<ReplicaState>(params.getSink(), from_id);
+    replicas_.push_back(replica);
+    auto results = ctx.getResults();
+    results.setSubscription(kj::heap<ReplicationSubscriptionImpl>(replica));
+    results.setEpoch(epoch_);
+
+    pumpReplica(replica);
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> replay(ReplayContext ctx) override {
+    const auto params = ctx.getParams();
+    const std::string kind = params.getKind().cStr();
+    const auto from = params.getFromSeq();
+    const auto requested = params.getToSeq();
+    KJ_REQUIRE(from > 0 && from <= requested, "invalid replay range", from,
+               requested);
+    // from + kMaxReplay - 1 は桁あふれし得るので、幅で比べる
+    const auto to =
+        requested - from < kMaxReplay ? requested : from + (kMaxReplay - 1);
+
+    std::vector<const LogEntry*> entries;
+    log_.forEachKindSeq(kind, from, to, [&](const LogEntry& entry) {
+      entries.push_back(&entry);
+    });
+    LOG_COUT << "[PollingNotifier] replay: kind=" << kind << ", seq=" << from
+             << ".." << to << ", found=" << entries.size() << std::endl;
+
+    auto results = ctx.getResults();
+    auto list =
+        results.initNotifications(static_cast<uint32_t>(entries.size()));
+    for (uint32_t i = 0; i < entries.size(); ++i) {
+      entries[i]->fill(list[i]);
+    }
+    results.setComplete(entries.size() == to - from + 1 && to == requested);
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getBlob(GetBlobContext ctx) override {
+    const auto params = ctx.getParams();
+    const auto hash = params.getHash();
+    KJ_REQUIRE(hash.size() == sizeof(BlobHash), "invalid blob hash",
+               hash.size());
+    const auto blob = blobs_.find(hash);
+    KJ_REQUIRE(blob != nullptr, "blob is no longer in the log");
+    const auto& bytes = blob->bytes;
+    const auto offset = params.getOffset();
+    KJ_REQUIRE(offset <= bytes.size(), "blob offset out of range", offset,
+               bytes.size());
+    auto size = bytes.size() - offset;
+    if (params.getMaxBytes() > 0) {
+      size = std::min<size_t>(
+          size, std::max(params.getMaxBytes(), kMinChunkBytes));
+    }
+    auto results = ctx.getResults();
+    results.setData(kj::arrayPtr(bytes.data() + offset, size));
+    results.setSize(bytes.size());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getEpoch(GetEpochContext ctx) override {
+    ctx.getResults().setEpoch(epoch_);
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getStats(GetStatsContext ctx) override {
+    auto stats = ctx.getResults().initStats();
+    size_t active = 0;
+    for (auto& weak_state : subscriptions_) {
+      auto state = weak_state.lock();
+      if (state && !state->cancelled.load()) ++active;
+    }
+    stats.setActiveSubscriptions(static_cast<uint32_t>(active));
+    stats.setEvictedSubscriptions(evicted_subscriptions_);
+    stats.setLogSize(static_cast<uint32_t>(log_.size()));
+    stats.setDemotions(demotions_);
+    stats.setRestorations(restorations_);
+    stats.setLagEvictions(lag_evictions_);
+    stats.setMaxQueueDepth(max_queue_depth_);
+    stats.setMaxPendingAgeMillis(max_pending_age_ / kj::MILLISECONDS);
+    stats.setMaxRttMicros(max_rtt_ / kj::MICROSECONDS);
+    return kj::READY_NOW;
+  }
+
+  /**
+   * @brief リーダーに接続し、フォロワーとしてログの複製を開始する
+   * @details 自分のログが空ならリーダーに残っている最も古いエントリから
+   * 受け取る。id はリーダーが振ったものなので、エポックもリーダーの
+   * ものを引き継ぐ。昇格はハートビートでリーダーからの応答が
+   * kLeaderTimeout 途絶えたときだけ行い、リーダーが応答したうえで
+   * 失敗した場合は heartbeat の間隔をおいて購読し直す
+   *
+   * @param leader リーダーの PollingNotifier
+   */
+  void follow(PollingNotifier::Client leader) {
+    KJ_REQUIRE(timer_ptr_ != nullptr, "Timer not set!");
+    KJ_REQUIRE(heartbeat_interval_ > 0 * kj::SECONDS,
+               "a follower needs heartbeats to detect leader failure");
+    if (is_leader_) {
+      is_leader_ = false;
+      last_leader_contact_ = timer_ptr_->now();
+    }
+
+    auto req = leader.replicateRequest();
+    req.setFromId(log_.nextId());
+    req.setFromOldest(log_.size() == 0);
+    req.setSink(kj::heap<ReplicationSinkImpl>(*this));
 
-    // 定期的に通知を送信するループを開始
     auto promise =
-        sendNotifications()
-            .then([this]() { return timer_ptr_->afterDelay(1 * kj::SECONDS); })
-            .then([this]() {
-              startNotificationLoop();  // 再帰的に継続
+        req.send()
+            .then([this](auto&& resp) {
+              LOG_COUT << "[Replication] following leader: epoch="
+                       << resp.getEpoch() << std::endl;
+              last_leader_contact_ = timer_ptr_->now();
+              leader_subscription_ = resp.getSubscription();
+              epoch_ = resp.getEpoch();
             })
-            .catch_([](kj::Exception&& e) {
-              LOG_COUT << "Notification loop error: "
+            .catch_([this, leader](kj::Exception&& e) mutable
+                        -> kj::Promise<void> {
+              LOG_COUT << "[Replication] failed to follow leader: "
                        << e.getDescription().cStr() << std::endl;
+              if (is_leader_) return kj::READY_NOW;
+              if (e.getType() == kj::Exception::Type::DISCONNECTED) {
+                // 届かないリーダーはハートビートのタイムアウトで見限る
+                return kj::READY_NOW;
+              }
+              // リーダーは応答しているので、昇格せずに購読し直す
+              last_leader_contact_ = timer_ptr_->now();
+              return timer_ptr_->afterDelay(heartbeat_interval_)
+                  .then([this, leader = kj::mv(leader)]() mutable {
+                    if (!is_leader_) follow(kj::mv(leader));
+                  });
             });
+    task_set_->add(kj::mv(promise));
+  }
+
+  /**
+   * @brief リーダーから届いたエントリを順に適用する（フォロワー側）
+   *
+   * @param entries 適用するエントリ（空ならハートビート）
+   * @return uint64_t 次に期待する id
+   */
+  uint64_t applyReplicated(capnp::List<::Notification>::Reader entries) {
+    if (is_leader_) {
+      // 昇格後に旧リーダーから届いたものは受け付けない
+      KJ_FAIL_REQUIRE("this server has been promoted to leader");
+    }
+    last_leader_contact_ = timer_ptr_->now();
+    for (auto entry : entries) {
+      if (entry.getId() < log_.nextId()) continue;  // 適用済み
+      if (log_.size() > 0 && entry.getId() > log_.nextId()) {
+        // 欠けがある。返す nextId でリーダーに続きから送り直させる
+        break;
+      }
+      auto replicated = LogEntry::fromReader(entry);
+      // 辞書と中身の共有はレプリケーションしないので、フォロワーが自分で
+      // 学習・圧縮・登録する
+      auto compressed =
+          dictionaries_.compress(replicated.kind, replicated.payload);
+      replicated.dictionary_id = compressed.dictionary_id;
+      replicated.compressed = std::move(compressed.bytes);
+      replicated.blob = blobs_.put(replicated.payload);
+      log_.applyReplicated(std::move(replicated));
+    }
+    if (entries.size() > 0) {
+      // 自分の購読者へ配信し、連鎖レプリケーション用にフォロワーへも転送する
+      scheduleDelivery();
+      schedulePumpReplicas();
+    }
+    return log_.nextId();
+  }
+
+  /**
+   * @brief フォロワーをリーダーに昇格させる
+   */
+  void promote() {
+    if (is_leader_) return;
+    LOG_COUT << "[Replication] promoted to leader at id=" << log_.nextId()
+             << std::endl;
+    is_leader_ = true;
+    leader_subscription_ = kj::none;
+  }
+
+  /**
+   * @brief キャンセルされた購読を同じターンで片付ける
+   * @details 送信中の呼び出しとタイマーを取り消し、未 ack ウィンドウを
+   * 解放して登録簿から外す。次の配信を待たずにメモリと作業を回収する。
+   * @param state キャンセルされた購読状態
+   */
+  void removeSubscription(
+      const std::shared_ptr<PollingSubscriptionState>& state) {
+    state->cancelled.store(true);
+    state->canceler.cancel("subscription cancelled");
+    std::deque<PollingSubscriptionState::Unacked>().swap(state->unacked);
+    state->has_pending = false;
+
+    subscriptions_.erase(
+        std::remove_if(
+            subscriptions_.begin(), subscriptions_.end(),
+            [&](const std::weak_ptr<PollingSubscriptionState>& weak_state) {
+              auto s = weak_state.lock();
+              return !s || s == state;
+            }),
+        subscriptions_.end());
+
+    LOG_COUT << "[Server] Active subscriptions: " << subscriptions_.size()
+             << std::endl;
+  }
+
+  /**
+   * @brief 切断された購読を追い出す
+   * @details 送信が DISCONNECTED で失敗したときに呼ぶ。removeSubscription
+   * と同じ片付けを行い、統計に記録する。接続が残っている場合に備えて
+   * receiver にも打ち切りを知らせる
+   * @param state 追い出す購読状態
+   */
+  void evictSubscription(
+      const std::shared_ptr<PollingSubscriptionState>& state) {
+    ++evicted_subscriptions_;
+    notifyClosed(*state, "subscription evicted");
+    removeSubscription(state);
+  }
+
+  /**
+   * @brief receiver に onClosed で購読の打ち切りを知らせる
+   * @details 黙って外すと接続が残ったクライアントは購読し直す契機を
+   * 得られない。onClosed は送信中の呼び出しの後に届く。removeSubscription
+   * で取り消されないよう、購読の canceler の外で送る
+   * @param state  打ち切る購読状態
+   * @param reason 打ち切りの理由
+   */
+  void notifyClosed(PollingSubscriptionState& state, kj::StringPtr reason) {
+    auto req = state.receiver.onClosedRequest();
+    req.setReason(reason);
+    task_set_->add(req.send().ignoreResult().catch_([](kj::Exception&&) {
+      // 切断済みなら知らせる先はない
+    }));
+  }
+
+  /**
+   * @brief 購読者 1 件に対して、tick を待たずに配信を試みる
+   * @details クレジットの返却や ack でウィンドウが空いたときに呼ぶ
+   * @param state 送信先の購読状態
+   */
+  void deliverNow(const std::shared_ptr<PollingSubscriptionState>& state) {
+    if (state->cancelled.load()) return;
+    kj::Vector<kj::Promise<void>> promises;
+    deliver(state, promises);
+    if (promises.size() > 0) {
+      task_set_->add(kj::joinPromises(promises.releaseAsArray()));
+    }
+  }
+
+ private:
+  /// 送信対象として選んだエントリと、一致したフィルタの番号
+  struct Selected {
+    const LogEntry* entry;
+    uint32_t filter_index;
+  };
+
+  /**
+   * @brief SubscribeParams から配信開始位置を求める
+   * @details 再開位置が指定されていればログからその id 以降を再送する。
+   * 再開位置は [firstId, nextId] に収める。遅れているフォロワーへの
+   * 切り替えの後は、先頭より先の id で再開されることがある。
+   * 再起動したサーバーは id を振り直すので、別のエポックで振られた
+   * fromId は収めずに断る（収めるとクライアントは新しい id を受信済みと
+   * みなして黙って捨ててしまう）
+   */
+  uint64_t startIdOf(SubscribeParams::Reader params) const {
+    if (!params.getStart().isFromId()) return log_.nextId();
+    KJ_REQUIRE(params.getEpoch() == 0 || params.getEpoch() == epoch_,
+               "fromId belongs to another server epoch", params.getEpoch(),
+               epoch_);
+    return std::clamp(params.getStart().getFromId(), log_.firstId(),
+                      log_.nextId());
+  }
+
+  /**
+   * @brief SubscribeParams のフロー制御・バッチ・kind 辞書の設定を
+   * 購読状態に反映する
+   */
+  void applyOptions(PollingSubscriptionState& state,
+                    SubscribeParams::Reader params) {
+    if (params.getCredits() > 0) {
+      // 初期クレジットを受け取り、以降は返却された分だけ送る
+      state.flow_controlled = true;
+      state.grant(params.getCredits());
+    }
+    if (params.hasBatch() && params.getBatch().getMaxSize() > 0) {
+      state.batch_max = params.getBatch().getMaxSize();
+      state.latency_budget =
+          params.getBatch().getMaxLatencyMicros() * kj::MICROSECONDS;
+    }
+    if (params.getLite()) state.lite = true;
+    if (params.getDeltaBatches()) state.delta_batches = true;
+    if (params.getInternKinds() || state.lite || state.delta_batches) {
+      // 既知の kind のうちフィルタに一致するものを先にまとめて知らせる
+      state.intern_kinds = true;
+      std::vector<uint32_t> known;
+      for (uint32_t id = 1; id <= log_.kindCount(); ++id) {
+        if (state.matchKind(id, log_.kindName(id)) != FilterSet::kNoMatch) {
+          known.push_back(id);
+        }
+      }
+      announceKinds(state, known);
+    }
+    if (params.getBlobs()) state.blobs = true;
+    if (params.getChunkBytes() > 0) {
+      state.chunk_bytes = std::max(params.getChunkBytes(), kMinChunkBytes);
+    }
+    if (params.getCompression()) {
+      // 一致する kind の最新の辞書を先に送っておく
+      state.compression = true;
+      std::vector<const PayloadCodec::Dictionary*> current;
+      dictionaries_.forEachCurrent([&](const PayloadCodec::Dictionary& d) {
+        if (state.filters.match(d.kind.c_str()) != FilterSet::kNoMatch) {
+          current.push_back(&d);
+        }
+      });
+      announceDictionaries(state, current);
+    }
+  }
+
+  /**
+   * @brief エントリのペイロードを購読者へどの形で送るか
+   * @details 前にも送った大きな中身はハッシュで、chunkBytes を超える
+   * ものは分けて、辞書で圧縮したものはその辞書を捨てていなければ
+   * 圧縮したまま送る
+   */
+  PayloadForm payloadForm(const PollingSubscriptionState& state,
+                          const LogEntry& entry) const {
+    if (state.blobs && entry.blob.repeated) return PayloadForm::BLOB;
+    if (state.chunk_bytes > 0 &&
+        entry.rawPayload().size() > state.chunk_bytes &&
+        entry.blob.blob != nullptr) {
+      return PayloadForm::CHUNKED;
+    }
+    if (state.compression && entry.dictionary_id != 0 &&
+        dictionaries_.find(entry.dictionary_id) != nullptr) {
+      return PayloadForm::COMPRESSED;
+    }
+    return PayloadForm::RAW;
+  }
+
+  /**
+   * @brief まだ送っていない辞書を onDictionaries で送る
+   * @details onKinds と同じく、この後に送る通知より先に届く
+   * @param state        送信先の購読状態
+   * @param dictionaries これから参照する辞書
+   */
+  void announceDictionaries(
+      PollingSubscriptionState& state,
+      const std::vector<const PayloadCodec::Dictionary*>& dictionaries) {
+    std::vector<const PayloadCodec::Dictionary*> fresh;
+    for (const auto* d : dictionaries) {
+      if (state.sent_dictionaries.insert(d->id).second) fresh.push_back(d);
+    }
+    if (fresh.empty()) return;
+
+    auto req = state.receiver.onDictionariesRequest();
+    auto list = req.initDictionaries(static_cast<uint32_t>(fresh.size()));
+    for (uint32_t i = 0; i < fresh.size(); ++i) {
+      list[i].setId(fresh[i]->id);
+      list[i].setKind(fresh[i]->kind.c_str());
+      list[i].setData(
+          kj::arrayPtr(fresh[i]->bytes.data(), fresh[i]->bytes.size()));
+    }
+    task_set_->add(
+        state.canceler.wrap(req.send().ignoreResult())
+            .catch_([this, weak = state.weak_from_this()](kj::Exception&& e) {
+              onSendFailed(weak, e);
+            }));
+  }
+
+  /// @brief 選んだエントリが参照する辞書を、送る前に知らせる
+  void announceDictionaries(PollingSubscriptionState& state,
+                            const std::vector<Selected>& entries) {
+    if (!state.compression) return;
+    std::vector<const PayloadCodec::Dictionary*> used;
+    for (const auto& selected : entries) {
+      if (payloadForm(state, *selected.entry) != PayloadForm::COMPRESSED) {
+        continue;
+      }
+      used.push_back(dictionaries_.find(selected.entry->dictionary_id));
+    }
+    announceDictionaries(state, used);
+  }
+
+  /**
+   * @brief まだ知らせていない kind の番号の対応を receiver に送る
+   * @details 同じ receiver への呼び出しは送った順に届くので、この後に
+   * 送る通知より先に対応が届く
+   * @param state 送信先の購読状態
+   * @param ids   これから送る通知の kind の番号
+   */
+  void announceKinds(PollingSubscriptionState& state,
+                     const std::vector<uint32_t>& ids) {
+    if (!state.intern_kinds) return;
+    std::vector<uint32_t> fresh;
+    for (const auto id : ids) {
+      if (id >= MAX_KIND_IDS) continue;  // 受信側が無視する。文字列で送る
+      if (id >= state.announced.size()) state.announced.resize(id + 1, false);
+      if (state.announced[id]) continue;
+      state.announced[id] = true;
+      fresh.push_back(id);
+    }
+    if (fresh.empty()) return;
+
+    auto req = state.receiver.onKindsRequest();
+    auto bindings = req.initBindings(static_cast<uint32_t>(fresh.size()));
+    for (uint32_t i = 0; i < fresh.size(); ++i) {
+      bindings[i].setId(fresh[i]);
+      bindings[i].setKind(log_.kindName(fresh[i]));
+    }
+    task_set_->add(
+        state.canceler.wrap(req.send().ignoreResult())
+            .catch_([this, weak = state.weak_from_this()](kj::Exception&& e) {
+              onSendFailed(weak, e);
+            }));
+  }
+
+  /// @brief 選んだエントリの kind の番号を、送る前に知らせる
+  void announceKinds(PollingSubscriptionState& state,
+                     const std::vector<Selected>& entries) {
+    if (!state.intern_kinds) return;
+    std::vector<uint32_t> ids;
+    ids.reserve(entries.size());
+    for (const auto& selected : entries) ids.push_back(selected.entry->kind_id);
+    announceKinds(state, ids);
+  }
+
+  /**
+   * @brief 購読状態を作成して登録する
+   *
+   * @param receiver 通知の送信先
+   * @param filters  購読フィルタ
+   * @param start_id 配信を開始するログ上の id
+   * @param delivery 配信保証のモード
+   * @return kj::Own<PollingSubscriptionImpl> クライアントに返す購読
+   */
+  kj::Own<PollingSubscriptionImpl> addSubscription(
+      PollingNotificationReceiver::Client receiver, FilterSet filters,
+      uint64_t start_id,
+      DeliveryMode delivery = DeliveryMode::AT_MOST_ONCE) {
+    // 新しい購読状態を作成
+    auto state = std::make_shared<PollingSubscriptionState>(
+        kj::mv(receiver), kj::mv(filters), start_id);
+    state->delivery = delivery;
+    state->catch_up_until = log_.nextId();
+    subscriptions_.push_back(state);
+
+    // receiver が壊れた promise capability ならその時点で追い出す
+    std::weak_ptr<PollingSubscriptionState> weak = state;
+    task_set_->add(state->canceler.wrap(state->receiver.whenResolved())
+                       .catch_([this, weak](kj::Exception&& e) {
+                         onSendFailed(weak, e);
+                       }));
+
+    if (start_id < log_.nextId()) {
+      // 再開位置が過去ならすぐにログからの再送を始める
+      scheduleDelivery();
+    }
+
+    LOG_COUT << "[PollingNotifier] new polling subscription created\n";
+    // Subscriptionオブジェクトを返す
+    return kj::heap<PollingSubscriptionImpl>(*this, state);
+  }
+
+  /**
+   * @brief 定期的な保守処理（ハートビート）のループ
+   * @details 配信は publish を契機に行うため、ここでは配信を待たない。
+   * ack タイムアウトの再送、フォロワーへのハートビート、リーダーの
+   * タイムアウト検出のみを行う。間隔 0 なら起動しない。
+   */
+  void startHeartbeatLoop() {
+    if (!timer_ptr_ || heartbeat_interval_ == 0 * kj::SECONDS) return;
+
+    auto promise = timer_ptr_->afterDelay(heartbeat_interval_)
+                       .then([this]() {
+                         heartbeat();
+                         startHeartbeatLoop();  // 再帰的に継続
+                       })
+                       .catch_([](kj::Exception&& e) {
+                         LOG_COUT << "Heartbeat loop error: "
+                                  << e.getDescription().cStr() << std::endl;
+                       });
 
     task_set_->add(kj::mv(promise));
   }
 
-  kj::Promise<void> sendNotifications() {
-    LOG_COUT << "[Server] Starting sendNotifications..." << std::endl;
+  void heartbeat() {
+    if (is_leader_) {
+      sendReplicationHeartbeats();
+    } else if (timer_ptr_->now() - last_leader_contact_ > kLeaderTimeout) {
+      LOG_COUT << "[Replication] leader timed out" << std::endl;
+      promote();
+    }
+    // ack タイムアウトの再送はここで拾う
+    deliverAll();
+  }
+
+  /**
+   * @brief 同じイベントループのターン内の publish をまとめて配信する
+   * @details publish のたびに配信せず、evalLater で 1 回にまとめる。
+   * 同じターンに届いた複数の通知は 1 回の走査で各購読者へ送られる。
+   */
+  void scheduleDelivery() {
+    if (delivery_scheduled_) return;
+    delivery_scheduled_ = true;
+    task_set_->add(kj::evalLater([this]() {
+      delivery_scheduled_ = false;
+      deliverAll();
+    }));
+  }
 
+  /**
+   * @brief 全購読者に未配信の通知を送る
+   */
+  void deliverAll() {
     // アクティブな購読をクリーンアップ
     subscriptions_.erase(
         std::remove_if(
@@ -129,123 +1032,1018 @@ class PollingNotifierImpl final : public PollingNotifier::Server {
             }),
         subscriptions_.end());
 
-    LOG_COUT << "[Server] Active subscriptions: " << subscriptions_.size()
-             << std::endl;
-
     // 各購読者に通知を送信
+    // （遅れによる追い出しで subscriptions_ が変わるため複製を走査する）
     kj::Vector<kj::Promise<void>> promises;
+    const auto snapshot = subscriptions_;
 
-    for (auto& weak_state : subscriptions_) {
+    for (auto& weak_state : snapshot) {
       auto state = weak_state.lock();
       if (!state || state->cancelled.load()) continue;
+      deliver(state, promises);
+    }
+
+    /**
+     * @brief アクティブな購読が存在しない場合の処理
+     * @details 送信対象となる購読者がいない場合は何もしない
+     */
+    if (promises.size() == 0) return;
 
-      /**
-       * @brief 購読者への通知送信ログを出力
-       */
-      LOG_COUT << "[Server] Sending notification to a subscriber..."
+    /**
+     * @brief 全ての通知送信プロミスを結合して TaskSet に登録
+     * @details 送信完了を待たずに戻るため、遅い購読者が他の配信を止めない
+     */
+    task_set_->add(kj::joinPromises(promises.releaseAsArray()));
+  }
+
+  /**
+   * @brief 購読者 1 件分の未配信通知を送る
+   * @details カーソル以降の未配信エントリを順に送る（再開時はログから再送）。
+   * atLeastOnce では未 ack ウィンドウ、フロー制御ありではクレジットの
+   * 残りまでしか送らない。
+   * @param state    送信先の購読状態
+   * @param promises 送信プロミスの追加先
+   */
+  void deliver(const std::shared_ptr<PollingSubscriptionState>& state_ptr,
+               kj::Vector<kj::Promise<void>>& promises) {
+    auto& state = *state_ptr;
+    if (state.next_id < log_.firstId()) {
+      LOG_COUT << "[Server] Subscriber fell behind the log, skipping "
+               << log_.firstId() - state.next_id << " notifications"
                << std::endl;
+      state.next_id = log_.firstId();
+    }
 
-      /**
-       * @brief 通知データを作成
-       * @details サーバーからクライアントへ送信する通知メッセージを構築
-       * - 一意のID（カウンター）を設定
-       * - 現在のタイムスタンプを設定
-       * - 通知の種類を設定
-       */
-      auto req = state->receiver.onNotificationRequest();
-      auto notification = req.initNotification();
-      notification.setId(notification_counter_++);
-
-      auto ts = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    std::chrono::system_clock::now().time_since_epoch())
-                    .count();
-      notification.setTimestamp(ts);
-      notification.setKind("polling_demo");
-
-      /**
-       * @brief 作成された通知データの詳細をログ出力
-       */
-      LOG_COUT << "[Server] Notification created: id=" << notification.getId()
-               << ", timestamp=" << notification.getTimestamp() << std::endl;
-
-      /**
-       * @brief 非同期で通知を送信
-       * @details
-       * - req.send()で非同期送信を開始
-       * - then()で送信成功時の処理を定義
-       * - catch_()で送信失敗時のエラーハンドリングを定義
-       * @return kj::Promise<void> 送信完了を示すプロミス
-       */
-      auto promise = req.send()
-                         .then([](auto&&) {
-                           LOG_COUT
-                               << "[Server] Notification sent successfully."
-                               << std::endl;
-                         })
-                         .catch_([](kj::Exception&& e) {
-                           LOG_COUT << "[Server] Failed to send notification: "
-                                    << e.getDescription().cStr() << std::endl;
-                         });
-
-      promises.add(kj::mv(promise));
+    skipUnmatched(state);
+    if (!applySlowConsumerPolicy(state_ptr)) return;
+
+    if (state.delivery == DeliveryMode::AT_LEAST_ONCE) {
+      redeliverExpired(state, promises);
+    }
+
+    if (state.batch_max > 0) {
+      deliverBatched(state_ptr, promises);
+      return;
     }
 
+    const auto budget = windowBudget(state);
+    if (budget == 0) return;
+
+    const auto entries = selectEntries(state, budget);
+    if (entries.empty()) return;
+
     /**
-     * @brief アクティブな購読が存在しない場合の処理
-     * @details 送信対象となる購読者がいない場合は即座に完了を返す
+     * @brief 購読者への通知送信ログを出力
      */
-    if (promises.size() == 0) {
-      LOG_COUT << "[Server] No active subscriptions to send notifications to."
-               << std::endl;
-      return kj::READY_NOW;
+    LOG_COUT << "[Server] Sending notification to a subscriber..."
+             << std::endl;
+
+    announceKinds(state, entries);
+    announceDictionaries(state, entries);
+    if (state.lite) {
+      for (const auto& selected : entries) markSent(state, *selected.entry);
+      const auto sent_at = timer_ptr_->now();
+      promises.add(
+          state.canceler.wrap(sendLite(state, entries))
+              .then([this, weak = state.weak_from_this(), sent_at]() {
+                if (auto s = weak.lock()) {
+                  recordRtt(*s, timer_ptr_->now() - sent_at);
+                }
+              })
+              .catch_([this, weak = state.weak_from_this()](
+                          kj::Exception&& e) { onSendFailed(weak, e); }));
+      return;
+    }
+    for (const auto& selected : entries) {
+      markSent(state, *selected.entry);
+      promises.add(sendEntry(state, *selected.entry, selected.filter_index));
+    }
+  }
+
+  /**
+   * @brief カーソルをフィルタに一致しないエントリの先まで進める
+   * @details 一致しないエントリは送らないので配信は変わらない。遅れの
+   * 計測やバッチの判断で、同じエントリを毎回見直さずに済む
+   * @param state 対象の購読状態
+   */
+  void skipUnmatched(PollingSubscriptionState& state) {
+    auto cursor = log_.nextId();
+    log_.scanFrom(state.next_id, [&](const LogEntry& entry) {
+      if (state.match(entry) == FilterSet::kNoMatch) return true;
+      cursor = entry.id;
+      return false;
+    });
+    state.next_id = std::max(state.next_id, cursor);
+  }
+
+  /// フィルタに一致した未配信のエントリ
+  struct Matched {
+    uint64_t count = 0;   ///< 件数（limit で打ち切る）
+    uint64_t oldest = 0;  ///< 最古のものの id（なければ 0）
+  };
+
+  /**
+   * @brief from 以降でフィルタに一致したエントリを数える
+   * @details 判断に足りる limit 件で打ち切るので、遅れが大きくても
+   * 走査はその件数分の一致で止まる
+   * @param state 対象の購読状態
+   * @param from  数え始める id
+   * @param limit 数える上限
+   */
+  Matched countMatched(PollingSubscriptionState& state, uint64_t from,
+                       uint64_t limit) {
+    Matched matched;
+    if (limit == 0) return matched;
+    log_.scanFrom(from, [&](const LogEntry& entry) {
+      if (state.match(entry) == FilterSet::kNoMatch) return true;
+      if (matched.count++ == 0) matched.oldest = entry.id;
+      return matched.count < limit;
+    });
+    return matched;
+  }
+
+  /**
+   * @brief 購読者の遅れを計測する
+   * @details 購読より前に発行された通知（fromId での再開の追いつき）は
+   * 数えない。古い通知の再送で即座に降格・追い出しされないよう、
+   * 購読者にとって未配信になってからの遅れだけを見る。
+   * フィルタに一致しない通知は送らないので数えない。クレジット切れで
+   * 送れずにいる通知も、購読者が止めているだけなので数えない
+   * - 件数: カーソル以降で一致した未配信（送れる分）＋未 ack の通知
+   * - 経過: 最古の未 ack（または数えた未配信）通知が発行されてからの時間
+   * - RTT: 送信の往復時間の移動平均
+   */
+  struct Lag {
+    uint64_t depth;
+    kj::Duration age;
+    kj::Duration rtt;
+  };
+
+  Lag measureLag(PollingSubscriptionState& state) {
+    const auto cursor = std::max(state.next_id, state.catch_up_until);
+    const auto first_new = std::lower_bound(
+        state.unacked.begin(), state.unacked.end(), state.catch_up_until,
+        [](const PollingSubscriptionState::Unacked& u, uint64_t id) {
+          return u.id < id;
+        });
+    // 追い出しの閾値まで数えれば判断できる
+    uint64_t sendable = slow_policy_.evict_queue_depth;
+    if (state.flow_controlled) {
+      sendable = std::min<uint64_t>(sendable, state.credits);
+    }
+    const auto undelivered = countMatched(state, cursor, sendable);
+    Lag lag{undelivered.count +
+                static_cast<uint64_t>(state.unacked.end() - first_new),
+            0 * kj::MILLISECONDS, state.rtt};
+    const auto oldest_id =
+        first_new == state.unacked.end() ? undelivered.oldest : first_new->id;
+    if (const auto* oldest = log_.find(oldest_id)) {
+      lag.age = std::max<int64_t>(0, nowMillis() - oldest->timestamp) *
+                kj::MILLISECONDS;
+    }
+    return lag;
+  }
+
+  /**
+   * @brief 遅れに応じて購読を降格・復帰・追い出しする
+   * @details 判断のたびにログと統計に記録する。降格後、遅れが閾値の 1/4
+   * まで縮んだら通常の配信に戻す。atLeastOnce の購読は間引くと約束した
+   * 通知を飛ばすことになる（受信側も飛んだ分を replay で取り直す）ので
+   * 降格しない。追い出すか、そのままにする。
+   * @param state_ptr 対象の購読状態
+   * @return bool 追い出した場合 false
+   */
+  bool applySlowConsumerPolicy(
+      const std::shared_ptr<PollingSubscriptionState>& state_ptr) {
+    using Action = SlowConsumerPolicy::Action;
+    using Level = PollingSubscriptionState::Level;
+    auto& state = *state_ptr;
+    const auto& policy = slow_policy_;
+    const auto lag = measureLag(state);
+
+    max_queue_depth_ = std::max(max_queue_depth_, lag.depth);
+    max_pending_age_ = std::max(max_pending_age_, lag.age);
+    max_rtt_ = std::max(max_rtt_, lag.rtt);
+
+    const bool must_evict = lag.depth >= policy.evict_queue_depth ||
+                            lag.age >= policy.evict_pending_age;
+    const bool lagging = lag.depth >= policy.demote_queue_depth ||
+                         lag.age >= policy.demote_pending_age ||
+                         lag.rtt >= policy.demote_rtt;
+
+    if (must_evict || (lagging && policy.demote_action == Action::EVICT)) {
+      LOG_COUT << "[SlowConsumer] evict: depth=" << lag.depth
+               << ", ageMs=" << lag.age / kj::MILLISECONDS
+               << ", rttUs=" << lag.rtt / kj::MICROSECONDS << std::endl;
+      ++lag_evictions_;
+      notifyClosed(state, "consumer too slow");
+      removeSubscription(state_ptr);
+      return false;
+    }
+
+    const bool may_demote = state.delivery != DeliveryMode::AT_LEAST_ONCE;
+    if (lagging && may_demote && state.level == Level::FULL &&
+        policy.demote_action != Action::NONE) {
+      state.level = policy.demote_action == Action::SAMPLE ? Level::SAMPLED
+                                                           : Level::CONFLATED;
+      ++demotions_;
+      LOG_COUT << "[SlowConsumer] demote to "
+               << (state.level == Level::SAMPLED ? "sampled" : "conflated")
+               << ": depth=" << lag.depth
+               << ", ageMs=" << lag.age / kj::MILLISECONDS
+               << ", rttUs=" << lag.rtt / kj::MICROSECONDS << std::endl;
+    } else if (!lagging && state.level != Level::FULL &&
+               lag.depth < policy.demote_queue_depth / 4 &&
+               lag.age < policy.demote_pending_age / 4) {
+      state.level = Level::FULL;
+      ++restorations_;
+      LOG_COUT << "[SlowConsumer] restore full delivery: depth=" << lag.depth
+               << ", skipped=" << state.skipped << std::endl;
+    }
+    return true;
+  }
+
+  /**
+   * @brief フィルタと配信の粒度に従って、次に送るエントリを選ぶ
+   * @details フィルタに一致しないエントリと、間引いたエントリの分も
+   * カーソルを進める。返すポインタはログに次の追記があるまで有効。
+   * - FULL: 一致したものをカーソルから順に budget 件
+   * - CONFLATED: 一致した未配信のうち種類ごとに最新の 1 件
+   * - SAMPLED: sample_every 件に 1 件と、一致した未配信の最新 1 件
+   * @param state  対象の購読状態
+   * @param budget 選ぶ最大件数
+   * @return std::vector<Selected> 送るエントリ（id 昇順）
+   */
+  std::vector<Selected> selectEntries(PollingSubscriptionState& state,
+                                      size_t budget) {
+    using Level = PollingSubscriptionState::Level;
+    std::vector<Selected> selected;
+    if (budget == 0 || state.next_id >= log_.nextId()) return selected;
+
+    if (state.level == Level::FULL) {
+      auto cursor = log_.nextId();
+      log_.scanFrom(state.next_id, [&](const LogEntry& entry) {
+        const auto index = state.match(entry);
+        if (index == FilterSet::kNoMatch) return true;
+        if (selected.size() == budget) {
+          cursor = entry.id;  // 残りは次回に回す
+          return false;
+        }
+        selected.push_back({&entry, static_cast<uint32_t>(index)});
+        return true;
+      });
+      state.next_id = cursor;
+      return selected;
+    }
+
+    std::vector<Selected> pending;
+    log_.scanFrom(state.next_id, [&](const LogEntry& entry) {
+      const auto index = state.match(entry);
+      if (index != FilterSet::kNoMatch) {
+        pending.push_back({&entry, static_cast<uint32_t>(index)});
+      }
+      return true;
+    });
+
+    std::vector<bool> keep(pending.size(), false);
+    if (state.level == Level::CONFLATED) {
+      // 後ろから見て、種類ごとに最初に現れたもの（＝最新）を残す
+      std::unordered_set<std::string> seen;
+      for (size_t i = pending.size(); i-- > 0;) {
+        keep[i] = seen.insert(pending[i].entry->kind).second;
+      }
+    } else {
+      const auto every = std::max<uint32_t>(1, slow_policy_.sample_every);
+      for (size_t i = 0; i < pending.size(); ++i) {
+        keep[i] = pending[i].entry->id % every == 0 || i + 1 == pending.size();
+      }
+    }
+
+    auto cursor = log_.nextId();
+    size_t examined = 0;
+    for (size_t i = 0; i < pending.size(); ++i) {
+      if (keep[i]) {
+        if (selected.size() == budget) {
+          cursor = pending[i].entry->id;  // 残りは次回に回す
+          break;
+        }
+        selected.push_back(pending[i]);
+      }
+      ++examined;
+    }
+    state.skipped += examined - selected.size();
+    state.next_id = cursor;
+    return selected;
+  }
+
+  /**
+   * @brief ack ウィンドウとクレジットから、今すぐ送ってよい件数を求める
+   *
+   * @param state 対象の購読状態
+   */
+  size_t windowBudget(const PollingSubscriptionState& state) const {
+    size_t budget = state.sendBudget(log_.size());
+    if (state.delivery == DeliveryMode::AT_LEAST_ONCE) {
+      budget = std::min(budget, kMaxUnacked - std::min(kMaxUnacked,
+                                                       state.unacked.size()));
+    }
+    return budget;
+  }
+
+  /**
+   * @brief 送信した通知を ack ウィンドウとクレジットに反映する
+   */
+  void markSent(PollingSubscriptionState& state, const LogEntry& entry) {
+    if (state.delivery == DeliveryMode::AT_LEAST_ONCE) {
+      state.unacked.push_back({entry.id, timer_ptr_->now()});
+    }
+    if (state.flow_controlled) --state.credits;
+  }
+
+  /**
+   * @brief 未送信の通知をまとめて onNotifications で送る
+   * @details 次のいずれかでフラッシュする。
+   * - 送信中のバッチがない（低負荷時はためずに即送る）
+   * - 未送信数が目標バッチサイズに達した
+   * - 最古の未送信通知が遅延上限に達した（タイマーで保証）
+   *
+   * 目標バッチサイズは「1 RTT の間にたまった件数」の移動平均で、
+   * 到着レート × RTT に追従する。高負荷ほど大きなバッチになる。
+   * 件数はフィルタに一致したものだけを数える（一致の少ない購読が
+   * 小さなバッチを早く送り出さないように）。
+   * @param state_ptr 送信先の購読状態
+   * @param promises  送信プロミスの追加先
+   */
+  void deliverBatched(
+      const std::shared_ptr<PollingSubscriptionState>& state_ptr,
+      kj::Vector<kj::Promise<void>>& promises) {
+    auto& state = *state_ptr;
+    // 目標に届いたかどうかが分かれば足りるので、その件数で打ち切る
+    const auto pending =
+        countMatched(state, state.next_id, state.batch_target).count;
+    if (pending == 0) {
+      state.has_pending = false;
+      return;
+    }
+
+    const auto now = timer_ptr_->now();
+    if (!state.has_pending) {
+      state.has_pending = true;
+      state.pending_since = now;
+    }
+
+    const bool idle = state.batches_inflight == 0;
+    const bool full = pending >= state.batch_target;
+    const bool late = now - state.pending_since >= state.latency_budget;
+    if (!idle && !full && !late) {
+      armFlushTimer(state_ptr);
+      return;
+    }
+
+    const auto entries = selectEntries(
+        state, std::min<size_t>(windowBudget(state), state.batch_max));
+    if (entries.empty()) return;
+
+    announceKinds(state, entries);
+    announceDictionaries(state, entries);
+    for (const auto& selected : entries) markSent(state, *selected.entry);
+    auto sent = state.lite            ? sendLite(state, entries)
+                : state.delta_batches ? sendDeltaBatch(state, entries)
+                                      : sendBatch(state, entries);
+    state.has_pending = countMatched(state, state.next_id, 1).count > 0;
+    state.pending_since = now;
+    ++state.batches_inflight;
+
+    std::weak_ptr<PollingSubscriptionState> weak = state_ptr;
+    promises.add(state.canceler.wrap(kj::mv(sent))
+                     .then([this, weak, now]() {
+                       auto s = weak.lock();
+                       if (!s) return;
+                       --s->batches_inflight;
+                       onBatchDelivered(s, timer_ptr_->now() - now);
+                     })
+                     .catch_([this, weak](kj::Exception&& e) {
+                       if (auto s = weak.lock()) --s->batches_inflight;
+                       onSendFailed(weak, e);
+                     }));
+  }
+
+  /**
+   * @brief 選んだエントリを 1 回の onNotifications で送る
+   *
+   * @param state   送信先の購読状態
+   * @param entries 送るエントリ（id 昇順）
+   * @return kj::Promise<void> 応答で完了するプロミス
+   */
+  kj::Promise<void> sendBatch(PollingSubscriptionState& state,
+                              const std::vector<Selected>& entries) {
+    auto req = state.receiver.onNotificationsRequest();
+    auto list = req.initNotifications(static_cast<uint32_t>(entries.size()));
+    uint32_t i = 0;
+    for (const auto& selected : entries) {
+      auto notification = list[i++];
+      selected.entry->fill(notification, !state.intern_kinds,
+                           payloadForm(state, *selected.entry));
+      notification.setFilterIndex(selected.filter_index);
+    }
+    auto sent = req.send().ignoreResult();
+    queueChunks(state, entries);
+    return sent;
+  }
+
+  /**
+   * @brief 選んだエントリを 1 回の onDeltaBatch で送る
+   * @details id・timestamp・kindSeq を差分でビット詰めする。差分が 32 bit に
+   * 収まらないバッチと、受信側が引けない kindId（maxKindIds 以上）を含む
+   * バッチは onNotifications で送る
+   * @param state   送信先の購読状態
+   * @param entries 送るエントリ（id 昇順）
+   * @return kj::Promise<void> 応答で完了するプロミス
+   */
+  kj::Promise<void> sendDeltaBatch(PollingSubscriptionState& state,
+                                   const std::vector<Selected>& entries) {
+    const auto count = static_cast<uint32_t>(entries.size());
+    std::vector<uint64_t> ids, timestamps, kind_seqs;
+    ids.reserve(count);
+    timestamps.reserve(count);
+    kind_seqs.reserve(count);
+    std::vector<PayloadForm> forms;
+    forms.reserve(count);
+    bool has_payload = false;
+    bool has_compressed = false;
+    bool has_blob = false;
+    bool has_chunked = false;
+    bool has_registered = false;
+    for (const auto& selected : entries) {
+      if (selected.entry->kind_id >= MAX_KIND_IDS) {
+        return sendBatch(state, entries);
+      }
+      ids.push_back(selected.entry->id);
+      timestamps.push_back(static_cast<uint64_t>(selected.entry->timestamp));
+      kind_seqs.push_back(selected.entry->kind_seq);
+      forms.push_back(payloadForm(state, *selected.entry));
+      has_payload = has_payload || selected.entry->rawPayload().size() > 0;
+      has_compressed =
+          has_compressed || forms.back() == PayloadForm::COMPRESSED;
+      has_blob = has_blob || forms.back() == PayloadForm::BLOB;
+      has_chunked = has_chunked || forms.back() == PayloadForm::CHUNKED;
+      has_registered =
+          has_registered || selected.entry->registered(forms.back());
+    }
+
+    auto req = state.receiver.onDeltaBatchRequest();
+    auto batch = req.initBatch();
+    batch.setCount(count);
+    if (!DeltaColumnCodec::encode(batch.initIds(), ids) ||
+        !DeltaColumnCodec::encode(batch.initTimestamps(), timestamps) ||
+        !DeltaColumnCodec::encode(batch.initKindSeqs(), kind_seqs)) {
+      return sendBatch(state, entries);
+    }
+    auto kind_ids = batch.initKindIds(count);
+    auto filters = batch.initFilterIndexes(count);
+    for (uint32_t i = 0; i < count; ++i) {
+      kind_ids.set(i, entries[i].entry->kind_id);
+      filters.set(i, static_cast<uint16_t>(entries[i].filter_index));
+    }
+    if (has_payload) {
+      auto payloads = batch.initPayloads(count);
+      for (uint32_t i = 0; i < count; ++i) {
+        const auto bytes = entries[i].entry->payloadBytes(forms[i]);
+        if (bytes.size() > 0) payloads.set(i, bytes);
+      }
+    }
+    if (has_compressed) {
+      auto dictionaries = batch.initPayloadDictionaries(count);
+      for (uint32_t i = 0; i < count; ++i) {
+        if (forms[i] == PayloadForm::COMPRESSED) {
+          dictionaries.set(i, entries[i].entry->dictionary_id);
+        }
+      }
+    }
+    if (has_blob) {
+      auto blobs = batch.initPayloadBlobs(count);
+      for (uint32_t i = 0; i < count; ++i) {
+        blobs.set(i, forms[i] == PayloadForm::BLOB);
+      }
+    }
+    if (has_chunked) {
+      auto chunked = batch.initPayloadChunked(count);
+      for (uint32_t i = 0; i < count; ++i) {
+        if (forms[i] == PayloadForm::CHUNKED) {
+          chunked.set(i, entries[i].entry->rawPayload().size());
+        }
+      }
+    }
+    if (has_registered) {
+      auto registered = batch.initPayloadRegistered(count);
+      for (uint32_t i = 0; i < count; ++i) {
+        registered.set(i, entries[i].entry->registered(forms[i]));
+      }
+    }
+    auto sent = req.send().ignoreResult();
+    queueChunks(state, entries);
+    return sent;
+  }
+
+  /**
+   * @brief 選んだエントリを NotificationLite のリストで onLite に送る
+   * @details ペイロードが litePayloadBytes を超えるエントリだけは
+   * onNotification で送る。タイムスタンプがまとめる範囲の先頭より前の
+   * エントリ（差分が負になる）は、そこから新しい onLite に分ける。
+   * 同じ receiver への呼び出しは送った順に届くので、分けて送っても
+   * id の順序は保たれる。
+   * @param state   送信先の購読状態
+   * @param entries 送るエントリ（id 昇順）
+   * @return kj::Promise<void> すべての応答で完了するプロミス
+   */
+  kj::Promise<void> sendLite(PollingSubscriptionState& state,
+                             const std::vector<Selected>& entries) {
+    kj::Vector<kj::Promise<void>> sent;
+    for (size_t i = 0; i < entries.size();) {
+      if (!entries[i].entry->fitsLite()) {
+        auto req = state.receiver.onNotificationRequest();
+        auto notification = req.initNotification();
+        entries[i].entry->fill(notification, false,
+                               payloadForm(state, *entries[i].entry));
+        notification.setFilterIndex(entries[i].filter_index);
+        sent.add(req.send().ignoreResult());
+        queueChunks(state, *entries[i].entry);
+        ++i;
+        continue;
+      }
+      // 埋め込める通知が続く範囲を 1 回の onLite にまとめる
+      const auto base = entries[i].entry->timestamp;
+      auto end = i;
+      while (end < entries.size() && entries[end].entry->fitsLite(base)) {
+        ++end;
+      }
+      auto req = state.receiver.onLiteRequest();
+      req.setBaseTimestamp(base);
+      auto list = req.initNotifications(static_cast<uint32_t>(end - i));
+      for (uint32_t k = 0; i < end; ++i, ++k) {
+        entries[i].entry->fillLite(list[k], base);
+        list[k].setFilterIndex(static_cast<uint16_t>(entries[i].filter_index));
+      }
+      sent.add(req.send().ignoreResult());
     }
+    return kj::joinPromises(sent.releaseAsArray());
+  }
+
+  /**
+   * @brief バッチの応答を受けて RTT と目標バッチサイズを更新する
+   *
+   * @param state 対象の購読状態
+   * @param rtt   今回のバッチの往復時間
+   */
+  void onBatchDelivered(const std::shared_ptr<PollingSubscriptionState>& state,
+                        kj::Duration rtt) {
+    recordRtt(*state, rtt);
+
+    // 応答待ちの間にたまった（フィルタに一致した）件数 ≒ 到着レート × RTT
+    const auto accumulated = static_cast<uint32_t>(
+        countMatched(*state, state->next_id, state->batch_max).count);
+    state->batch_target =
+        std::max<uint32_t>(1, (state->batch_target * 3 + accumulated) / 4);
+
+    // たまっていた分をすぐに送る
+    deliverNow(state);
+  }
+
+  /**
+   * @brief 送信 RTT の移動平均を更新する
+   */
+  static void recordRtt(PollingSubscriptionState& state, kj::Duration rtt) {
+    state.rtt = state.rtt == 0 * kj::MILLISECONDS ? rtt
+                                                   : (state.rtt * 7 + rtt) / 8;
+  }
+
+  /**
+   * @brief 最古の未送信通知が遅延上限に達した時点でフラッシュする
+   *
+   * @param state_ptr 対象の購読状態
+   */
+  void armFlushTimer(
+      const std::shared_ptr<PollingSubscriptionState>& state_ptr) {
+    auto& state = *state_ptr;
+    if (state.flush_timer_armed) return;
+    state.flush_timer_armed = true;
+
+    std::weak_ptr<PollingSubscriptionState> weak = state_ptr;
+    task_set_->add(
+        state.canceler
+            .wrap(timer_ptr_->atTime(state.pending_since + state.latency_budget))
+            .then([this, weak]() {
+              auto s = weak.lock();
+              if (!s) return;
+              s->flush_timer_armed = false;
+              deliverNow(s);
+            })
+            .catch_([](kj::Exception&&) {
+              // 購読のキャンセルで取り消された
+            }));
+  }
+
+  /**
+   * @brief 分けて送るエントリの中身を、送信待ちに加える
+   * @details 通知（ヘッダー）を送った後に呼ぶ。中身はログではなく
+   * 共有の中身から読むので、送り終える前にログから捨てられてもよい
+   */
+  void queueChunks(PollingSubscriptionState& state, const LogEntry& entry) {
+    if (payloadForm(state, entry) != PayloadForm::CHUNKED) return;
+    state.chunks.push_back({entry.id, entry.blob.blob});
+    pumpChunks(state);
+  }
+
+  void queueChunks(PollingSubscriptionState& state,
+                   const std::vector<Selected>& entries) {
+    if (state.chunk_bytes == 0) return;
+    for (const auto& selected : entries) queueChunks(state, *selected.entry);
+  }
+
+  /**
+   * @brief 送信待ちの中身を onPayloadChunk で 1 つずつ送る
+   * @details onPayloadChunk は stream メソッドなので、フロー制御の窓が
+   * 空くと送信が完了し、次の断片を送る。断片の間にはその間に発行された
+   * 通知の呼び出しが入るので、小さな通知は大きな中身を待たない。
+   * 中身は最後の断片の送信が完了してから送信待ちから外す。
+   * stream メソッドの呼び出しが 1 度失敗すると同じ capability への以降の
+   * 呼び出しもすべて失敗するので、失敗したらこの購読では分割をやめ、
+   * 送信待ちを捨てる。ack されていない通知は再送のときに分けずに送る
+   * @param state 送信先の購読状態
+   */
+  void pumpChunks(PollingSubscriptionState& state) {
+    if (state.chunk_in_flight || state.chunks.empty()) return;
+    auto& pending = state.chunks.front();
+    const auto& bytes = pending.blob->bytes;
+    const auto size =
+        std::min<size_t>(state.chunk_bytes, bytes.size() - pending.offset);
+    const auto id = pending.id;
+    auto req = state.receiver.onPayloadChunkRequest();
+    req.setId(id);
+    req.setOffset(pending.offset);
+    req.setData(kj::arrayPtr(bytes.data() + pending.offset, size));
+    pending.offset += size;
+
+    state.chunk_in_flight = true;
+    task_set_->add(
+        state.canceler.wrap(req.send())
+            .then([this, weak = state.weak_from_this()]() {
+              auto s = weak.lock();
+              if (!s) return;
+              s->chunk_in_flight = false;
+              // 送信中は先頭を外さないので、先頭が今送った中身
+              const auto& front = s->chunks.front();
+              if (front.offset == front.blob->bytes.size()) {
+                s->chunks.pop_front();
+              }
+              pumpChunks(*s);
+            })
+            .catch_([this, weak = state.weak_from_this(),
+                     id](kj::Exception&& e) {
+              onSendFailed(weak, e);
+              auto s = weak.lock();
+              if (!s || s->cancelled.load()) return;
+              LOG_COUT << "[Server] Payload chunk for id=" << id
+                       << " failed, sending payloads unsplit from now on"
+                       << std::endl;
+              s->chunk_bytes = 0;
+              s->chunks.clear();
+              s->chunk_in_flight = false;
+            }));
+  }
+
+  /**
+   * @brief 1 件の通知を購読者に送る
+   *
+   * @param state        送信先の購読状態
+   * @param entry        送信するエントリ
+   * @param filter_index 一致したフィルタの番号
+   * @return kj::Promise<void> 送信完了を示すプロミス
+   */
+  kj::Promise<void> sendEntry(PollingSubscriptionState& state,
+                              const LogEntry& entry, uint32_t filter_index) {
+    auto req = state.receiver.onNotificationRequest();
+    auto notification = req.initNotification();
+    entry.fill(notification, !state.intern_kinds,
+               payloadForm(state, entry));
+    notification.setFilterIndex(filter_index);
 
     /**
-     * @brief 全ての通知送信プロミスを結合して完了を待機
+     * @brief 非同期で通知を送信
      * @details
-     * - joinPromises()で全ての送信プロミスを並行実行
-     * - then()で全送信完了後の処理を定義
-     * @return kj::Promise<void> 全通知送信完了を示すプロミス
+     * - req.send()で非同期送信を開始
+     * - then()で送信成功時の処理を定義
+     * - catch_()で送信失敗時のエラーハンドリングを定義
+     * @return kj::Promise<void> 送信完了を示すプロミス
      */
-    return kj::joinPromises(promises.releaseAsArray())
-        .then([]() -> kj::Promise<void> {
-          LOG_COUT << "[Server] All notifications sent successfully."
-                   << std::endl;
-          return kj::READY_NOW;
+    const auto sent_at = timer_ptr_->now();
+    auto sent = req.send().ignoreResult();
+    queueChunks(state, entry);
+    return state.canceler.wrap(kj::mv(sent))
+        .then([this, weak = state.weak_from_this(), sent_at]() {
+          LOG_COUT << "[Server] Notification sent successfully." << std::endl;
+          if (auto s = weak.lock()) recordRtt(*s, timer_ptr_->now() - sent_at);
+        })
+        .catch_([this, weak = state.weak_from_this()](kj::Exception&& e) {
+          onSendFailed(weak, e);
         });
   }
 
+  /**
+   * @brief 送信失敗時の処理
+   * @details 切断（DISCONNECTED）による失敗ならその購読を即座に追い出す。
+   * 以降の配信で同じ相手へのリクエストを作り続けないようにする。
+   * @param weak 送信先の購読状態
+   * @param e    発生した例外
+   */
+  void onSendFailed(const std::weak_ptr<PollingSubscriptionState>& weak,
+                    const kj::Exception& e) {
+    LOG_COUT << "[Server] Failed to send notification: "
+             << e.getDescription().cStr() << std::endl;
+    if (e.getType() != kj::Exception::Type::DISCONNECTED) return;
+    if (auto state = weak.lock()) {
+      if (!state->cancelled.load()) {
+        LOG_COUT << "[Server] Receiver disconnected, evicting subscription"
+                 << std::endl;
+        evictSubscription(state);
+      }
+    }
+  }
+
+  /**
+   * @brief ack されないままタイムアウトした通知を再送する
+   * @details ログから既に捨てられた通知は再送できないためウィンドウから外す
+   * @param state    対象の購読状態
+   * @param promises 送信プロミスの追加先
+   */
+  void redeliverExpired(PollingSubscriptionState& state,
+                        kj::Vector<kj::Promise<void>>& promises) {
+    const auto now = timer_ptr_->now();
+    for (auto it = state.unacked.begin(); it != state.unacked.end();) {
+      if (now - it->sent_at < kRedeliveryTimeout) {
+        ++it;
+        continue;
+      }
+      const auto* entry = log_.find(it->id);
+      if (entry == nullptr) {
+        LOG_COUT << "[Server] Unacked notification id=" << it->id
+                 << " is no longer in the log" << std::endl;
+        it = state.unacked.erase(it);
+        continue;
+      }
+      if (state.flow_controlled) {
+        // 再送もクレジットを消費する
+        if (state.credits == 0) break;
+        --state.credits;
+      }
+      LOG_COUT << "[Server] Redelivering id=" << it->id << std::endl;
+      it->sent_at = now;
+      ++state.redelivered;
+      const auto index = state.match(*entry);
+      promises.add(sendEntry(
+          state, *entry,
+          static_cast<uint32_t>(std::max(index, int32_t{0}))));
+      ++it;
+    }
+  }
+
+  /**
+   * @brief 同じイベントループのターン内の追記をまとめてから転送する
+   * @details publish のたびに 1 件ずつ送らず、evalLater で 1 回にまとめる
+   */
+  void schedulePumpReplicas() {
+    if (pump_scheduled_ || replicas_.empty()) return;
+    pump_scheduled_ = true;
+    task_set_->add(kj::evalLater([this]() {
+      pump_scheduled_ = false;
+      replicas_.erase(
+          std::remove_if(replicas_.begin(), replicas_.end(),
+                         [](const std::shared_ptr<ReplicaState>& r) {
+                           return r->cancelled.load();
+                         }),
+          replicas_.end());
+      for (auto& replica : replicas_) {
+        pumpReplica(replica);
+      }
+    }));
+  }
+
+  /**
+   * @brief フォロワーへ未送信のエントリをバッチで送る
+   * @details 応答を待たずに最大 kReplicationMaxInflight 個の append
+   * を投げておき、応答が返るたびに続きを送る。同一 capability
+   * への呼び出しは順序通りに届くため、フォロワー側の適用順は保たれる。
+   * @param replica 送信先のフォロワー
+   */
+  void pumpReplica(const std::shared_ptr<ReplicaState>& replica) {
+    while (!replica->cancelled.load() &&
+           replica->inflight < kReplicationMaxInflight &&
+           replica->next_id < log_.nextId()) {
+      if (replica->next_id < log_.firstId()) {
+        LOG_COUT << "[Replication] replica fell behind the log, dropping"
+                 << std::endl;
+        replica->cancelled.store(true);
+        return;
+      }
+
+      const auto count = static_cast<uint32_t>(std::min<uint64_t>(
+          log_.nextId() - replica->next_id, kReplicationBatchSize));
+      auto req = replica->sink.appendRequest();
+      auto entries = req.initEntries(count);
+      uint32_t i = 0;
+      log_.forEachFrom(replica->next_id, count,
+                       [&](const LogEntry& entry) { entry.fill(entries[i++]); });
+      replica->next_id += count;
+      sendToReplica(replica, kj::mv(req), replica->next_id);
+    }
+  }
+
+  /**
+   * @brief 待機中の append がないフォロワーに空のバッチを送る
+   * @details フォロワーはこれでリーダーの生存を確認する
+   */
+  void sendReplicationHeartbeats() {
+    for (auto& replica : replicas_) {
+      if (replica->cancelled.load() || replica->inflight > 0) continue;
+      auto req = replica->sink.appendRequest();
+      req.initEntries(0);
+      sendToReplica(replica, kj::mv(req), replica->next_id);
+    }
+  }
+
+  /**
+   * @brief フォロワーへ append を送り、応答の nextId に合わせて続きを送る
+   * @details フォロワーが既に持っていれば先へ飛ばし、end まで適用できて
+   * いなければ（欠けがあった）nextId から送り直す
+   * @param end このバッチを適用した後にフォロワーが期待するはずの id
+   */
+  void sendToReplica(const std::shared_ptr<ReplicaState>& replica,
+                     capnp::Request<ReplicationSink::AppendParams,
+                                    ReplicationSink::AppendResults>&& req,
+                     uint64_t end) {
+    ++replica->inflight;
+    std::weak_ptr<ReplicaState> weak = replica;
+    auto promise = req.send()
+                       .then([this, weak, end](auto&& resp) {
+                         auto r = weak.lock();
+                         if (!r) return;
+                         --r->inflight;
+                         const auto expected = resp.getNextId();
+                         if (expected > r->next_id || expected < end) {
+                           r->next_id = expected;
+                         }
+                         pumpReplica(r);
+                       })
+                       .catch_([weak](kj::Exception&& e) {
+                         LOG_COUT << "[Replication] append failed: "
+                                  << e.getDescription().cStr() << std::endl;
+                         if (auto r = weak.lock()) r->cancelled.store(true);
+                       });
+    task_set_->add(kj::mv(promise));
+  }
+
   kj::Timer* timer_ptr_ =
       nullptr;  ///< 定期実行用タイマーオブジェクトへのポインタ
   kj::TaskSet* task_set_ = nullptr;
   std::vector<std::weak_ptr<PollingSubscriptionState>> subscriptions_;
-  uint64_t notification_counter_ = 0;
+  uint64_t evicted_subscriptions_ = 0;  ///< 切断検出で追い出した購読数
+
+  SlowConsumerPolicy slow_policy_;
+  uint64_t demotions_ = 0;      ///< 間引き配信への降格回数
+  uint64_t restorations_ = 0;   ///< 通常配信への復帰回数
+  uint64_t lag_evictions_ = 0;  ///< 遅れによる追い出し回数
+  uint64_t max_queue_depth_ = 0;
+  kj::Duration max_pending_age_ = 0 * kj::MILLISECONDS;
+  kj::Duration max_rtt_ = 0 * kj::MILLISECONDS;
+  NotificationLog log_;  ///< 直近の通知（再開・レプリケーション用）
+  PayloadDictionaryTrainer dictionaries_;  ///< kind ごとのペイロード辞書
+  BlobStore blobs_;  ///< 大きなペイロードの中身（ハッシュで共有）
+
+  /// id の系列のエポック（起動ごとに変わる。フォロワーはリーダーのもの）
+  uint64_t epoch_ = newEpoch();
+  bool is_leader_ = true;  ///< false ならフォロワーとして複製を受ける
+  kj::TimePoint last_leader_contact_ = kj::origin<kj::TimePoint>();
+  kj::Maybe<PollingSubscription::Client> leader_subscription_;
+  std::vector<std::shared_ptr<ReplicaState>> replicas_;
+  bool pump_scheduled_ = false;
+  bool delivery_scheduled_ = false;  ///< 同じターンの配信を予約済みか
+  kj::Duration heartbeat_interval_ = 1 * kj::SECONDS;
 };
 
+PollingSubscriptionImpl::~PollingSubscriptionImpl() {
+  if (!state->cancelled.load()) {
+    LOG_COUT << "[PollingSubscription] released without cancel()\n";
+    notifier.removeSubscription(state);
+  }
+}
+
+kj::Promise<void> PollingSubscriptionImpl::cancel(CancelContext context) {
+  if (state->cancelled.load()) {
+    LOG_COUT << "[PollingSubscription] already cancelled\n";
+  } else {
+    LOG_COUT << "[PollingSubscription] cancel()\n";
+    notifier.removeSubscription(state);
+  }
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> PollingSubscriptionImpl::ack(AckContext context) {
+  state->ack(context.getParams().getUpToId());
+  // ウィンドウが空いた分をすぐに送る
+  notifier.deliverNow(state);
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> PollingSubscriptionImpl::grantCredits(
+    GrantCreditsContext context) {
+  state->grant(context.getParams().getCredits());
+  // 返却されたクレジットで tick を待たずに送り、パイプを埋めておく
+  notifier.deliverNow(state);
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> ReplicationSinkImpl::append(AppendContext ctx) {
+  const auto next_id = notifier.applyReplicated(ctx.getParams().getEntries());
+  ctx.getResults().setNextId(next_id);
+  return kj::READY_NOW;
+}
+
 //------------------------------------------------------------
 // main
 //------------------------------------------------------------
-int main() {
+int main(int argc, char* argv[]) {
   try {
+    uint32_t port = 5924;
+    const char* leader_address = nullptr;
+    int64_t publish_ms = 1000;
+    int64_t heartbeat_ms = 1000;
+    SlowConsumerPolicy slow_policy;
+    bool allow_packed = false;
+    for (int i = 1; i < argc; ++i) {
+      if (std::strcmp(argv[i], "--follow") == 0 && i + 1 < argc) {
+        leader_address = argv[++i];
+      } else if (std::strcmp(argv[i], "--publish-ms") == 0 && i + 1 < argc) {
+        publish_ms = std::stoll(argv[++i]);
+      } else if (std::strcmp(argv[i], "--heartbeat-ms") == 0 && i + 1 < argc) {
+        heartbeat_ms = std::stoll(argv[++i]);
+      } else if (std::strcmp(argv[i], "--slow-consumer") == 0 &&
+                 i + 1 < argc) {
+        const std::string action = argv[++i];
+        using Action = SlowConsumerPolicy::Action;
+        slow_policy.demote_action = action == "none"     ? Action::NONE
+                                    : action == "sample" ? Action::SAMPLE
+                                    : action == "evict"  ? Action::EVICT
+                                                         : Action::CONFLATE;
+      } else if (std::strcmp(argv[i], "--packed") == 0) {
+        allow_packed = true;
+      } else {
+        port = static_cast<uint32_t>(std::stoul(argv[i]));
+      }
+    }
+    // フォロワーはハートビートでリーダーの停止を検知して昇格する
+    KJ_REQUIRE(leader_address == nullptr || heartbeat_ms > 0,
+               "--heartbeat-ms must be positive for a follower");
+
     // PollingNotifierImpl を heap で生成してClientに変換
     auto notifierImpl = kj::heap<PollingNotifierImpl>();
     auto* notifierRaw = notifierImpl.get();
     auto notifierClient = PollingNotifier::Client(kj::mv(notifierImpl));
 
-    // EzRpcServer を起動
-    capnp::EzRpcServer server(kj::mv(notifierClient), "localhost", 5924);
+    // イベントループを用意し、接続ごとに枠付け方式を交渉して待ち受ける
+    auto io = kj::setupAsyncIo();
+    auto& network = io.provider->getNetwork();
+    auto listener =
+        network.parseAddress("localhost", port).wait(io.waitScope)->listen();
 
     // Timer を取得し、NotifierImpl に注入
-    auto& timer = server.getIoProvider().getTimer();
-    auto& ws = server.getWaitScope();
+    auto& timer = io.provider->getTimer();
+    auto& ws = io.waitScope;
     SimpleErrorHandler errorHandler;
     kj::TaskSet taskSet(errorHandler);
     notifierRaw->setTaskSet(taskSet);
+    notifierRaw->setHeartbeatInterval(heartbeat_ms * kj::MILLISECONDS);
+    notifierRaw->setSlowConsumerPolicy(slow_policy);
     notifierRaw->setTimer(timer);
+    notifierRaw->startDemoPublisher(publish_ms * kj::MILLISECONDS);
+
+    taskSet.add(serveNegotiated(*listener, notifierClient, allow_packed,
+                                taskSet));
+
+    // フォロワーとして起動する場合はリーダーへ接続して複製を開始
+    kj::Own<NegotiatedConnection> leader;
+    if (leader_address != nullptr) {
+      LOG_COUT << "Following leader at " << leader_address << '\n';
+      leader = NegotiatedConnection::connect(
+                   network, kj::str(leader_address), 5924,
+                   allow_packed ? WireFormat::PACKED : WireFormat::PLAIN)
+                   .wait(ws);
+      notifierRaw->follow(leader->bootstrap<PollingNotifier>());
+    }
 
     // ログ & イベントループ
-    auto port = server.getPort().wait(ws);
-    LOG_COUT << "Polling Notifier server started on port " << port << '\n';
+    auto actual_port = listener->getPort();
+    LOG_COUT << "Polling Notifier server started on port " << actual_port
+             << '\n';
 
     kj::NEVER_DONE.wait(ws);
   } catch (kj::Exception& e) {
@@ -0,0 +1,57 @@
+// resilient_client.cpp
+// 切断されても自動で再接続し、続きから購読を再開するクライアントの例
+// ネットワークの切断なら切断中の通知が再送される。polling_server を
+// 再起動するとログごと失われるので、エポックの変化を検知して受け取った
+// id を忘れ、再起動後のサーバーの通知を最初から受け取る
+//
+// 使い方:
+//   resilient_client [seconds] [--packed]
+//   --packed で packed 符号化の接続を希望する
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+
+#include <cstring>
+#include <resilient_session.hpp>
+#include <string>
+#include <utility.hpp>
+
+#include "schema/notification.capnp.h"
+
+int main(int argc, char* argv[]) {
+  try {
+    int seconds = 60;
+    ResilientSession::Options options;
+    for (int i = 1; i < argc; ++i) {
+      if (std::strcmp(argv[i], "--packed") == 0) {
+        options.format = WireFormat::PACKED;
+      } else {
+        seconds = std::stoi(argv[i]);
+      }
+    }
+
+    auto io = kj::setupAsyncIo();
+    auto& ws = io.waitScope;
+
+    ResilientSession session(
+        *io.provider, "localhost", 5924, {"polling_*", "sensor.*"},
+        [](Notification::Reader n) {
+          LOG_COUT << "[Client] id=" << n.getId()
+                   << ", kind=" << n.getKind().cStr() << std::endl;
+        },
+        options);
+
+    auto running = session.run();
+    io.provider->getTimer().afterDelay(seconds * kj::SECONDS).wait(ws);
+
+    session.stop();
+    running.wait(ws);
+    LOG_COUT << "[Client] lastId=" << session.getLastId()
+             << ", connects=" << session.getConnects()
+             << ", duplicates=" << session.getDuplicates() << std::endl;
+  } catch (kj::Exception& e) {
+    LOG_COUT << "Client exception: " << e.getDescription().cStr() << std::endl;
+  }
+
+  return 0;
+}